@@ -0,0 +1,225 @@
+#!/bin/bash
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation; either version 2 of
+# the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# General Public License for more details at
+# http://www.gnu.org/copyleft/gpl.html
+#
+#
+#
+# Routing benchmarks. Synthetic producer and consumer modules are
+# connected through mkapp in standard topologies:
+#  - chain:  producer -> relay (cat) -> ... -> consumer
+#  - fanout: producer -> N consumers
+#  - fanin:  N producers -> consumer
+#  - obey:   producer output obeyed as "write consumer ..." commands
+#  - listen: producer listened to, mkapp's standard output piped to the
+#            consumer
+#
+# Each consumer measures throughput (MB/s and messages/s) and message
+# latency percentiles. Results are written on standard output as a JSON
+# object, so that runs can be compared across commits.
+#
+# Usage: bench.sh [-n COUNT] [-s SIZE] [-r RATE] [-f N] [-l LENGTH]
+#                 [-L LOOPS] [TOPOLOGY...]
+#  -n COUNT   messages per run (default 100000)
+#  -s SIZE    bytes per message (default 100)
+#  -r RATE    messages per second per producer, 0 for unlimited (default 0)
+#  -f N       number of consumers/producers for fanout/fanin (default 4)
+#  -l LENGTH  number of relays in the chain (default 4)
+#  -L LOOPS   number of worker loops run by mkapp (default 0)
+#
+# The mkapp executable and library can be chosen with the MKAPP and
+# LIB_DIR environment variables.
+#
+
+set -e
+
+BENCH_DIR=$(cd "$(dirname "$0")" && pwd)
+MKAPP=${MKAPP:-$BENCH_DIR/../src/mkapp/mkapp}
+LIB_DIR=${LIB_DIR:-$BENCH_DIR/../src/libmkapp}
+PRODUCER=$BENCH_DIR/producer
+CONSUMER=$BENCH_DIR/consumer
+
+COUNT=100000
+SIZE=100
+RATE=0
+FAN=4
+LENGTH=4
+LOOPS=0
+
+while getopts "n:s:r:f:l:L:" OPT; do
+    case $OPT in
+        n) COUNT=$OPTARG ;;
+        s) SIZE=$OPTARG ;;
+        r) RATE=$OPTARG ;;
+        f) FAN=$OPTARG ;;
+        l) LENGTH=$OPTARG ;;
+        L) LOOPS=$OPTARG ;;
+        *) exit 1 ;;
+    esac
+done
+shift $((OPTIND - 1))
+
+TOPOLOGIES=${*:-chain fanout fanin obey listen}
+
+TMP=$(mktemp -d /tmp/mkbench.XXXXXX)
+
+cleanup() {
+    rm -rf "$TMP"
+}
+
+trap cleanup EXIT INT TERM
+
+export LD_LIBRARY_PATH="$LIB_DIR"
+
+
+# Print the commands defining a producer. It creates NAME.done when it has
+# written all its messages.
+producer() {
+    local NAME=$1
+    shift
+    echo "define $NAME sh -c \"$PRODUCER -s $SIZE -r $RATE $*;" \
+         ": > $TMP/$NAME.done\";"
+}
+
+# Print the commands defining a consumer writing its results to NAME.json.
+consumer() {
+    echo "define $1 $CONSUMER -o $TMP/$1.json;"
+}
+
+# Print the commands defining a relay. It creates NAME.done at end of file.
+relay() {
+    echo "define $1 sh -c \"cat; : > $TMP/$1.done\";"
+}
+
+# Wait until a module has created its NAME.done file, then print the
+# command reaping it. Since it has exited, waiting cannot block mkapp.
+finished() {
+    while [ ! -e "$TMP/$1.done" ]; do
+        sleep 0.01
+    done
+    echo "wait $1;"
+}
+
+
+chain() {
+    producer p -n "$COUNT"
+    consumer c
+    PREV=p
+    for ((I = 1; I <= LENGTH; I++)); do
+        relay "r$I"
+        echo "bind $PREV r$I;"
+        PREV=r$I
+    done
+    echo "bind $PREV c;"
+    echo "run c;"
+    for ((I = LENGTH; I >= 1; I--)); do
+        echo "run r$I;"
+    done
+    echo "run p;"
+
+    # Close each stage once the previous one is done
+    PREV=p
+    for ((I = 1; I <= LENGTH; I++)); do
+        finished $PREV
+        echo "eof r$I;"
+        PREV=r$I
+    done
+    finished $PREV
+    echo "eof c;"
+}
+
+fanout() {
+    producer p -n "$COUNT"
+    for ((I = 1; I <= FAN; I++)); do
+        consumer "c$I"
+        echo "bind p c$I;"
+        echo "run c$I;"
+    done
+    echo "run p;"
+
+    finished p
+    for ((I = 1; I <= FAN; I++)); do
+        echo "eof c$I;"
+    done
+}
+
+fanin() {
+    consumer c
+    echo "run c;"
+    for ((I = 1; I <= FAN; I++)); do
+        producer "p$I" -n $((COUNT / FAN))
+        echo "bind p$I c;"
+    done
+    for ((I = 1; I <= FAN; I++)); do
+        echo "run p$I;"
+    done
+
+    for ((I = 1; I <= FAN; I++)); do
+        finished "p$I"
+    done
+    echo "eof c;"
+}
+
+obey() {
+    producer p -n "$COUNT" -w c
+    consumer c
+    echo "obey p;"
+    echo "run c;"
+    echo "run p;"
+
+    finished p
+    echo "eof c;"
+}
+
+listen() {
+    producer p -n "$COUNT"
+    echo "listen p;"
+    echo "run p;"
+
+    finished p
+}
+
+
+# Run the topologies and print their consumers' results
+echo "{"
+echo "  \"commit\": \"$(git -C "$BENCH_DIR" rev-parse --short HEAD 2>/dev/null)\","
+echo "  \"date\": \"$(date -u +%Y-%m-%dT%H:%M:%SZ)\","
+echo "  \"count\": $COUNT, \"size\": $SIZE, \"rate\": $RATE,"
+echo "  \"fan\": $FAN, \"length\": $LENGTH, \"loops\": $LOOPS,"
+echo "  \"topologies\": {"
+
+SEPARATOR=""
+for TOPOLOGY in $TOPOLOGIES; do
+    echo "Running $TOPOLOGY..." >&2
+    rm -f "$TMP"/*
+
+    # Modules may have been reaped before they are waited for
+    if [ "$TOPOLOGY" = listen ]; then
+        $TOPOLOGY | "$MKAPP" --loops="$LOOPS" 2> "$TMP/stderr" \
+            | "$CONSUMER" -o "$TMP/stdout.json"
+    else
+        $TOPOLOGY | "$MKAPP" --loops="$LOOPS" 2> "$TMP/stderr"
+    fi
+    grep -v "^wait: module not running" "$TMP/stderr" >&2 || true
+
+    echo -n "$SEPARATOR    \"$TOPOLOGY\": ["
+    SEP=""
+    for RESULT in "$TMP"/*.json; do
+        echo -n "$SEP"
+        echo -ne "\n      "
+        tr -d '\n' < "$RESULT"
+        SEP=","
+    done
+    echo -ne "\n    ]"
+    SEPARATOR=$',\n'
+done
+
+echo -e "\n  }"
+echo "}"
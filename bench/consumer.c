@@ -0,0 +1,177 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+/**
+ * Synthetic consumer module for the routing benchmarks.
+ *
+ * Reads the messages written by the producer from standard input and
+ * computes their latency from the timestamp they start with. At end of
+ * file, writes statistics as a JSON object.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define BUFFER_LENGTH (64 << 10)
+#define STAMP_DIGITS  20
+
+
+/**
+ * Get the current time.
+ * @return CLOCK_MONOTONIC time in nanoseconds
+ */
+static unsigned long long now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+static int compare(const void* a, const void* b)
+{
+    unsigned long long x = *(const unsigned long long*)a;
+    unsigned long long y = *(const unsigned long long*)b;
+    return (x > y) - (x < y);
+}
+
+
+/**
+ * Get a percentile of sorted latencies.
+ * @param latencies sorted latencies
+ * @param count     number of latencies
+ * @param p         percentile, between 0 and 100
+ * @return          the latency in microseconds
+ */
+static double percentile(const unsigned long long* latencies,
+                         size_t count, double p)
+{
+    if (count == 0)
+        return 0;
+
+    size_t i = (size_t)(p / 100 * (count - 1) + 0.5);
+    return latencies[i] / 1000.0;
+}
+
+
+static void usage(void)
+{
+    fprintf(stderr, "usage: consumer [-o FILE]\n"
+                    "  -o FILE  where to write statistics (default: "
+                    "standard output)\n");
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char* argv[])
+{
+    const char* output = NULL;
+    int         opt;
+
+    while ((opt = getopt(argc, argv, "o:")) != -1) {
+        switch (opt) {
+        case 'o': output = optarg; break;
+        default:  usage();
+        }
+    }
+
+    static char         buffer[BUFFER_LENGTH];
+    char                line[STAMP_DIGITS + 1];
+    size_t              line_length = 0;     // Bytes of line kept
+    int                 line_valid  = 1;     // Only digits so far?
+    unsigned long long* latencies   = NULL;
+    size_t              capacity    = 0;
+    size_t              messages    = 0;
+    size_t              invalid     = 0;
+    unsigned long long  bytes       = 0;
+    unsigned long long  first_sent  = 0;
+    unsigned long long  last_seen   = 0;
+
+    while (1) {
+        ssize_t n = read(STDIN_FILENO, buffer, BUFFER_LENGTH);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            break;
+
+        unsigned long long t = now();
+        bytes += n;
+
+        // Only the timestamp at the start of each line matters. Lines
+        // mangled by interleaved writers are counted as invalid.
+        for (ssize_t i = 0; i < n; ++i) {
+            char c = buffer[i];
+
+            if (c != '\n') {
+                if (line_length < STAMP_DIGITS) {
+                    line_valid &= (c >= '0' && c <= '9');
+                    line[line_length++] = c;
+                }
+                continue;
+            }
+
+            if (!line_valid || line_length < STAMP_DIGITS) {
+                ++invalid;
+            } else {
+                line[STAMP_DIGITS] = '\0';
+                unsigned long long sent = strtoull(line, NULL, 10);
+
+                if (messages == capacity) {
+                    capacity  = capacity ? 2 * capacity : 4096;
+                    latencies = realloc(latencies,
+                                        capacity * sizeof(*latencies));
+                }
+                latencies[messages++] = t > sent ? t - sent : 0;
+                if (first_sent == 0 || sent < first_sent)
+                    first_sent = sent;
+                last_seen = t;
+            }
+
+            line_length = 0;
+            line_valid  = 1;
+        }
+    }
+
+    qsort(latencies, messages, sizeof(*latencies), compare);
+
+    double seconds = messages > 0 ? (last_seen - first_sent) / 1e9 : 0;
+    double mbps    = seconds > 0 ? bytes / seconds / 1e6 : 0;
+    double rate    = seconds > 0 ? messages / seconds : 0;
+
+    FILE* out = output != NULL ? fopen(output, "w") : stdout;
+    if (out == NULL) {
+        perror(output);
+        return EXIT_FAILURE;
+    }
+
+    fprintf(out,
+            "{\"messages\": %zu, \"invalid\": %zu, \"bytes\": %llu, "
+            "\"seconds\": %.6f, \"mb_per_s\": %.3f, \"msg_per_s\": %.1f, "
+            "\"latency_us\": {\"p50\": %.1f, \"p90\": %.1f, \"p99\": %.1f, "
+            "\"max\": %.1f}}\n",
+            messages, invalid, bytes, seconds, mbps, rate,
+            percentile(latencies, messages, 50),
+            percentile(latencies, messages, 90),
+            percentile(latencies, messages, 99),
+            percentile(latencies, messages, 100));
+
+    if (out != stdout)
+        fclose(out);
+    free(latencies);
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,139 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+/**
+ * Synthetic producer module for the routing benchmarks.
+ *
+ * Writes messages of a fixed size on standard output, one per line. Each
+ * message starts with the CLOCK_MONOTONIC time at which it was written, in
+ * nanoseconds, so that the consumer can compute its latency.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+
+
+#define STAMP_LENGTH 21               // Timestamp and space
+#define MIN_SIZE     (STAMP_LENGTH + 1) // Timestamp, space and newline
+
+
+/**
+ * Get the current time.
+ * @return CLOCK_MONOTONIC time in nanoseconds
+ */
+static unsigned long long now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+
+/**
+ * Write a whole buffer.
+ * @param data   data to write
+ * @param length number of bytes
+ */
+static void write_all(const char* data, size_t length)
+{
+    while (length > 0) {
+        ssize_t n = write(STDOUT_FILENO, data, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            perror("producer");
+            exit(EXIT_FAILURE);
+        }
+        data   += n;
+        length -= n;
+    }
+}
+
+
+static void usage(void)
+{
+    fprintf(stderr,
+            "usage: producer [-n COUNT] [-s SIZE] [-r RATE] [-w MODULE]\n"
+            "  -n COUNT   number of messages (default 100000)\n"
+            "  -s SIZE    bytes per message, newline included (default 100)\n"
+            "  -r RATE    messages per second, 0 for unlimited (default 0)\n"
+            "  -w MODULE  write mkapp commands sending each message to "
+            "MODULE\n");
+    exit(EXIT_FAILURE);
+}
+
+
+int main(int argc, char* argv[])
+{
+    long        count  = 100000;
+    long        size   = 100;
+    double      rate   = 0;
+    const char* module = NULL;
+    int         opt;
+
+    while ((opt = getopt(argc, argv, "n:s:r:w:")) != -1) {
+        switch (opt) {
+        case 'n': count  = atol(optarg); break;
+        case 's': size   = atol(optarg); break;
+        case 'r': rate   = atof(optarg); break;
+        case 'w': module = optarg;       break;
+        default:  usage();
+        }
+    }
+
+    // Commands add "write MODULE " before the message and ";" after it
+    long prefix = module != NULL ? strlen(module) + 7 : 0;
+    long suffix = module != NULL ? 1 : 0;
+    if (size < MIN_SIZE + prefix + suffix)
+        size = MIN_SIZE + prefix + suffix;
+
+    char* message = malloc(size);
+    memset(message, 'x', size);
+    message[size - 1] = '\n';
+    if (module != NULL) {
+        memcpy(message, "write ", 6);
+        memcpy(message + 6, module, strlen(module));
+        message[prefix - 1] = ' ';
+        message[size - 2]   = ';';
+    }
+
+    unsigned long long start    = now();
+    double             interval = rate > 0 ? 1e9 / rate : 0;
+
+    for (long i = 0; i < count; ++i) {
+        // Wait until the message is due when the rate is limited
+        if (interval > 0) {
+            unsigned long long due = start + i * interval;
+            unsigned long long t   = now();
+            if (due > t) {
+                struct timespec ts = { (due - t) / 1000000000ULL,
+                                       (due - t) % 1000000000ULL };
+                nanosleep(&ts, NULL);
+            }
+        }
+
+        // The timestamp overwrites the start of the padding
+        char stamp[STAMP_LENGTH + 1];
+        snprintf(stamp, sizeof(stamp), "%020llu ", now());
+        memcpy(message + prefix, stamp, STAMP_LENGTH);
+
+        write_all(message, size);
+    }
+
+    free(message);
+    return EXIT_SUCCESS;
+}
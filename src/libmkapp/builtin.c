@@ -0,0 +1,466 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "builtin.h"
+
+
+#define BUILTIN_PREFIX      "builtin:"
+#define BUILTIN_UNKNOWN     "unknown built-in module"
+#define BUILTIN_BAD_ARGS    "invalid arguments"
+#define BUILTIN_BAD_PATTERN "invalid pattern"
+#define BUILTIN_BAD_FILE    "could not open file"
+
+
+gboolean mk_builtin_is_builtin(const gchar* command)
+{
+    return g_str_has_prefix(command, BUILTIN_PREFIX);
+}
+
+
+/**
+ * Compile a built-in module's regular expression. Data is matched as
+ * bytes, since nothing guarantees it is valid UTF-8.
+ * @param builtin the built-in module
+ * @param pattern the regular expression
+ * @return        whether the pattern is valid
+ */
+static gboolean builtin_compile(MkBuiltin* builtin, const gchar* pattern)
+{
+    GError* error = NULL;
+
+    builtin->regex = g_regex_new(pattern, G_REGEX_OPTIMIZE | G_REGEX_RAW,
+                                 0, &error);
+    if (error != NULL) {
+        g_debug("Invalid pattern %s: %s", pattern, error->message);
+        g_error_free(error);
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+MkBuiltin* mk_builtin_new(const gchar**       argv,
+                          MkBuiltinOutputFunc output_func,
+                          MkBuiltinDoneFunc   done_func,
+                          void*               data,
+                          const gchar**       error)
+{
+    MkBuiltin* builtin = g_malloc(sizeof(MkBuiltin));
+
+    builtin->regex       = NULL;
+    builtin->invert      = FALSE;
+    builtin->replacement = NULL;
+    builtin->count       = 0;
+    builtin->fd          = -1;
+    builtin->rate        = 0;
+    builtin->tokens      = 1;
+    builtin->refilled    = g_get_monotonic_time();
+    builtin->held        = g_queue_new();
+    builtin->source      = 0;
+    builtin->line        = g_string_new(NULL);
+    builtin->output      = g_string_new(NULL);
+    builtin->eof         = FALSE;
+    builtin->done        = FALSE;
+    builtin->output_func = output_func;
+    builtin->done_func   = done_func;
+    builtin->data        = data;
+
+    const gchar* type = argv[0] + strlen(BUILTIN_PREFIX);
+    gsize        argc = g_strv_length((gchar**)argv) - 1;
+    gchar*       end;
+
+    *error = NULL;
+
+    if (!g_strcmp0(type, "grep")) {
+        builtin->type = MK_BUILTIN_GREP;
+        gsize pattern = 1;
+        if (argc == 2 && !g_strcmp0(argv[1], "-v")) {
+            builtin->invert = TRUE;
+            pattern = 2;
+        }
+        if (argc != pattern)
+            *error = BUILTIN_BAD_ARGS;
+        else if (!builtin_compile(builtin, argv[pattern]))
+            *error = BUILTIN_BAD_PATTERN;
+
+    } else if (!g_strcmp0(type, "sed")) {
+        builtin->type = MK_BUILTIN_SED;
+        if (argc != 2)
+            *error = BUILTIN_BAD_ARGS;
+        else if (!builtin_compile(builtin, argv[1]))
+            *error = BUILTIN_BAD_PATTERN;
+        else
+            builtin->replacement = g_strdup(argv[2]);
+
+    } else if (!g_strcmp0(type, "head")) {
+        builtin->type = MK_BUILTIN_HEAD;
+        if (argc != 1)
+            *error = BUILTIN_BAD_ARGS;
+        else
+            builtin->count = g_ascii_strtoull(argv[1], &end, 10);
+        if (*error == NULL && (*end != '\0' || end == argv[1]))
+            *error = BUILTIN_BAD_ARGS;
+
+    } else if (!g_strcmp0(type, "tee")) {
+        builtin->type = MK_BUILTIN_TEE;
+        if (argc != 1)
+            *error = BUILTIN_BAD_ARGS;
+        else
+            builtin->fd = open(argv[1], O_WRONLY | O_CREAT | O_APPEND
+                                        | O_CLOEXEC, 0666);
+        if (*error == NULL && builtin->fd < 0)
+            *error = BUILTIN_BAD_FILE;
+
+    } else if (!g_strcmp0(type, "throttle")) {
+        builtin->type = MK_BUILTIN_THROTTLE;
+        if (argc != 1)
+            *error = BUILTIN_BAD_ARGS;
+        else
+            builtin->rate = g_ascii_strtod(argv[1], &end);
+        if (*error == NULL && (*end != '\0' || builtin->rate <= 0))
+            *error = BUILTIN_BAD_ARGS;
+
+    } else {
+        *error = BUILTIN_UNKNOWN;
+    }
+
+    if (*error != NULL) {
+        mk_builtin_free(builtin);
+        return NULL;
+    }
+
+    return builtin;
+}
+
+
+/**
+ * Throw away the lines held by a throttle.
+ * @param builtin the built-in module
+ */
+static void builtin_discard_held(MkBuiltin* builtin)
+{
+    GString* line;
+    while ((line = g_queue_pop_head(builtin->held)) != NULL)
+        g_string_free(line, TRUE);
+
+    if (builtin->source != 0) {
+        g_source_remove(builtin->source);
+        builtin->source = 0;
+    }
+}
+
+
+void mk_builtin_free(MkBuiltin* builtin)
+{
+    builtin_discard_held(builtin);
+    g_queue_free(builtin->held);
+
+    if (builtin->regex != NULL)
+        g_regex_unref(builtin->regex);
+    if (builtin->fd >= 0)
+        close(builtin->fd);
+
+    g_free(builtin->replacement);
+    g_string_free(builtin->line, TRUE);
+    g_string_free(builtin->output, TRUE);
+    g_free(builtin);
+}
+
+
+/**
+ * Send the output prepared so far. The output buffer is replaced first,
+ * since sending it can cause more data to be written to the module.
+ * @param builtin the built-in module
+ */
+static void builtin_flush(MkBuiltin* builtin)
+{
+    if (builtin->output->len == 0)
+        return;
+
+    GString* output = builtin->output;
+    builtin->output = g_string_new(NULL);
+    builtin->output_func(builtin->data, output->str, output->len);
+    g_string_free(output, TRUE);
+}
+
+
+/**
+ * Let the module's owner know that no more output will be produced.
+ * @param builtin the built-in module
+ */
+static void builtin_finish(MkBuiltin* builtin)
+{
+    if (!builtin->done) {
+        builtin->done = TRUE;
+        builtin->done_func(builtin->data);
+    }
+}
+
+
+static gboolean builtin_release_timeout(MkBuiltin* builtin);
+
+/**
+ * Output as many held lines as the throttle's rate allows. Up to one
+ * second worth of lines can be output at once after an idle period.
+ * @param builtin the built-in module
+ */
+static void builtin_release(MkBuiltin* builtin)
+{
+    gint64 now = g_get_monotonic_time();
+
+    builtin->tokens += (now - builtin->refilled) * builtin->rate
+                       / G_USEC_PER_SEC;
+    builtin->tokens   = MIN(builtin->tokens, MAX(builtin->rate, 1));
+    builtin->refilled = now;
+
+    while (builtin->tokens >= 1 && !g_queue_is_empty(builtin->held)) {
+        GString* line = g_queue_pop_head(builtin->held);
+        g_string_append_len(builtin->output, line->str, line->len);
+        g_string_free(line, TRUE);
+        builtin->tokens -= 1;
+    }
+
+    builtin_flush(builtin);
+
+    if (!g_queue_is_empty(builtin->held)) {
+        // Wake up when the next line can be output
+        if (builtin->source == 0) {
+            guint delay = (1 - builtin->tokens) * 1000 / builtin->rate + 1;
+            builtin->source = g_timeout_add
+                (delay, (GSourceFunc)builtin_release_timeout, builtin);
+        }
+    } else if (builtin->eof) {
+        builtin_finish(builtin);
+    }
+}
+
+
+/**
+ * Called when a throttle can output more lines.
+ * @param builtin the built-in module
+ * @return        FALSE: builtin_release() sets up the next timeout
+ */
+static gboolean builtin_release_timeout(MkBuiltin* builtin)
+{
+    builtin->source = 0;
+    builtin_release(builtin);
+    return FALSE;
+}
+
+
+/**
+ * Append a line with all the matches of the pattern replaced to the
+ * output. Unlike g_regex_replace(), this keeps the NUL bytes of the line.
+ * @param builtin the built-in module
+ * @param line    the line, without its newline character
+ * @param length  number of bytes in the line
+ */
+static void builtin_replace(MkBuiltin*   builtin,
+                            const gchar* line,
+                            const gsize  length)
+{
+    GMatchInfo* info;
+    gint        end = 0;
+
+    g_regex_match_full(builtin->regex, line, length, 0, 0, &info, NULL);
+    while (g_match_info_matches(info)) {
+        gint   start, stop;
+        gchar* replacement;
+
+        g_match_info_fetch_pos(info, 0, &start, &stop);
+        g_string_append_len(builtin->output, line + end, start - end);
+        replacement = g_match_info_expand_references(info,
+                                                     builtin->replacement,
+                                                     NULL);
+        if (replacement != NULL)
+            g_string_append(builtin->output, replacement);
+        g_free(replacement);
+
+        end = stop;
+        g_match_info_next(info, NULL);
+    }
+    g_match_info_free(info);
+
+    g_string_append_len(builtin->output, line + end, length - end);
+}
+
+
+/**
+ * Process a complete line.
+ * @param builtin the built-in module
+ * @param line    the line, without its newline character
+ * @param length  number of bytes in the line
+ * @param newline whether the line ended with a newline character
+ */
+static void builtin_line(MkBuiltin*   builtin,
+                         const gchar* line,
+                         const gsize  length,
+                         gboolean     newline)
+{
+    GString* held;
+
+    switch (builtin->type) {
+    case MK_BUILTIN_GREP:
+        if (g_regex_match_full(builtin->regex, line, length, 0, 0,
+                               NULL, NULL) == builtin->invert)
+            return;
+        g_string_append_len(builtin->output, line, length);
+        break;
+
+    case MK_BUILTIN_SED:
+        builtin_replace(builtin, line, length);
+        break;
+
+    case MK_BUILTIN_HEAD:
+        if (builtin->count == 0)
+            return;
+        --builtin->count;
+        g_string_append_len(builtin->output, line, length);
+        break;
+
+    case MK_BUILTIN_THROTTLE:
+        held = g_string_new_len(line, length);
+        if (newline)
+            g_string_append_c(held, '\n');
+        g_queue_push_tail(builtin->held, held);
+        return;
+
+    case MK_BUILTIN_TEE:
+        return;
+    }
+
+    if (newline)
+        g_string_append_c(builtin->output, '\n');
+}
+
+
+/**
+ * Append data to a tee's file.
+ * @param builtin the built-in module
+ * @param data    data to append
+ * @param length  number of data bytes
+ */
+static void builtin_tee(MkBuiltin* builtin, const gchar* data, gsize length)
+{
+    while (length > 0) {
+        gssize n = write(builtin->fd, data, length);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0) {
+            g_warning("Could not write to tee file: %s", g_strerror(errno));
+            return;
+        }
+        data   += n;
+        length -= n;
+    }
+}
+
+
+void mk_builtin_write(MkBuiltin*   builtin,
+                      const gchar* data,
+                      const gsize  length)
+{
+    if (builtin->eof || builtin->done)
+        return;
+
+    if (builtin->type == MK_BUILTIN_TEE) {
+        builtin_tee(builtin, data, length);
+        g_string_append_len(builtin->output, data, length);
+        builtin_flush(builtin);
+        return;
+    }
+
+    // Process complete lines. A line split across writes is put back
+    // together first.
+    const gchar* end = data + length;
+    while (data < end) {
+        const gchar* newline = memchr(data, '\n', end - data);
+        if (newline == NULL) {
+            g_string_append_len(builtin->line, data, end - data);
+            break;
+        }
+
+        if (builtin->line->len > 0) {
+            g_string_append_len(builtin->line, data, newline - data);
+            builtin_line(builtin, builtin->line->str, builtin->line->len,
+                         TRUE);
+            g_string_truncate(builtin->line, 0);
+        } else {
+            builtin_line(builtin, data, newline - data, TRUE);
+        }
+
+        data = newline + 1;
+    }
+
+    if (builtin->type == MK_BUILTIN_THROTTLE) {
+        builtin_release(builtin);
+    } else {
+        builtin_flush(builtin);
+        if (builtin->type == MK_BUILTIN_HEAD && builtin->count == 0)
+            builtin_finish(builtin);
+    }
+}
+
+
+void mk_builtin_eof(MkBuiltin* builtin)
+{
+    if (builtin->eof)
+        return;
+    builtin->eof = TRUE;
+
+    if (builtin->line->len > 0 && !builtin->done) {
+        builtin_line(builtin, builtin->line->str, builtin->line->len, FALSE);
+        g_string_truncate(builtin->line, 0);
+    }
+
+    if (builtin->type == MK_BUILTIN_THROTTLE) {
+        builtin_release(builtin);
+    } else {
+        builtin_flush(builtin);
+        builtin_finish(builtin);
+    }
+}
+
+
+void mk_builtin_drain(MkBuiltin* builtin)
+{
+    while (!g_queue_is_empty(builtin->held)) {
+        if (builtin->source != 0) {
+            g_source_remove(builtin->source);
+            builtin->source = 0;
+        }
+
+        // Sleep until the next line can be output
+        if (builtin->tokens < 1)
+            g_usleep((1 - builtin->tokens) * G_USEC_PER_SEC / builtin->rate
+                     + 1);
+        builtin_release(builtin);
+    }
+}
+
+
+void mk_builtin_stop(MkBuiltin* builtin)
+{
+    builtin->eof = TRUE;
+    g_string_truncate(builtin->line, 0);
+    builtin_discard_held(builtin);
+    builtin_finish(builtin);
+}
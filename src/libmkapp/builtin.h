@@ -0,0 +1,163 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+/**
+ * @file
+ * Built-in modules.
+ *
+ * Built-in modules transform the data written to them inside mkapp, with
+ * no process of their own. They are defined like other modules, with a
+ * command starting with "builtin:":
+ *  - builtin:grep [-v] PATTERN:      lines matching (or not matching) a
+ *                                    regular expression
+ *  - builtin:sed PATTERN REPLACEMENT: lines with all the matches of a
+ *                                    regular expression replaced
+ *  - builtin:head N:                 the first N lines, then exit
+ *  - builtin:tee FILE:               all data, also appended to FILE
+ *  - builtin:throttle RATE:          lines, delayed to at most RATE lines
+ *                                    per second
+ *
+ * Patterns are Perl-compatible regular expressions, compiled once when
+ * the module is run.
+ */
+
+#ifndef __BUILTIN_H__
+#define __BUILTIN_H__
+
+#include <glib.h>
+
+
+/**
+ * Function called with the output of a built-in module.
+ * @param data   arbitrary pointer passed to mk_builtin_new()
+ * @param output output data, nul-terminated
+ * @param length number of output bytes
+ */
+typedef void(*MkBuiltinOutputFunc)(void* data,
+                                   const gchar* output,
+                                   const gsize length);
+
+
+/**
+ * Function called when a built-in module has finished: it will not
+ * produce any more output.
+ * @param data arbitrary pointer passed to mk_builtin_new()
+ */
+typedef void(*MkBuiltinDoneFunc)(void* data);
+
+
+/**
+ * @brief Type of built-in module.
+ */
+typedef enum {
+    MK_BUILTIN_GREP,
+    MK_BUILTIN_SED,
+    MK_BUILTIN_HEAD,
+    MK_BUILTIN_TEE,
+    MK_BUILTIN_THROTTLE
+} MkBuiltinType;
+
+
+/**
+ * @brief Built-in module state.
+ */
+typedef struct {
+    MkBuiltinType       type;        /// What the module does
+    GRegex*             regex;       /// grep and sed pattern
+    gboolean            invert;      /// grep: keep non-matching lines?
+    gchar*              replacement; /// sed replacement
+    guint64             count;       /// head: lines still to let through
+    gint                fd;          /// tee: file descriptor
+    gdouble             rate;        /// throttle: lines per second
+    gdouble             tokens;      /// throttle: lines that can be sent
+    gint64              refilled;    /// throttle: when tokens were added
+    GQueue*             held;        /// throttle: lines waiting (GString)
+    guint               source;      /// throttle: timer releasing lines
+    GString*            line;        /// Incomplete line received so far
+    GString*            output;      /// Output being prepared
+    gboolean            eof;         /// Has all the input been received?
+    gboolean            done;        /// Has all the output been produced?
+    MkBuiltinOutputFunc output_func; /// Where output goes
+    MkBuiltinDoneFunc   done_func;   /// Called when done
+    void*               data;        /// Data for output_func and done_func
+} MkBuiltin;
+
+
+/**
+ * Check whether a module command designates a built-in module.
+ * @param command the command (first argument of the module)
+ * @return        whether the command starts with "builtin:"
+ */
+gboolean mk_builtin_is_builtin(const gchar* command);
+
+
+/**
+ * Create a built-in module.
+ * @param argv        the command and its arguments, NULL-terminated
+ * @param output_func function called with the output
+ * @param done_func   function called when no more output will be produced
+ * @param data        data for output_func and done_func
+ * @param error       where to store an error string if the module cannot
+ *                    be created
+ * @return            a new built-in module that must be freed with
+ *                    mk_builtin_free(), or NULL if an error occurred
+ */
+MkBuiltin* mk_builtin_new(const gchar**       argv,
+                          MkBuiltinOutputFunc output_func,
+                          MkBuiltinDoneFunc   done_func,
+                          void*               data,
+                          const gchar**       error);
+
+
+/**
+ * Free a built-in module. Data it has not output yet is lost.
+ * @param builtin the built-in module
+ */
+void mk_builtin_free(MkBuiltin* builtin);
+
+
+/**
+ * Write data to a built-in module. Output is produced synchronously,
+ * except for throttled lines.
+ * @param builtin the built-in module
+ * @param data    input data
+ * @param length  number of input bytes
+ */
+void mk_builtin_write(MkBuiltin*   builtin,
+                      const gchar* data,
+                      const gsize  length);
+
+
+/**
+ * Signal the end of a built-in module's input. An incomplete last line is
+ * processed as a line.
+ * @param builtin the built-in module
+ */
+void mk_builtin_eof(MkBuiltin* builtin);
+
+
+/**
+ * Output the lines a throttle holds, at its rate, sleeping in between.
+ * Like waiting for a process to exit, this blocks the caller.
+ * @param builtin the built-in module
+ */
+void mk_builtin_drain(MkBuiltin* builtin);
+
+
+/**
+ * Stop a built-in module: discard its input and the lines it holds.
+ * @param builtin the built-in module
+ */
+void mk_builtin_stop(MkBuiltin* builtin);
+
+#endif // __BUILTIN_H__
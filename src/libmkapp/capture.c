@@ -0,0 +1,174 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "capture.h"
+
+
+#define CAPTURE_SPLICE_LENGTH (1 << 20)
+
+
+/**
+ * Open the current capture file, appending to it if it exists.
+ * @param capture the capture
+ * @return        whether the file could be opened
+ */
+static gboolean capture_open(MkCapture* capture)
+{
+    capture->fd = open(capture->path, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+    if (capture->fd < 0)
+        return FALSE;
+
+    off_t end = lseek(capture->fd, 0, SEEK_END);
+    capture->size     = end > 0 ? end : 0;
+    capture->unsynced = 0;
+    return TRUE;
+}
+
+
+/**
+ * Rename the current capture file with the next free suffix and start a
+ * new one.
+ * @param capture the capture
+ * @return        whether a new file could be opened
+ */
+static gboolean capture_rotate(MkCapture* capture)
+{
+    gchar* rotated = NULL;
+
+    do {
+        g_free(rotated);
+        rotated = g_strdup_printf("%s.%u", capture->path, ++capture->rotated);
+    } while (g_file_test(rotated, G_FILE_TEST_EXISTS));
+
+    if (capture->sync > 0)
+        fdatasync(capture->fd);
+    close(capture->fd);
+
+    if (rename(capture->path, rotated))
+        g_warning("Could not rename %s: %s", capture->path, g_strerror(errno));
+    g_free(rotated);
+
+    return capture_open(capture);
+}
+
+
+/**
+ * Account for data written to a capture file, syncing and rotating it
+ * when due.
+ * @param capture the capture
+ * @param length  number of bytes written
+ * @return        whether the file is still open
+ */
+static gboolean capture_written(MkCapture* capture, const gsize length)
+{
+    capture->size     += length;
+    capture->unsynced += length;
+
+    if (capture->sync > 0 && capture->unsynced >= capture->sync) {
+        fdatasync(capture->fd);
+        capture->unsynced = 0;
+    }
+
+    if (capture->rotate > 0 && capture->size >= capture->rotate)
+        return capture_rotate(capture);
+
+    return TRUE;
+}
+
+
+MkCapture* mk_capture_new(const gchar* path, const gsize rotate,
+                          const gsize sync)
+{
+    MkCapture* capture = g_malloc(sizeof(MkCapture));
+
+    capture->path    = g_strdup(path);
+    capture->rotate  = rotate;
+    capture->sync    = sync;
+    capture->rotated = 0;
+
+    if (!capture_open(capture)) {
+        g_free(capture->path);
+        g_free(capture);
+        return NULL;
+    }
+
+    return capture;
+}
+
+
+void mk_capture_free(MkCapture* capture)
+{
+    if (capture->fd >= 0) {
+        if (capture->sync > 0)
+            fdatasync(capture->fd);
+        close(capture->fd);
+    }
+
+    g_free(capture->path);
+    g_free(capture);
+}
+
+
+gboolean mk_capture_write(MkCapture*   capture,
+                          const gchar* data,
+                          const gsize  length)
+{
+    gsize written = 0;
+
+    while (written < length) {
+        gssize n = write(capture->fd, data + written, length - written);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n < 0)
+            return FALSE;
+        written += n;
+    }
+
+    return capture_written(capture, length);
+}
+
+
+gssize mk_capture_splice(MkCapture* capture, const gint fd)
+{
+    gsize  length = CAPTURE_SPLICE_LENGTH;
+    gssize n;
+
+    // Spliced data can be cut where the file is rotated. A file that was
+    // already full when opened is rotated first.
+    if (capture->rotate > 0) {
+        if (capture->size >= capture->rotate && !capture_rotate(capture))
+            return -1;
+        length = MIN(length, capture->rotate - capture->size);
+    }
+
+    do {
+        n = splice(fd, NULL, capture->fd, NULL, length,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (n < 0 && errno == EINTR);
+
+    if (n > 0 && !capture_written(capture, n))
+        return -1;
+
+    return n;
+}
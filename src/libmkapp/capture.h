@@ -0,0 +1,91 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+
+/**
+ * @file
+ * Output capture files.
+ *
+ * A capture appends a module's output to a file. Output that goes nowhere
+ * else is moved from the module's pipe to the file with splice(), without
+ * being copied through mkapp's memory. Once the file reaches a given size,
+ * it is renamed with the next free numeric suffix (FILE.1, FILE.2...) and
+ * a new file is started. Output read by mkapp is rotated between two
+ * writes, so a file may exceed that size by one write. Captured data can
+ * also be flushed to disk with fdatasync() every given number of bytes.
+ */
+
+#ifndef __CAPTURE_H__
+#define __CAPTURE_H__
+
+#include <glib.h>
+
+
+/**
+ * The capture file is written from its current end, through the file
+ * position: splice() does not accept files opened in append mode.
+ * @brief Output capture file.
+ */
+typedef struct {
+    gchar* path;     /// File name
+    gint   fd;       /// File descriptor
+    gsize  rotate;   /// Size at which the file is rotated, or 0
+    gsize  sync;     /// Bytes between two fdatasync() calls, or 0
+    gsize  size;     /// Size of the file
+    gsize  unsynced; /// Bytes written since the last fdatasync()
+    guint  rotated;  /// Suffix of the last rotated file, or 0
+} MkCapture;
+
+
+/**
+ * Open a capture file. Data is appended to the file if it exists.
+ * @param path   file name
+ * @param rotate size at which the file is rotated, or 0 to never rotate it
+ * @param sync   number of bytes between two fdatasync() calls, or 0 to
+ *               leave writing to disk to the system
+ * @return       a new capture that must be freed with mk_capture_free(),
+ *               or NULL if the file could not be opened
+ */
+MkCapture* mk_capture_new(const gchar* path, const gsize rotate,
+                          const gsize sync);
+
+
+/**
+ * Close a capture file.
+ * @param capture the capture
+ */
+void mk_capture_free(MkCapture* capture);
+
+
+/**
+ * Append data to a capture file.
+ * @param capture the capture
+ * @param data    what to write
+ * @param length  number of data bytes
+ * @return        whether all the data was written
+ */
+gboolean mk_capture_write(MkCapture*   capture,
+                          const gchar* data,
+                          const gsize  length);
+
+
+/**
+ * Move the data available from a pipe to a capture file, without blocking.
+ * @param capture the capture
+ * @param fd      the pipe, which must be non-blocking
+ * @return        number of bytes moved, 0 at end-of-file, or -1 with errno
+ *                set if an error occurred (EAGAIN if the pipe is empty)
+ */
+gssize mk_capture_splice(MkCapture* capture, const gint fd);
+
+#endif // __CAPTURE_H__
@@ -0,0 +1,305 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+
+#include <string.h>
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+
+#include "compiled.h"
+
+
+#define COMPILED_MAGIC        "MKAPPC\0\1"
+#define COMPILED_MAGIC_LENGTH 8
+
+
+gchar* mk_compiled_path(const gchar* source)
+{
+    return g_strconcat(source, "c", NULL);
+}
+
+
+/**
+ * Get the size and modification time of a source file.
+ * @param source name of the file
+ * @param header where to store them
+ * @return       whether the file is a regular file
+ */
+static gboolean compiled_stat(const gchar* source, MkCompiledHeader* header)
+{
+    struct stat st;
+
+    if (stat(source, &st) || !S_ISREG(st.st_mode))
+        return FALSE;
+
+    header->size  = st.st_size;
+    header->mtime = (gint64)st.st_mtim.tv_sec * G_GINT64_CONSTANT(1000000000)
+                    + st.st_mtim.tv_nsec;
+    return TRUE;
+}
+
+
+/**
+ * Hash the contents of a source file with FNV-1a.
+ * @param source name of the file
+ * @param size   size of the file
+ * @param hash   where to store the hash
+ * @return       whether the file could be read
+ */
+static gboolean compiled_hash(const gchar* source,
+                              const gsize  size,
+                              guint64*     hash)
+{
+    gint fd = open(source, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return FALSE;
+
+    *hash = G_GUINT64_CONSTANT(14695981039346656037);
+
+    if (size > 0) {
+        const guchar* map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED) {
+            close(fd);
+            return FALSE;
+        }
+
+        for (gsize i = 0; i < size; ++i)
+            *hash = (*hash ^ map[i]) * G_GUINT64_CONSTANT(1099511628211);
+        munmap((gpointer)map, size);
+    }
+
+    close(fd);
+    return TRUE;
+}
+
+
+MkCompiler* mk_compiler_new(const gchar* source)
+{
+    MkCompiledHeader header;
+
+    memset(&header, 0, sizeof(header));
+    if (!compiled_stat(source, &header)
+        || !compiled_hash(source, header.size, &header.hash))
+        return NULL;
+
+    MkCompiler* compiler = g_malloc(sizeof(MkCompiler));
+    compiler->header  = header;
+    compiler->index   = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                              g_free, NULL);
+    compiler->strings = g_string_new(NULL);
+    compiler->words   = g_array_new(FALSE, FALSE, sizeof(guint32));
+
+    memcpy(compiler->header.magic, COMPILED_MAGIC, COMPILED_MAGIC_LENGTH);
+
+    return compiler;
+}
+
+
+void mk_compiler_add(MkCompiler*   compiler,
+                     const gchar** tokens,
+                     const gsize   length)
+{
+    guint32 word = length;
+    g_array_append_val(compiler->words, word);
+
+    // Each distinct token is stored once
+    for (gsize i = 0; i < length; ++i) {
+        gpointer index;
+
+        if (g_hash_table_lookup_extended(compiler->index, tokens[i], NULL,
+                                         &index)) {
+            word = GPOINTER_TO_UINT(index);
+        } else {
+            word = compiler->header.n_strings++;
+            g_hash_table_insert(compiler->index, g_strdup(tokens[i]),
+                                GUINT_TO_POINTER(word));
+            g_string_append_len(compiler->strings, tokens[i],
+                                strlen(tokens[i]) + 1);
+        }
+        g_array_append_val(compiler->words, word);
+    }
+
+    ++compiler->header.n_commands;
+}
+
+
+gboolean mk_compiler_save(MkCompiler* compiler, const gchar* path)
+{
+    GError* error = NULL;
+
+    // Commands follow the strings, aligned for reading them in place
+    while (compiler->strings->len % sizeof(guint32) != 0)
+        g_string_append_c(compiler->strings, '\0');
+
+    compiler->header.strings_length = compiler->strings->len;
+    compiler->header.n_words        = compiler->words->len;
+
+    GString* contents = g_string_sized_new(sizeof(MkCompiledHeader)
+        + compiler->strings->len + compiler->words->len * sizeof(guint32));
+    g_string_append_len(contents, (const gchar*)&compiler->header,
+                        sizeof(MkCompiledHeader));
+    g_string_append_len(contents, compiler->strings->str,
+                        compiler->strings->len);
+    g_string_append_len(contents, compiler->words->data,
+                        compiler->words->len * sizeof(guint32));
+
+    // The file is written under another name, then renamed
+    gboolean saved = g_file_set_contents(path, contents->str, contents->len,
+                                         &error);
+    if (!saved) {
+        g_debug("Could not save %s: %s", path, error->message);
+        g_error_free(error);
+    }
+
+    g_string_free(contents, TRUE);
+    return saved;
+}
+
+
+void mk_compiler_free(MkCompiler* compiler)
+{
+    g_hash_table_unref(compiler->index);
+    g_string_free(compiler->strings, TRUE);
+    g_array_free(compiler->words, TRUE);
+    g_free(compiler);
+}
+
+
+/**
+ * Check that a compiled script was compiled from the current version of
+ * its source file. A source file with a new modification time may still
+ * have the same contents, for instance after being copied.
+ * @param header header of the compiled script
+ * @param source name of the source file
+ * @return       whether the compiled script is up to date
+ */
+static gboolean compiled_is_current(const MkCompiledHeader* header,
+                                    const gchar*            source)
+{
+    MkCompiledHeader current;
+
+    if (!compiled_stat(source, &current) || current.size != header->size)
+        return FALSE;
+
+    return current.mtime == header->mtime
+        || (compiled_hash(source, current.size, &current.hash)
+            && current.hash == header->hash);
+}
+
+
+/**
+ * Turn the commands of a compiled script into tokens pointing to its
+ * string table.
+ * @param compiled the compiled script, mapped to memory
+ * @return         whether the compiled script is well-formed
+ */
+static gboolean compiled_resolve(MkCompiled* compiled)
+{
+    const MkCompiledHeader* header = (const MkCompiledHeader*)compiled->map;
+    const gchar*   table = compiled->map + sizeof(MkCompiledHeader);
+    const gchar*   end   = table + header->strings_length;
+    const guint32* words = (const guint32*)end;
+    const gchar**  strings = g_new(const gchar*, header->n_strings);
+    gboolean       valid   = TRUE;
+
+    // Find where each string starts, making sure it ends within the table
+    const gchar* p = table;
+    for (guint32 i = 0; valid && i < header->n_strings; ++i) {
+        strings[i] = p;
+        p = memchr(p, '\0', end - p);
+        if (p == NULL)
+            valid = FALSE;
+        else
+            ++p;
+    }
+
+    // Each token count becomes the NULL ending the command's tokens
+    compiled->tokens     = g_new(const gchar*, header->n_words);
+    compiled->n_commands = 0;
+
+    guint32 w = 0;
+    while (valid && w < header->n_words) {
+        guint32 length = words[w];
+        if (length == 0 || length > header->n_words - w - 1) {
+            valid = FALSE;
+            break;
+        }
+
+        for (guint32 i = 0; i < length; ++i) {
+            guint32 index = words[w + 1 + i];
+            if (index >= header->n_strings) {
+                valid = FALSE;
+                break;
+            }
+            compiled->tokens[w + i] = strings[index];
+        }
+        compiled->tokens[w + length] = NULL;
+
+        w += length + 1;
+        ++compiled->n_commands;
+    }
+
+    g_free(strings);
+    return valid && compiled->n_commands == header->n_commands;
+}
+
+
+MkCompiled* mk_compiled_load(const gchar* source, const gchar* path)
+{
+    struct stat st;
+    gint        fd = open(path, O_RDONLY | O_CLOEXEC);
+
+    if (fd < 0)
+        return NULL;
+
+    gchar* map = MAP_FAILED;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode)
+        && st.st_size >= sizeof(MkCompiledHeader))
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+
+    if (map == MAP_FAILED)
+        return NULL;
+
+    const MkCompiledHeader* header = (const MkCompiledHeader*)map;
+
+    MkCompiled* compiled = g_malloc(sizeof(MkCompiled));
+    compiled->map    = map;
+    compiled->size   = st.st_size;
+    compiled->tokens = NULL;
+
+    if (memcmp(header->magic, COMPILED_MAGIC, COMPILED_MAGIC_LENGTH)
+        || header->strings_length % sizeof(guint32) != 0
+        || sizeof(MkCompiledHeader) + (guint64)header->strings_length
+           + (guint64)header->n_words * sizeof(guint32) != compiled->size
+        || !compiled_is_current(header, source)
+        || !compiled_resolve(compiled)) {
+        mk_compiled_free(compiled);
+        return NULL;
+    }
+
+    return compiled;
+}
+
+
+void mk_compiled_free(MkCompiled* compiled)
+{
+    munmap(compiled->map, compiled->size);
+    g_free(compiled->tokens);
+    g_free(compiled);
+}
@@ -0,0 +1,141 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+
+/**
+ * @file
+ * Compiled mkapp scripts.
+ *
+ * A compiled script holds the commands read from an mkapp file, with their
+ * escape sequences already expanded, so that they can be run again without
+ * parsing the file. It is kept next to the file, under the same name
+ * followed by "c" (see mk_compiled_path()), and is only used as long as
+ * the file is unchanged: same size, and same modification time or same
+ * contents.
+ *
+ * A compiled script starts with a fixed-size header, followed by a string
+ * table holding each distinct token once, nul-terminated, then by the
+ * commands: the number of tokens of each command followed by the index of
+ * each of its tokens in the string table, as 32-bit integers. Integers are
+ * stored in host byte order: compiled scripts are meant to be used on the
+ * machine they were compiled on.
+ */
+
+#ifndef __COMPILED_H__
+#define __COMPILED_H__
+
+#include <glib.h>
+
+
+/**
+ * Header of a compiled script.
+ * @brief Compiled script header.
+ */
+typedef struct {
+    gchar   magic[8];       /// Identifies compiled scripts
+    guint64 size;           /// Size of the source file
+    gint64  mtime;          /// Modification time of the source file, in ns
+    guint64 hash;           /// Hash of the contents of the source file
+    guint32 n_strings;      /// Number of strings in the string table
+    guint32 strings_length; /// Number of bytes of the string table
+    guint32 n_commands;     /// Number of commands
+    guint32 n_words;        /// Number of integers describing the commands
+} MkCompiledHeader;
+
+
+/**
+ * A compiler collects the commands read from an mkapp file, to save them
+ * as a compiled script.
+ * @brief Compiled script being built.
+ */
+typedef struct {
+    MkCompiledHeader header;  /// Header, describing the source file
+    GHashTable*      index;   /// Index of each string (key=string)
+    GString*         strings; /// String table
+    GArray*          words;   /// Token counts and string indices (guint32)
+} MkCompiler;
+
+
+/**
+ * A compiled script loaded from a file, ready to be run. Its tokens point
+ * to the file, which is mapped to memory.
+ * @brief Loaded compiled script.
+ */
+typedef struct {
+    gchar*        map;        /// The file mapped to memory
+    gsize         size;       /// Size of the file
+    const gchar** tokens;     /// Tokens of each command, NULL-terminated
+    guint32       n_commands; /// Number of commands
+} MkCompiled;
+
+
+/**
+ * Get the name of the compiled script of an mkapp file.
+ * @param source name of the mkapp file
+ * @return       newly-allocated name of the compiled script
+ */
+gchar* mk_compiled_path(const gchar* source);
+
+
+/**
+ * Create a compiler for an mkapp file, which is about to be read.
+ * @param source name of the mkapp file
+ * @return       a new compiler, or NULL if the file is not a regular file
+ */
+MkCompiler* mk_compiler_new(const gchar* source);
+
+
+/**
+ * Add a command to a compiled script.
+ * @param compiler the compiler
+ * @param tokens   the tokens that make up the command, expanded
+ * @param length   number of tokens
+ */
+void mk_compiler_add(MkCompiler*   compiler,
+                     const gchar** tokens,
+                     const gsize   length);
+
+
+/**
+ * Save a compiled script, replacing any previous one atomically.
+ * @param compiler the compiler
+ * @param path     where to save the compiled script
+ * @return         whether the compiled script could be saved
+ */
+gboolean mk_compiler_save(MkCompiler* compiler, const gchar* path);
+
+
+/**
+ * Free a compiler.
+ * @param compiler the compiler
+ */
+void mk_compiler_free(MkCompiler* compiler);
+
+
+/**
+ * Load the compiled script of an mkapp file, with a single mmap().
+ * @param source name of the mkapp file
+ * @param path   name of the compiled script
+ * @return       the compiled script, or NULL if there is none, if it is
+ *               invalid, or if the mkapp file changed since it was compiled
+ */
+MkCompiled* mk_compiled_load(const gchar* source, const gchar* path);
+
+
+/**
+ * Free a compiled script loaded with mk_compiled_load().
+ * @param compiled the compiled script
+ */
+void mk_compiled_free(MkCompiled* compiled);
+
+#endif // __COMPILED_H__
@@ -0,0 +1,388 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "loop.h"
+
+
+static MkLoopSet* m_set     = NULL;                 // The loop set
+static GPrivate   m_current = G_PRIVATE_INIT(NULL); // Worker of the thread
+
+
+/**
+ * Handle all the items posted to a loop.
+ * @param loop the loop
+ */
+static void loop_drain(MkLoop* loop)
+{
+    MkLoopSet* set = loop->set;
+
+    for (guint i = 0; i < set->loops->len; ++i) {
+        MkQueueLink* item;
+        while ((item = mk_queue_pop(&loop->inbound[i])) != NULL)
+            set->func(item, set->data);
+    }
+}
+
+
+/**
+ * Handle all the items posted to all the loops of a set.
+ * @param set the loop set
+ */
+static void loop_drain_all(MkLoopSet* set)
+{
+    for (guint i = 0; i < set->loops->len; ++i)
+        loop_drain(g_ptr_array_index(set->loops, i));
+}
+
+
+/**
+ * Called when a loop is woken up, to handle the items posted to it. The
+ * wakeup flag is cleared first, so that items posted meanwhile wake the
+ * loop up again.
+ * @param source the wakeup pipe
+ * @param unused unused
+ * @param loop   the loop
+ * @return       TRUE to keep watching the pipe
+ */
+static gboolean loop_woken(GIOChannel*  source,
+                           GIOCondition unused,
+                           MkLoop*      loop)
+{
+    gchar buffer[64];
+
+    g_atomic_int_set(&loop->signaled, 0);
+    while (read(loop->wake[0], buffer, sizeof(buffer)) > 0);
+
+    loop_drain(loop);
+    return TRUE;
+}
+
+
+/**
+ * Poll function of the control loop. The worker loops run only while the
+ * control loop polls. Once it is done, the workers that were ready get
+ * their turn before the control loop takes all the locks back and handles
+ * the items left in the queues.
+ * @param fds     file descriptors to poll
+ * @param n_fds   number of file descriptors
+ * @param timeout timeout in milliseconds, or -1
+ * @return        see g_poll()
+ */
+static gint loop_control_poll(GPollFD* fds, guint n_fds, gint timeout)
+{
+    MkLoopSet* set = m_set;
+    guint      i;
+
+    for (i = 1; i < set->loops->len; ++i)
+        g_mutex_unlock(&((MkLoop*)g_ptr_array_index(set->loops, i))->lock);
+
+    gint result = g_poll(fds, n_fds, timeout);
+    gint saved_errno = errno;
+
+    for (i = 1; i < set->loops->len; ++i)
+        while (g_atomic_int_get(&((MkLoop*)g_ptr_array_index(set->loops, i))
+                                ->waiting))
+            g_thread_yield();
+
+    g_atomic_int_set(&set->control, 1);
+    for (i = 1; i < set->loops->len; ++i)
+        g_mutex_lock(&((MkLoop*)g_ptr_array_index(set->loops, i))->lock);
+    g_atomic_int_set(&set->control, 0);
+
+    loop_drain_all(set);
+
+    errno = saved_errno;
+    return result;
+}
+
+
+/**
+ * Poll function of the worker loops: the worker's lock is released while
+ * it polls. It waits for the control loop to take the locks, if it is
+ * doing so, before taking its own back.
+ * @param fds     file descriptors to poll
+ * @param n_fds   number of file descriptors
+ * @param timeout timeout in milliseconds, or -1
+ * @return        see g_poll()
+ */
+static gint loop_worker_poll(GPollFD* fds, guint n_fds, gint timeout)
+{
+    MkLoop* loop = g_private_get(&m_current);
+
+    g_mutex_unlock(&loop->lock);
+    gint result = g_poll(fds, n_fds, timeout);
+    gint saved_errno = errno;
+
+    g_atomic_int_set(&loop->waiting, 1);
+    while (g_atomic_int_get(&loop->set->control))
+        g_thread_yield();
+    g_mutex_lock(&loop->lock);
+    g_atomic_int_set(&loop->waiting, 0);
+
+    errno = saved_errno;
+    return result;
+}
+
+
+/**
+ * Worker thread.
+ * @param loop the worker loop
+ * @return     NULL
+ */
+static gpointer loop_thread(MkLoop* loop)
+{
+    g_private_set(&m_current, loop);
+
+    g_mutex_lock(&loop->lock);
+    while (!g_atomic_int_get(&loop->stop))
+        g_main_context_iteration(loop->context, TRUE);
+    g_mutex_unlock(&loop->lock);
+
+    return NULL;
+}
+
+
+/**
+ * Create a loop of a set.
+ * @param set   the loop set
+ * @param index index of the loop
+ * @param count number of loops in the set
+ * @return      the loop
+ */
+static MkLoop* loop_new(MkLoopSet* set, const guint index, const guint count)
+{
+    MkLoop* loop = g_malloc0(sizeof(MkLoop));
+
+    loop->set     = set;
+    loop->index   = index;
+    loop->inbound = g_new(MkQueue, count);
+    for (guint i = 0; i < count; ++i)
+        mk_queue_init(&loop->inbound[i], g_free);
+
+    if (pipe(loop->wake))
+        g_critical("Could not create pipe: %s", g_strerror(errno));
+
+    for (gint i = 0; i < 2; ++i) {
+        fcntl(loop->wake[i], F_SETFL, O_NONBLOCK);
+        fcntl(loop->wake[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    if (index > 0) {
+        loop->context = g_main_context_new();
+        g_main_context_set_poll_func(loop->context, loop_worker_poll);
+        g_mutex_init(&loop->lock);
+    }
+
+    GIOChannel* chan = g_io_channel_unix_new(loop->wake[0]);
+    mk_loop_add_watch(index > 0 ? loop : NULL, chan, G_IO_IN,
+                      (GIOFunc)loop_woken, loop);
+    g_io_channel_unref(chan);
+
+    return loop;
+}
+
+
+MkLoopSet* mk_loop_set_new(const guint workers, MkLoopFunc func, gpointer data)
+{
+    MkLoopSet* set = g_malloc(sizeof(MkLoopSet));
+    guint      count = workers + 1;
+
+    set->loops   = g_ptr_array_new();
+    set->func    = func;
+    set->data    = data;
+    set->control = 0;
+
+    for (guint i = 0; i < count; ++i)
+        g_ptr_array_add(set->loops, loop_new(set, i, count));
+
+    // Workers start once the control loop polls for the first time
+    m_set = set;
+    g_main_context_set_poll_func(NULL, loop_control_poll);
+
+    for (guint i = 1; i < count; ++i) {
+        MkLoop* loop = g_ptr_array_index(set->loops, i);
+        gchar*  name = g_strdup_printf("mkapp-loop%u", i - 1);
+
+        g_mutex_lock(&loop->lock);
+        loop->thread = g_thread_new(name, (GThreadFunc)loop_thread, loop);
+        g_free(name);
+    }
+
+    return set;
+}
+
+
+void mk_loop_set_free(MkLoopSet* set)
+{
+    guint i;
+
+    for (i = 1; i < set->loops->len; ++i) {
+        MkLoop* loop = g_ptr_array_index(set->loops, i);
+        g_atomic_int_set(&loop->stop, 1);
+        g_main_context_wakeup(loop->context);
+        g_mutex_unlock(&loop->lock);
+        g_thread_join(loop->thread);
+    }
+
+    g_main_context_set_poll_func(NULL, NULL);
+    m_set = NULL;
+    loop_drain_all(set);
+
+    for (i = 0; i < set->loops->len; ++i) {
+        MkLoop* loop = g_ptr_array_index(set->loops, i);
+
+        if (loop->index > 0) {
+            g_main_context_unref(loop->context);
+            g_mutex_clear(&loop->lock);
+        } else {
+            mk_loop_remove_by_user_data(NULL, loop);
+        }
+
+        for (guint j = 0; j < set->loops->len; ++j)
+            mk_queue_clear(&loop->inbound[j]);
+        g_free(loop->inbound);
+        close(loop->wake[0]);
+        close(loop->wake[1]);
+        g_free(loop);
+    }
+
+    g_ptr_array_free(set->loops, TRUE);
+    g_free(set);
+}
+
+
+guint mk_loop_set_workers(MkLoopSet* set)
+{
+    return set->loops->len - 1;
+}
+
+
+MkLoop* mk_loop_set_worker(MkLoopSet* set, const guint index)
+{
+    return g_ptr_array_index(set->loops, index + 1);
+}
+
+
+MkLoop* mk_loop_set_least_used(MkLoopSet* set)
+{
+    MkLoop* least = g_ptr_array_index(set->loops, 1);
+
+    for (guint i = 2; i < set->loops->len; ++i) {
+        MkLoop* loop = g_ptr_array_index(set->loops, i);
+        if (loop->modules < least->modules)
+            least = loop;
+    }
+
+    return least;
+}
+
+
+void mk_loop_set_foreach_item(MkLoopSet* set, GFunc func, gpointer data)
+{
+    for (guint i = 0; i < set->loops->len; ++i) {
+        MkLoop* loop = g_ptr_array_index(set->loops, i);
+        for (guint j = 0; j < set->loops->len; ++j)
+            mk_queue_foreach(&loop->inbound[j], func, data);
+    }
+}
+
+
+MkLoop* mk_loop_current(void)
+{
+    return g_private_get(&m_current);
+}
+
+
+void mk_loop_post(MkLoopSet* set, MkLoop* loop, MkQueueLink* item)
+{
+    MkLoop* current = mk_loop_current();
+
+    if (loop == NULL)
+        loop = g_ptr_array_index(set->loops, 0);
+
+    mk_queue_push(&loop->inbound[current != NULL ? current->index : 0], item);
+
+    // One wakeup is enough until the loop handles its items
+    if (g_atomic_int_compare_and_exchange(&loop->signaled, 0, 1)
+        && write(loop->wake[1], "", 1) < 0)
+        ; // The pipe is full: a wakeup is already pending
+}
+
+
+guint mk_loop_add_watch(MkLoop*      loop,
+                        GIOChannel*  channel,
+                        GIOCondition condition,
+                        GIOFunc      func,
+                        gpointer     data)
+{
+    if (loop == NULL)
+        return g_io_add_watch(channel, condition, func, data);
+
+    GSource* source = g_io_create_watch(channel, condition);
+    g_source_set_callback(source, (GSourceFunc)func, data, NULL);
+    guint id = g_source_attach(source, loop->context);
+    g_source_unref(source);
+
+    return id;
+}
+
+
+guint mk_loop_add_timeout(MkLoop*     loop,
+                          const guint interval,
+                          GSourceFunc func,
+                          gpointer    data)
+{
+    if (loop == NULL)
+        return g_timeout_add(interval, func, data);
+
+    GSource* source = g_timeout_source_new(interval);
+    g_source_set_callback(source, func, data, NULL);
+    guint id = g_source_attach(source, loop->context);
+    g_source_unref(source);
+
+    return id;
+}
+
+
+void mk_loop_remove_source(MkLoop* loop, const guint id)
+{
+    if (loop == NULL) {
+        g_source_remove(id);
+        return;
+    }
+
+    GSource* source = g_main_context_find_source_by_id(loop->context, id);
+    if (source != NULL)
+        g_source_destroy(source);
+}
+
+
+gboolean mk_loop_remove_by_user_data(MkLoop* loop, gpointer data)
+{
+    if (loop == NULL)
+        return g_source_remove_by_user_data(data);
+
+    GSource* source = g_main_context_find_source_by_user_data(loop->context,
+                                                              data);
+    if (source == NULL)
+        return FALSE;
+
+    g_source_destroy(source);
+    return TRUE;
+}
@@ -0,0 +1,203 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+/**
+ * @file
+ * Worker event loops.
+ *
+ * A loop set is made of the control loop, which is the default main loop
+ * of the program, and of worker loops running on their own threads. Each
+ * worker loop watches its own file descriptors, so that I/O on different
+ * loops happens in parallel.
+ *
+ * Loops never share data directly. Items are passed from one loop to
+ * another through lock-free single-producer, single-consumer queues, one
+ * for each pair of loops, and handled by a function of the loop set on
+ * the destination loop.
+ *
+ * The control loop has the last word: while it is not polling, it holds
+ * the lock of every worker loop, and worker loops only dispatch events
+ * while holding their own lock. Code running on the control loop can thus
+ * use anything owned by the workers. Before the control loop dispatches
+ * events, it handles all the items left in all the queues, so that the
+ * items posted before an event are handled before it.
+ *
+ * Only one loop set can exist at a time.
+ */
+
+#ifndef __LOOP_H__
+#define __LOOP_H__
+
+#include <glib.h>
+
+#include "queue.h"
+
+
+/**
+ * Function handling the items posted to a loop.
+ * @param item the item, which is freed with g_free() afterwards
+ * @param data data passed to mk_loop_set_new()
+ */
+typedef void(*MkLoopFunc)(MkQueueLink* item, gpointer data);
+
+
+struct MkLoopSet;
+
+/**
+ * Event loop of a loop set.
+ * @brief Event loop.
+ */
+typedef struct {
+    struct MkLoopSet* set;      /// Loop set the loop belongs to
+    guint             index;    /// Index in the set, 0 for the control loop
+    GMainContext*     context;  /// Main context, NULL for the default one
+    GThread*          thread;   /// Worker thread, or NULL
+    gint              stop;     /// Must the worker thread stop?
+    GMutex            lock;     /// Held by whoever runs the worker
+    gint              waiting;  /// Is the worker waiting for its lock?
+    gint              wake[2];  /// Pipe waking the loop up
+    gint              signaled; /// Was the loop woken up already?
+    MkQueue*          inbound;  /// Items from each loop of the set
+    guint             modules;  /// Number of modules using the loop
+} MkLoop;
+
+
+/**
+ * Control loop and worker loops.
+ * @brief Loop set.
+ */
+typedef struct MkLoopSet {
+    GPtrArray* loops;   /// All the loops, the control loop first
+    MkLoopFunc func;    /// Function handling the items posted
+    gpointer   data;    /// Data for func
+    gint       control; /// Is the control loop taking the locks?
+} MkLoopSet;
+
+
+/**
+ * Create a set of loops and start its worker threads. The control loop is
+ * the default main loop, which must be run by the calling thread.
+ * @param workers number of worker loops
+ * @param func    function handling the items posted to the loops
+ * @param data    data for func
+ * @return        a new loop set
+ */
+MkLoopSet* mk_loop_set_new(const guint workers, MkLoopFunc func, gpointer data);
+
+
+/**
+ * Stop the worker threads of a loop set, handle the items left in its
+ * queues, and free it. This must be called from the control loop.
+ * @param set the loop set
+ */
+void mk_loop_set_free(MkLoopSet* set);
+
+
+/**
+ * Get the number of worker loops in a set.
+ * @param set the loop set
+ * @return    number of worker loops
+ */
+guint mk_loop_set_workers(MkLoopSet* set);
+
+
+/**
+ * Get one of the worker loops of a set.
+ * @param set   the loop set
+ * @param index worker number, from 0 to mk_loop_set_workers() - 1
+ * @return      the worker loop
+ */
+MkLoop* mk_loop_set_worker(MkLoopSet* set, const guint index);
+
+
+/**
+ * Get the worker loop used by the fewest modules.
+ * @param set the loop set
+ * @return    the worker loop
+ */
+MkLoop* mk_loop_set_least_used(MkLoopSet* set);
+
+
+/**
+ * Call a function for each item waiting in the queues of a loop set. This
+ * must be called from the control loop.
+ * @param set  the loop set
+ * @param func function to call with each item
+ * @param data data to pass to func
+ */
+void mk_loop_set_foreach_item(MkLoopSet* set, GFunc func, gpointer data);
+
+
+/**
+ * Get the worker loop running on the calling thread.
+ * @return the worker loop, or NULL on the control loop
+ */
+MkLoop* mk_loop_current(void);
+
+
+/**
+ * Post an item to a loop from the calling thread's loop.
+ * @param loop the destination loop, or NULL for the control loop
+ * @param set  the loop set
+ * @param item the item, allocated with g_malloc()
+ */
+void mk_loop_post(MkLoopSet* set, MkLoop* loop, MkQueueLink* item);
+
+
+/**
+ * Watch an IO channel from a loop.
+ * @param loop      the loop, or NULL for the control loop
+ * @param channel   the channel
+ * @param condition condition to watch
+ * @param func      function to call
+ * @param data      data for func
+ * @return          the source ID, within the loop
+ */
+guint mk_loop_add_watch(MkLoop*      loop,
+                        GIOChannel*  channel,
+                        GIOCondition condition,
+                        GIOFunc      func,
+                        gpointer     data);
+
+
+/**
+ * Call a function periodically from a loop.
+ * @param loop     the loop, or NULL for the control loop
+ * @param interval time between calls in milliseconds
+ * @param func     function to call, returning FALSE to stop
+ * @param data     data for func
+ * @return         the source ID, within the loop
+ */
+guint mk_loop_add_timeout(MkLoop*     loop,
+                          const guint interval,
+                          GSourceFunc func,
+                          gpointer    data);
+
+
+/**
+ * Remove a source from a loop.
+ * @param loop the loop, or NULL for the control loop
+ * @param id   the source ID, within the loop
+ */
+void mk_loop_remove_source(MkLoop* loop, const guint id);
+
+
+/**
+ * Remove a source from a loop by its user data.
+ * @param loop the loop, or NULL for the control loop
+ * @param data user data of the source
+ * @return     whether a source was found and removed
+ */
+gboolean mk_loop_remove_by_user_data(MkLoop* loop, gpointer data);
+
+#endif // __LOOP_H__
@@ -18,15 +18,21 @@
  * All functions are named after the following pattern:
  * mk_command_(command name).
  *
- * Functions defined in this file are meant to be used with GModule instead
- * of being referenced directly. This is why no header file is provided.
+ * Functions defined in this file are meant to be found by name with
+ * mk_commands_lookup() instead of being referenced directly. This is why
+ * they are not declared in mkapp_commands.h.
  */
 
 
+#include <errno.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <glib.h>
+#include <glib/gprintf.h>
 
 #include "module.h"
+#include "mkapp_commands.h"
 
 
 #define COMMAND_MODULE_NOT_FOUND       "module not found"
@@ -34,11 +40,21 @@
 #define COMMAND_MODULE_ALREADY_RUNNING "module already running"
 #define COMMAND_BINDING_EXISTS         "binding already exists"
 #define COMMAND_BINDING_NOT_EXISTS     "no such binding"
-
-#define COMMAND_DEFINE_USAGE       "usage: define module command [arg...]"
+#define COMMAND_RECORD_FAILED          "could not create recording"
+#define COMMAND_TAP_NOT_EXISTS         "no such tap"
+#define COMMAND_CAPTURE_FAILED         "could not open capture file"
+#define COMMAND_CAPTURE_NOT_EXISTS     "output not captured"
+
+#define COMMAND_DEFINE_USAGE       "usage: define [--lazy] [--idle=seconds] " \
+                                   "[--shard=rr|least|hash:regex] " \
+                                   "[--loop=number] " \
+                                   "module[[count]] command [arg...]"
 #define COMMAND_UNDEFINE_USAGE     "usage: undefine module"
 #define COMMAND_BIND_USAGE         "usage: bind out_module in_module"
 #define COMMAND_UNBIND_USAGE       "usage: unbind out_module in_module"
+#define COMMAND_TAP_USAGE          "usage: tap out_module in_module " \
+                                   "[1/n|bytes/s] [file]"
+#define COMMAND_UNTAP_USAGE        "usage: untap out_module in_module"
 #define COMMAND_RUN_USAGE          "usage: run module"
 #define COMMAND_KILL_USAGE         "usage: kill module"
 #define COMMAND_WAIT_USAGE         "usage: wait module"
@@ -46,14 +62,60 @@
 #define COMMAND_IGNORE_USAGE       "usage: ignore module"
 #define COMMAND_EOF_USAGE          "usage: eof module"
 #define COMMAND_WRITE_USAGE        "usage: write module string"
+#define COMMAND_WRITEB_USAGE       "usage: writeb module length"
+#define COMMAND_FEED_USAGE         "usage: feed module file [offset length]"
+#define COMMAND_CAPTURE_USAGE      "usage: capture [--rotate=size] " \
+                                   "[--sync=size] module file"
+#define COMMAND_UNCAPTURE_USAGE    "usage: uncapture module"
 #define COMMAND_OBEY_USAGE         "usage: obey module"
 #define COMMAND_DISOBEY_USAGE      "usage: disobey module"
+#define COMMAND_SPOOL_USAGE        "usage: spool module"
+#define COMMAND_UNSPOOL_USAGE      "usage: unspool module"
+#define COMMAND_TUNE_USAGE         "usage: tune module option=value..."
+#define COMMAND_RECORD_USAGE       "usage: record file"
+#define COMMAND_UNRECORD_USAGE     "usage: unrecord"
+#define COMMAND_PS_USAGE           "usage: ps"
 #define COMMAND_EXIT_USAGE         "usage: exit [status]"
 
+#define COMMAND_TABLE_BITS 6                         // Bits of a slot index
+#define COMMAND_TABLE_SIZE (1 << COMMAND_TABLE_BITS) // Slots of the table
+#define COMMAND_MAX_SEED   (1 << 16)                 // Seeds tried at most
+
+
+/**
+ * Find the module named by a token of a command. The caller may have
+ * resolved it already.
+ * @param modules module running context
+ * @param tokens  the tokens that make up the command
+ * @param i       index of the token naming the module
+ * @return        module found, or NULL if not found
+ */
+static MkModule* command_module(MkModuleContext* modules,
+                                const gchar**    tokens,
+                                const gsize      i)
+{
+    if (i <= modules->n_prepared)
+        return modules->prepared[i - 1];
+
+    return mk_module_lookup(modules, tokens[i]);
+}
+
 
 /**
  * Define a new module. The module will be initialized and added to the
- * module table. It will not run until command_run() is called.
+ * module table. It will not run until command_run() is called. Commands
+ * starting with "builtin:" define built-in modules (see builtin.h).
+ *
+ * With --lazy, the module is also run when data is first written to it.
+ * With --idle=N, it is lazy and its standard input is closed after N
+ * seconds without input.
+ *
+ * "name[N]" defines a group of N instances of the command, each line
+ * written to the group going to one of them (see mk_module_shard()).
+ * --shard=POLICY chooses how: rr (the default), least or hash:REGEX.
+ *
+ * With --loop=K, the module's I/O is done by worker loop K rather than by
+ * the least used one, if mkapp runs worker loops (see mk_module_set_loop()).
  * @param tokens  the tokens that make up the command
  * @param length  number of tokens
  * @param modules module running context
@@ -63,12 +125,58 @@ const gchar* mk_command_define(const gchar**    tokens,
                                const gsize      length,
                                MkModuleContext* modules)
 {
-    if (length < 3)
+    gboolean     lazy   = FALSE;
+    guint        idle   = 0;
+    const gchar* policy = NULL;
+    gint         loop   = -1;
+    gsize        first;
+
+    // Options come before the module name
+    for (first = 1; first < length && g_str_has_prefix(tokens[first], "--");
+         ++first) {
+        const gchar* option = tokens[first];
+        gchar*       end;
+
+        if (!g_strcmp0(option, "--lazy")) {
+            lazy = TRUE;
+        } else if (g_str_has_prefix(option, "--idle=")) {
+            idle = g_ascii_strtoull(option + 7, &end, 10);
+            lazy = TRUE;
+            if (*end != '\0' || end == option + 7)
+                return COMMAND_DEFINE_USAGE;
+        } else if (g_str_has_prefix(option, "--shard=")) {
+            policy = option + 8;
+        } else if (g_str_has_prefix(option, "--loop=")) {
+            loop = g_ascii_strtoull(option + 7, &end, 10);
+            if (*end != '\0' || end == option + 7 || loop < 0)
+                return COMMAND_DEFINE_USAGE;
+        } else {
+            return COMMAND_DEFINE_USAGE;
+        }
+    }
+
+    if (length < first + 2)
         return COMMAND_DEFINE_USAGE;
 
-    const gchar*  name = tokens[1];
-    const gchar** argv = &tokens[2];
-    const gint    argc = length - 2;
+    const gchar** argv  = &tokens[first + 1];
+    const gint    argc  = length - first - 1;
+    gchar*        name  = g_strdup(tokens[first]);
+    guint         count = 0;
+
+    // A group of instances is defined as "name[count]"
+    gchar* bracket = strchr(name, '[');
+    if (bracket != NULL) {
+        gchar* end;
+        count = g_ascii_strtoull(bracket + 1, &end, 10);
+        if (count == 0 || end[0] != ']' || end[1] != '\0') {
+            g_free(name);
+            return COMMAND_DEFINE_USAGE;
+        }
+        *bracket = '\0';
+    } else if (policy != NULL) {
+        g_free(name);
+        return COMMAND_DEFINE_USAGE;
+    }
     
     MkModule* module = mk_module_new(modules, name, argv[0]);
     g_assert(module != NULL);
@@ -76,6 +184,19 @@ const gchar* mk_command_define(const gchar**    tokens,
     if (argc > 1)
         mk_module_append_args(module, argc-1, &argv[1]);
 
+    if (lazy)
+        mk_module_set_lazy(module, idle);
+    mk_module_set_loop(module, loop);
+
+    if (count > 0) {
+        const gchar* error = mk_module_shard(module, count, policy);
+        if (error != NULL) {
+            mk_module_delete(module);
+            g_free(name);
+            return error;
+        }
+    }
+
     MkModule* existing = mk_module_lookup(modules, name);
     if (existing) {
         g_debug("Module %s already exists => killing and removing",
@@ -86,6 +207,7 @@ const gchar* mk_command_define(const gchar**    tokens,
     }
     
     mk_module_add(modules, module);
+    g_free(name);
 
     return NULL;    
 }
@@ -106,9 +228,7 @@ const gchar* mk_command_undefine(const gchar**    tokens,
     if (length != 2)
         return COMMAND_UNDEFINE_USAGE;
 
-    const gchar* name = tokens[1];
-
-    MkModule* module = mk_module_lookup(modules, name);
+    MkModule* module = command_module(modules, tokens, 1);
     if (module == NULL)
         return COMMAND_MODULE_NOT_FOUND;
 
@@ -135,11 +255,8 @@ const gchar* mk_command_bind(const gchar**    tokens,
     if (length != 3)
         return COMMAND_BIND_USAGE;
 
-    const gchar* out_name = tokens[1];
-    const gchar* in_name  = tokens[2];
-
-    MkModule* out_module = mk_module_lookup(modules, out_name);
-    MkModule* in_module  = mk_module_lookup(modules, in_name);
+    MkModule* out_module = command_module(modules, tokens, 1);
+    MkModule* in_module  = command_module(modules, tokens, 2);
 
     if (out_module == NULL || in_module == NULL)
         return COMMAND_MODULE_NOT_FOUND;
@@ -167,11 +284,8 @@ const gchar* mk_command_unbind(const gchar**    tokens,
     if (length != 3)
         return COMMAND_UNBIND_USAGE;
 
-    const gchar* out_name = tokens[1];
-    const gchar* in_name  = tokens[2];
-
-    MkModule* out_module = mk_module_lookup(modules, out_name);
-    MkModule* in_module  = mk_module_lookup(modules, in_name);
+    MkModule* out_module = command_module(modules, tokens, 1);
+    MkModule* in_module  = command_module(modules, tokens, 2);
 
     if (out_module == NULL || in_module == NULL)
         return COMMAND_MODULE_NOT_FOUND;
@@ -185,6 +299,78 @@ const gchar* mk_command_unbind(const gchar**    tokens,
 }
 
 
+/**
+ * Copy a sample of a binding's traffic to the standard output, or append
+ * it to a file: every line, every Nth line ("1/N") or lines up to a number
+ * of bytes per second ("BYTES/s"). Unlike listening to the module providing
+ * the output, this does not flush each chunk of data (see tap.h).
+ * @param tokens  the tokens that make up the command
+ * @param length  number of tokens
+ * @param modules module running context
+ * @return        error string if any, or NULL
+ */
+const gchar* mk_command_tap(const gchar**    tokens,
+                            const gsize      length,
+                            MkModuleContext* modules)
+{
+    if (length < 3 || length > 5)
+        return COMMAND_TAP_USAGE;
+
+    MkModule* out_module = command_module(modules, tokens, 1);
+    MkModule* in_module  = command_module(modules, tokens, 2);
+
+    if (out_module == NULL || in_module == NULL)
+        return COMMAND_MODULE_NOT_FOUND;
+
+    if (!mk_module_binding_exists(out_module, in_module))
+        return COMMAND_BINDING_NOT_EXISTS;
+
+    // With a single optional argument, a sampling is a number followed by
+    // a slash: anything else is a file name
+    const gchar* sampling = NULL;
+    const gchar* path     = NULL;
+
+    if (length == 5) {
+        sampling = tokens[3];
+        path     = tokens[4];
+    } else if (length == 4) {
+        if (g_ascii_isdigit(tokens[3][0]) && strchr(tokens[3], '/') != NULL)
+            sampling = tokens[3];
+        else
+            path = tokens[3];
+    }
+
+    return mk_module_tap(out_module, in_module, sampling, path);
+}
+
+
+/**
+ * Remove a tap installed with mk_command_tap().
+ * @param tokens  the tokens that make up the command
+ * @param length  number of tokens
+ * @param modules module running context
+ * @return        error string if any, or NULL
+ */
+const gchar* mk_command_untap(const gchar**    tokens,
+                              const gsize      length,
+                              MkModuleContext* modules)
+{
+    if (length != 3)
+        return COMMAND_UNTAP_USAGE;
+
+    MkModule* out_module = command_module(modules, tokens, 1);
+    MkModule* in_module  = command_module(modules, tokens, 2);
+
+    if (out_module == NULL || in_module == NULL)
+        return COMMAND_MODULE_NOT_FOUND;
+
+    if (!mk_module_untap(out_module, in_module))
+        return COMMAND_TAP_NOT_EXISTS;
+
+    return NULL;
+}
+
+
 /**
  * Run a module defined with mk_command_define().
  * @param tokens  the tokens that make up the command
@@ -199,9 +385,7 @@ const gchar* mk_command_run(const gchar**    tokens,
     if (length != 2)
         return COMMAND_RUN_USAGE;
 
-    const gchar* name = tokens[1];
-
-    MkModule* module = mk_module_lookup(modules, name);
+    MkModule* module = command_module(modules, tokens, 1);
     if (module == NULL)
         return COMMAND_MODULE_NOT_FOUND;
 
@@ -229,9 +413,7 @@ const gchar* mk_command_kill(const gchar**    tokens,
     if (length != 2)
         return COMMAND_KILL_USAGE;
 
-    const gchar* name = tokens[1];
-
-    MkModule* module = mk_module_lookup(modules, name);
+    MkModule* module = command_module(modules, tokens, 1);
     if (module == NULL)
         return COMMAND_MODULE_NOT_FOUND;
 
@@ -258,9 +440,7 @@ const gchar* mk_command_wait(const gchar**    tokens,
     if (length != 2)
         return COMMAND_WAIT_USAGE;
 
-    const gchar* name = tokens[1];
-
-    MkModule* module = mk_module_lookup(modules, name);
+    MkModule* module = command_module(modules, tokens, 1);
     if (module == NULL)
         return COMMAND_MODULE_NOT_FOUND;
 
@@ -287,9 +467,7 @@ const gchar* mk_command_listen(const gchar**    tokens,
     if (length != 2)
         return COMMAND_LISTEN_USAGE;
 
-    const gchar* name = tokens[1];
-
-    MkModule* module = mk_module_lookup(modules, name);
+    MkModule* module = command_module(modules, tokens, 1);
     if (module == NULL)
         return COMMAND_MODULE_NOT_FOUND;
 
@@ -313,9 +491,7 @@ const gchar* mk_command_ignore(const gchar**    tokens,
     if (length != 2)
         return COMMAND_IGNORE_USAGE;
 
-    const gchar* name = tokens[1];
-
-    MkModule* module = mk_module_lookup(modules, name);
+    MkModule* module = command_module(modules, tokens, 1);
     if (module == NULL)
         return COMMAND_MODULE_NOT_FOUND;
 
@@ -339,9 +515,7 @@ const gchar* mk_command_eof(const gchar**    tokens,
     if (length != 2)
         return COMMAND_EOF_USAGE;
 
-    const gchar* name = tokens[1];
-
-    MkModule* module = mk_module_lookup(modules, name);
+    MkModule* module = command_module(modules, tokens, 1);
     if (module == NULL)
         return COMMAND_MODULE_NOT_FOUND;
 
@@ -369,20 +543,162 @@ const gchar* mk_command_write(const gchar**    tokens,
     if (length < 3)
         return COMMAND_WRITE_USAGE;
 
-    const gchar* name = tokens[1];
-
-    MkModule* module = mk_module_lookup(modules, name);
+    MkModule* module = command_module(modules, tokens, 1);
     if (module == NULL)
         return COMMAND_MODULE_NOT_FOUND;
 
-    if (!mk_module_is_running(module))
+    // Within a batch, the module may be run by a later command
+    if (!mk_module_is_running(module) && !module->spooling && !module->lazy
+        && modules->batching == 0)
         return COMMAND_MODULE_NOT_RUNNING;
 
+    // The line goes to the module in one piece
+    GString* line = g_string_new("");
     for(gsize i = 2; i < length; ++i) {
-        mk_module_write(module, tokens[i], -1);
-        mk_module_write(module, " ", -1);
+        g_string_append(line, tokens[i]);
+        g_string_append_c(line, ' ');
     }
-    mk_module_write(module, "\n", -1);
+    g_string_append_c(line, '\n');
+
+    mk_module_write(module, line->str, line->len);
+    g_string_free(line, TRUE);
+
+    return NULL;
+}
+
+
+/**
+ * Write bytes to a module's standard input as they are. In mkapp files,
+ * they are the number of bytes given by the command that follow its ";"
+ * (see mkapp_parser.h), which the parser passes as a last token that may
+ * hold any byte, including NUL, and is not NUL-terminated.
+ * @param tokens  the tokens that make up the command
+ * @param length  number of tokens
+ * @param modules module running context
+ * @return        error string if any, or NULL
+ */
+const gchar* mk_command_writeb(const gchar**    tokens,
+                               const gsize      length,
+                               MkModuleContext* modules)
+{
+    gsize size;
+    if (length != 4 || !mk_commands_data_length(tokens[2], &size))
+        return COMMAND_WRITEB_USAGE;
+
+    MkModule* module = command_module(modules, tokens, 1);
+    if (module == NULL)
+        return COMMAND_MODULE_NOT_FOUND;
+
+    // Within a batch, the module may be run by a later command
+    if (!mk_module_is_running(module) && !module->spooling && !module->lazy
+        && modules->batching == 0)
+        return COMMAND_MODULE_NOT_RUNNING;
+
+    if (size > 0)
+        mk_module_write(module, tokens[3], size);
+
+    return NULL;
+}
+
+
+/**
+ * Copy a file, or the part of it starting at offset, to a module's standard
+ * input (see mk_module_feed()).
+ * @param tokens  the tokens that make up the command
+ * @param length  number of tokens
+ * @param modules module running context
+ * @return        error string if any, or NULL
+ */
+const gchar* mk_command_feed(const gchar**    tokens,
+                             const gsize      length,
+                             MkModuleContext* modules)
+{
+    if (length != 3 && length != 5)
+        return COMMAND_FEED_USAGE;
+
+    MkModule* module = command_module(modules, tokens, 1);
+    if (module == NULL)
+        return COMMAND_MODULE_NOT_FOUND;
+
+    gsize offset = 0;
+    gsize size   = (gsize)-1;
+
+    if (length == 5 && (!mk_commands_data_length(tokens[3], &offset)
+                        || !mk_commands_data_length(tokens[4], &size)))
+        return COMMAND_FEED_USAGE;
+
+    return mk_module_feed(module, tokens[2], offset, size);
+}
+
+
+/**
+ * Append a module's output to a file (see mk_module_capture()). With
+ * --rotate=SIZE, the file is renamed with a numeric suffix and started
+ * again whenever it reaches SIZE. With --sync=SIZE, it is flushed to disk
+ * every SIZE bytes. Sizes accept a K, M or G suffix.
+ * @param tokens  the tokens that make up the command
+ * @param length  number of tokens
+ * @param modules module running context
+ * @return        error string if any, or NULL
+ */
+const gchar* mk_command_capture(const gchar**    tokens,
+                                const gsize      length,
+                                MkModuleContext* modules)
+{
+    guint64 rotate = 0;
+    guint64 sync   = 0;
+    gsize   first;
+
+    // Options come before the module name
+    for (first = 1; first < length && g_str_has_prefix(tokens[first], "--");
+         ++first) {
+        const gchar* option = tokens[first];
+
+        if (g_str_has_prefix(option, "--rotate=")) {
+            if (!mk_tuning_parse_size(option + 9, &rotate))
+                return COMMAND_CAPTURE_USAGE;
+        } else if (g_str_has_prefix(option, "--sync=")) {
+            if (!mk_tuning_parse_size(option + 7, &sync))
+                return COMMAND_CAPTURE_USAGE;
+        } else {
+            return COMMAND_CAPTURE_USAGE;
+        }
+    }
+
+    if (length - first != 2)
+        return COMMAND_CAPTURE_USAGE;
+
+    MkModule* module = mk_module_lookup(modules, tokens[first]);
+    if (module == NULL)
+        return COMMAND_MODULE_NOT_FOUND;
+
+    if (!mk_module_capture(module, tokens[first + 1], rotate, sync))
+        return COMMAND_CAPTURE_FAILED;
+
+    return NULL;
+}
+
+
+/**
+ * Stop capturing a module's output.
+ * @param tokens  the tokens that make up the command
+ * @param length  number of tokens
+ * @param modules module running context
+ * @return        error string if any, or NULL
+ */
+const gchar* mk_command_uncapture(const gchar**    tokens,
+                                  const gsize      length,
+                                  MkModuleContext* modules)
+{
+    if (length != 2)
+        return COMMAND_UNCAPTURE_USAGE;
+
+    MkModule* module = command_module(modules, tokens, 1);
+    if (module == NULL)
+        return COMMAND_MODULE_NOT_FOUND;
+
+    if (!mk_module_uncapture(module))
+        return COMMAND_CAPTURE_NOT_EXISTS;
 
     return NULL;
 }
@@ -402,9 +718,7 @@ const gchar* mk_command_obey(const gchar**    tokens,
     if (length != 2)
         return COMMAND_OBEY_USAGE;
 
-    const gchar* name = tokens[1];
-
-    MkModule* module = mk_module_lookup(modules, name);
+    MkModule* module = command_module(modules, tokens, 1);
     if (module == NULL)
         return COMMAND_MODULE_NOT_FOUND;
 
@@ -428,9 +742,7 @@ const gchar* mk_command_disobey(const gchar**    tokens,
     if (length != 2)
         return COMMAND_DISOBEY_USAGE;
 
-    const gchar* name = tokens[1];
-
-    MkModule* module = mk_module_lookup(modules, name);
+    MkModule* module = command_module(modules, tokens, 1);
     if (module == NULL)
         return COMMAND_MODULE_NOT_FOUND;
 
@@ -440,6 +752,188 @@ const gchar* mk_command_disobey(const gchar**    tokens,
 }
 
 
+/**
+ * Keep the data written to a module while it is not running, instead of
+ * dropping it, and write it when the module starts. Data kept beyond the
+ * in-memory budget goes to a spool file.
+ * @param tokens  the tokens that make up the command
+ * @param length  number of tokens
+ * @param modules module running context
+ * @return        error string if any, or NULL
+ */
+const gchar* mk_command_spool(const gchar**    tokens,
+                              const gsize      length,
+                              MkModuleContext* modules)
+{
+    if (length != 2)
+        return COMMAND_SPOOL_USAGE;
+
+    MkModule* module = command_module(modules, tokens, 1);
+    if (module == NULL)
+        return COMMAND_MODULE_NOT_FOUND;
+
+    mk_module_spool(module);
+
+    return NULL;
+}
+
+
+/**
+ * Stop keeping the data written to a module while it is not running.
+ * @param tokens  the tokens that make up the command
+ * @param length  number of tokens
+ * @param modules module running context
+ * @return        error string if any, or NULL
+ */
+const gchar* mk_command_unspool(const gchar**    tokens,
+                                const gsize      length,
+                                MkModuleContext* modules)
+{
+    if (length != 2)
+        return COMMAND_UNSPOOL_USAGE;
+
+    MkModule* module = command_module(modules, tokens, 1);
+    if (module == NULL)
+        return COMMAND_MODULE_NOT_FOUND;
+
+    mk_module_unspool(module);
+
+    return NULL;
+}
+
+
+/**
+ * Set scheduling and resource options (CPU affinity, priority, I/O
+ * priority, resource limits, control group) for a module's process. They
+ * are applied when the module is spawned. The "lane" option sets the
+ * priority lane of the module's output instead (see mk_module_tune()).
+ * @param tokens  the tokens that make up the command
+ * @param length  number of tokens
+ * @param modules module running context
+ * @return        error string if any, or NULL
+ */
+const gchar* mk_command_tune(const gchar**    tokens,
+                             const gsize      length,
+                             MkModuleContext* modules)
+{
+    if (length < 3)
+        return COMMAND_TUNE_USAGE;
+
+    MkModule* module = command_module(modules, tokens, 1);
+    if (module == NULL)
+        return COMMAND_MODULE_NOT_FOUND;
+
+    for (gsize i = 2; i < length; ++i) {
+        const gchar* error = mk_module_tune(module, tokens[i]);
+        if (error != NULL)
+            return error;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Record traffic to a file: all data read from modules, and the commands
+ * obeyed from them. The recording can be played back with mkreplay.
+ * @param tokens  the tokens that make up the command
+ * @param length  number of tokens
+ * @param modules module running context
+ * @return        error string if any, or NULL
+ */
+const gchar* mk_command_record(const gchar**    tokens,
+                               const gsize      length,
+                               MkModuleContext* modules)
+{
+    if (length != 2)
+        return COMMAND_RECORD_USAGE;
+
+    if (!mk_module_record(modules, tokens[1]))
+        return COMMAND_RECORD_FAILED;
+
+    return NULL;
+}
+
+
+/**
+ * Stop recording traffic.
+ * @param tokens  the tokens that make up the command
+ * @param length  number of tokens
+ * @param modules module running context
+ * @return        error string if any, or NULL
+ */
+const gchar* mk_command_unrecord(const gchar**    tokens,
+                                 const gsize      length,
+                                 MkModuleContext* modules)
+{
+    if (length != 1)
+        return COMMAND_UNRECORD_USAGE;
+
+    mk_module_unrecord(modules);
+    return NULL;
+}
+
+
+/**
+ * Print the resource usage of a module as a line of the ps command.
+ * @param module the module
+ */
+static void command_ps_module(MkModule* module)
+{
+    MkUsage* usage   = &module->usage;
+    gboolean running = mk_module_is_running(module);
+
+    const gchar* state = running             ? "running"
+                       : usage->started != 0 ? "exited"
+                       : "defined";
+
+    g_printf("%-16s %7d %-8s %6.1f %9ld %9ld %9.2f %9.1f %11.0f %11.0f\n",
+             module->name, running ? (gint)module->pid : 0, state,
+             usage->cpu_percent, usage->rss, usage->max_rss,
+             usage->user_time + usage->system_time,
+             mk_usage_uptime(usage), usage->rate_in, usage->rate_out);
+}
+
+
+/**
+ * Print the resource usage of all modules on standard output: process ID,
+ * state, CPU usage, resident set size, CPU time, uptime and input and
+ * output rates. Figures are those of the last sample for running modules
+ * and the final ones for modules that have exited.
+ * @param tokens  the tokens that make up the command
+ * @param length  number of tokens
+ * @param modules module running context
+ * @return        error string if any, or NULL
+ */
+const gchar* mk_command_ps(const gchar**    tokens,
+                           const gsize      length,
+                           MkModuleContext* modules)
+{
+    if (length != 1)
+        return COMMAND_PS_USAGE;
+
+    GList* names = g_hash_table_get_keys(modules->modules);
+    names = g_list_sort(names, (GCompareFunc)g_strcmp0);
+
+    g_printf("%-16s %7s %-8s %6s %9s %9s %9s %9s %11s %11s\n",
+             "NAME", "PID", "STATE", "CPU%", "RSS", "MAXRSS", "TIME",
+             "UPTIME", "IN/s", "OUT/s");
+
+    // The instances of a group follow it
+    for (GList* n = names; n != NULL; n = n->next) {
+        MkModule* module = g_hash_table_lookup(modules->modules, n->data);
+        command_ps_module(module);
+        if (module->instances != NULL)
+            for (guint i = 0; i < module->instances->len; ++i)
+                command_ps_module(g_ptr_array_index(module->instances, i));
+    }
+
+    fflush(stdout);
+    g_list_free(names);
+    return NULL;
+}
+
+
 /**
  * Exit.
  * @param tokens  the tokens that make up the command
@@ -466,3 +960,117 @@ const gchar* mk_command_exit(const gchar**    tokens,
 
     return NULL;
 }
+
+
+/**
+ * Built-in commands, by name.
+ */
+static const MkCommand m_commands[] = {
+    { "define",    mk_command_define,    0 },
+    { "undefine",  mk_command_undefine,  1 },
+    { "bind",      mk_command_bind,      2 },
+    { "unbind",    mk_command_unbind,    2 },
+    { "tap",       mk_command_tap,       2 },
+    { "untap",     mk_command_untap,     2 },
+    { "run",       mk_command_run,       1 },
+    { "kill",      mk_command_kill,      1 },
+    { "wait",      mk_command_wait,      1 },
+    { "listen",    mk_command_listen,    1 },
+    { "ignore",    mk_command_ignore,    1 },
+    { "eof",       mk_command_eof,       1 },
+    { "write",     mk_command_write,     1 },
+    { "writeb",    mk_command_writeb,    1 },
+    { "feed",      mk_command_feed,      1 },
+    { "capture",   mk_command_capture,   0 },
+    { "uncapture", mk_command_uncapture, 1 },
+    { "obey",      mk_command_obey,      1 },
+    { "disobey",   mk_command_disobey,   1 },
+    { "spool",     mk_command_spool,     1 },
+    { "unspool",   mk_command_unspool,   1 },
+    { "tune",      mk_command_tune,      1 },
+    { "record",    mk_command_record,    0 },
+    { "unrecord",  mk_command_unrecord,  0 },
+    { "ps",        mk_command_ps,        0 },
+    { "exit",      mk_command_exit,      0 },
+};
+
+static guint8  m_slots[COMMAND_TABLE_SIZE]; // Index of a command + 1, or 0
+static guint32 m_seed = 0;                  // Seed of the perfect hash
+
+
+/**
+ * Get the slot of a command name in the table, from the high bits of its
+ * FNV-1a hash (the low bits only depend on the low bits of the seed).
+ * @param name the name
+ * @param seed value mixed into the hash, chosen so that no two commands
+ *             share a slot
+ * @return     the slot
+ */
+static guint32 commands_slot(const gchar* name, guint32 seed)
+{
+    guint32 hash = 2166136261u ^ seed;
+
+    for (const guchar* p = (const guchar*)name; *p != '\0'; ++p)
+        hash = (hash ^ *p) * 16777619u;
+
+    return hash >> (32 - COMMAND_TABLE_BITS);
+}
+
+
+/**
+ * Fill the command table with a seed.
+ * @param seed the seed
+ * @return     whether each command has a slot of its own
+ */
+static gboolean commands_fill(guint32 seed)
+{
+    memset(m_slots, 0, sizeof(m_slots));
+
+    for (gsize i = 0; i < G_N_ELEMENTS(m_commands); ++i) {
+        guint32 slot = commands_slot(m_commands[i].name, seed);
+        if (m_slots[slot] != 0)
+            return FALSE;
+        m_slots[slot] = i + 1;
+    }
+
+    return TRUE;
+}
+
+
+const MkCommand* mk_commands_lookup(const gchar* name)
+{
+    static gsize built = 0;
+
+    // Try seeds until one gives each command a slot of its own
+    if (g_once_init_enter(&built)) {
+        g_assert(G_N_ELEMENTS(m_commands) * 2 <= COMMAND_TABLE_SIZE);
+        for (m_seed = 0; !commands_fill(m_seed); ++m_seed)
+            if (m_seed == COMMAND_MAX_SEED)
+                g_error("No perfect hash for the command table.");
+        g_once_init_leave(&built, 1);
+    }
+
+    guint8 index = m_slots[commands_slot(name, m_seed)];
+    if (index == 0 || strcmp(m_commands[index - 1].name, name))
+        return NULL;
+
+    return &m_commands[index - 1];
+}
+
+
+gboolean mk_commands_data_length(const gchar* token, gsize* length)
+{
+    gchar*  end;
+    guint64 value;
+
+    if (!g_ascii_isdigit(*token))
+        return FALSE;
+
+    errno = 0;
+    value = g_ascii_strtoull(token, &end, 10);
+    if (*end != '\0' || errno == ERANGE || value > G_MAXSIZE)
+        return FALSE;
+
+    *length = value;
+    return TRUE;
+}
@@ -0,0 +1,76 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+
+/**
+ * @file
+ * Table of the mkapp commands.
+ *
+ * The commands of mkapp_commands.c are found by name in a perfect hash
+ * table built the first time a command is looked up: each name has a slot
+ * of its own, so that a lookup costs one hash and one string comparison.
+ *
+ * Commands naming modules right after their own name let the caller
+ * resolve these modules beforehand (see MkModuleContext's prepared array).
+ */
+
+#ifndef __MKAPP_COMMANDS_H__
+#define __MKAPP_COMMANDS_H__
+
+#include <glib.h>
+
+#include "module.h"
+
+
+/**
+ * Command function type. All mkapp commands are executed by a
+ * mk_command_... function with this signature.
+ * @param tokens  the tokens that make up the command
+ * @param length  number of tokens
+ * @param modules table of declared modules
+ * @return        an error string, or NULL if there are no errors
+ */
+typedef const gchar*(*MkCommandFunc)(const gchar**    tokens,
+                                     const gsize      length,
+                                     MkModuleContext* modules);
+
+
+/**
+ * Built-in command.
+ */
+typedef struct {
+    const gchar*  name;    /// Name of the command
+    MkCommandFunc f;       /// Function executing the command
+    guint         modules; /// Number of module names following the name
+} MkCommand;
+
+
+/**
+ * Find a built-in command.
+ * @param name name of the command
+ * @return     the command, or NULL if there is no such built-in command
+ */
+const MkCommand* mk_commands_lookup(const gchar* name);
+
+
+/**
+ * Parse a number of bytes, such as the length of the data written by a
+ * writeb command or the part of a file fed to a module.
+ * @param token  the token giving the number, without a sign
+ * @param length where to store the number
+ * @return       whether the token is a valid number, small enough to be
+ *               the size of a buffer
+ */
+gboolean mk_commands_data_length(const gchar* token, gsize* length);
+
+#endif // __MKAPP_COMMANDS_H__
@@ -11,117 +11,844 @@
  * http://www.gnu.org/copyleft/gpl.html
  */
 
+#include <string.h>
+
 #include <glib.h>
 #include <glib/gprintf.h>
 #include <gmodule.h>
 
 #include "module.h"
 #include "parser.h"
+#include "mkapp_commands.h"
+#include "compiled.h"
 
 
 /**
- * Command function type. All mkapp commands are executed by a command_...
- * fonction with this signature.
- * @param tokens  the tokens that make up the command
- * @param length  number of tokens
- * @param modules table of declared modules
- * @return        an error string, or NULL if there are no errors
+ * Memory in which the tokens of a command are expanded before it runs. It
+ * is emptied once the command has run, but keeps its memory for the next
+ * one.
+ * @brief Command arena.
  */
-typedef const gchar*(*CommandFunc)(const gchar**    tokens,
-                                   const gsize      length,
-                                   MkModuleContext* modules);
+typedef struct {
+    GString*   chars;   /// Expanded tokens, NUL-separated
+    GPtrArray* tokens;  /// Pointers to the expanded tokens, NULL-terminated
+    gboolean   invalid; /// Was an invalid token reported?
+} MkappArena;
+
+
+#define PREPARED_WAYS 4 // Prepared commands kept per built-in command
+
+
+/**
+ * Modules named by the latest occurrences of a built-in command, resolved
+ * once and for all. When the command names the same modules again, they
+ * are found by comparing names, without hashing them, and handles keep
+ * following the names when modules are redefined.
+ * @brief Prepared commands.
+ */
+typedef struct {
+    gchar*         names[PREPARED_WAYS][2];   /// Module names, or NULL
+    MkModuleHandle handles[PREPARED_WAYS][2]; /// Handles on the names
+    guint          next;                      /// Entry to replace next
+} MkappPrepared;
+
+
+/**
+ * State of a source of commands: the input, or an obeyed module. Each
+ * source has a parser of its own, so that a command, or the data of a
+ * writeb command, split across reads is not mixed up with what other
+ * sources send in between.
+ * @brief Command source.
+ */
+typedef struct {
+    MkParserContext* parser;  /// Parser of the commands of the source
+    GPtrArray*       batch;   /// Commands between begin and commit, or NULL
+    gchar**          writeb;  /// writeb command reading its data, or NULL
+    GString*         raw;     /// Data of that command read so far
+    guint            parsing; /// Number of calls parsing its commands
+    gboolean         ended;   /// Did the source end while being parsed?
+} MkappSource;
 
 
 typedef struct {
     MkModuleContext* modules;
+    GPtrArray*       arenas;    /// One arena per level of nested commands
+    guint            executing; /// Number of commands being executed
+    GHashTable*      prepared;  /// Prepared commands (key=MkCommand)
+    MkappSource      input;     /// The input, as a source of commands
+    GHashTable*      sources;   /// Obeyed modules' sources (key=name)
+    MkCompiler*      compiler;  /// Compiler of the file read, or NULL
 } MkappParserData;
 
 
 /**
- * Execute a command based on its token list. A function called
- * "mk_command_...", where ... is the command name, will be looked up.
- * If it exists, it will be executed.
+ * Append a token to an arena, expanding its escape sequences the way
+ * g_strcompress() does.
+ * @param arena the arena
+ * @param token the token
+ */
+static void arena_append_token(MkappArena* arena, const gchar* token)
+{
+    const gchar* p = token;
+
+    while (*p != '\0') {
+        // Copy everything up to the next backslash at once
+        gsize n = strcspn(p, "\\");
+        g_string_append_len(arena->chars, p, n);
+        p += n;
+        if (*p == '\0')
+            break;
+
+        switch (*(++p)) {
+        case '\0':
+            g_warning("%s: trailing \\", token);
+            arena->invalid = TRUE;
+            break;
+
+        case '0': case '1': case '2': case '3':
+        case '4': case '5': case '6': case '7': {
+            gchar c = 0;
+            for (gsize i = 0; i < 3 && *p >= '0' && *p <= '7'; ++i, ++p)
+                c = c * 8 + (*p - '0');
+            g_string_append_c(arena->chars, c);
+            continue;
+        }
+
+        case 'b': g_string_append_c(arena->chars, '\b'); break;
+        case 'f': g_string_append_c(arena->chars, '\f'); break;
+        case 'n': g_string_append_c(arena->chars, '\n'); break;
+        case 'r': g_string_append_c(arena->chars, '\r'); break;
+        case 't': g_string_append_c(arena->chars, '\t'); break;
+        case 'v': g_string_append_c(arena->chars, '\v'); break;
+        default:  g_string_append_c(arena->chars, *p);   break;
+        }
+
+        if (*p != '\0')
+            ++p;
+    }
+
+    g_string_append_c(arena->chars, '\0');
+}
+
+
+/**
+ * Expand the tokens of a command into an arena.
+ * @param arena  the arena, which must be empty
+ * @param tokens the tokens
+ * @param length number of tokens
+ * @return       the expanded tokens, NULL-terminated
+ */
+static const gchar** arena_fill(MkappArena*   arena,
+                                const gchar** tokens,
+                                const gsize   length)
+{
+    for (gsize i = 0; i < length; ++i) {
+        g_ptr_array_add(arena->tokens, GSIZE_TO_POINTER(arena->chars->len));
+        arena_append_token(arena, tokens[i]);
+    }
+
+    // Offsets are only turned into pointers once the arena stops growing
+    for (gsize i = 0; i < length; ++i)
+        arena->tokens->pdata[i] = arena->chars->str
+            + GPOINTER_TO_SIZE(arena->tokens->pdata[i]);
+    g_ptr_array_add(arena->tokens, NULL);
+
+    return (const gchar**)(arena->tokens->pdata);
+}
+
+
+/**
+ * Empty an arena, keeping its memory.
+ * @param arena the arena
+ */
+static void arena_reset(MkappArena* arena)
+{
+    g_string_truncate(arena->chars, 0);
+    g_ptr_array_set_size(arena->tokens, 0);
+    arena->invalid = FALSE;
+}
+
+
+/**
+ * Free an arena.
+ * @param arena the arena
+ */
+static void arena_free(MkappArena* arena)
+{
+    g_string_free(arena->chars, TRUE);
+    g_ptr_array_free(arena->tokens, TRUE);
+    g_free(arena);
+}
+
+
+/**
+ * Get the number of tokens of a command that are strings: all of them,
+ * except the data passed to a writeb command.
+ * @param tokens the tokens that make up the command
+ * @param length number of tokens
+ * @return       number of leading tokens that are strings
+ */
+static gsize command_strings(const gchar** tokens, const gsize length)
+{
+    return strcmp(tokens[0], "writeb") ? length : MIN(length, 3);
+}
+
+
+/**
+ * Copy the tokens of a command, including the data passed to a writeb
+ * command, which is NUL-terminated in the copy.
+ * @param tokens the tokens that make up the command
+ * @param length number of tokens
+ * @return       the copy, to free with g_strfreev()
+ */
+static gchar** command_copy(const gchar** tokens, const gsize length)
+{
+    gsize   n    = command_strings(tokens, length);
+    gchar** copy = g_new(gchar*, length + 1);
+
+    for (gsize i = 0; i < n; ++i)
+        copy[i] = g_strdup(tokens[i]);
+
+    if (n < length) {
+        gsize size = 0;
+        mk_commands_data_length(tokens[2], &size);
+        copy[n] = g_malloc(size + 1);
+        memcpy(copy[n], tokens[n], size);
+        copy[n][size] = '\0';
+    }
+
+    copy[length] = NULL;
+    return copy;
+}
+
+
+/**
+ * Free prepared commands.
+ * @param prepared the prepared commands
+ */
+static void prepared_free(MkappPrepared* prepared)
+{
+    for (guint way = 0; way < PREPARED_WAYS; ++way) {
+        g_free(prepared->names[way][0]);
+        g_free(prepared->names[way][1]);
+    }
+    g_free(prepared);
+}
+
+
+/**
+ * Check whether a prepared command names given modules.
+ * @param names  module names of the prepared command
+ * @param tokens module names of the command
+ * @param n      number of module names of the command
+ * @return       whether the module names are the same
+ */
+static gboolean prepared_matches(gchar**       names,
+                                 const gchar** tokens,
+                                 const guint   n)
+{
+    for (guint i = 0; i < 2; ++i)
+        if (i < n ? names[i] == NULL || strcmp(names[i], tokens[i])
+                  : names[i] != NULL)
+            return FALSE;
+
+    return TRUE;
+}
+
+
+/**
+ * Resolve the modules named by a built-in command into the module
+ * context's prepared array, reusing a prepared command naming the same
+ * modules if there is one.
+ * @param data    parser data
+ * @param command the built-in command
  * @param tokens  the tokens that make up the command
  * @param length  number of tokens
- * @param modules the module context that commands will work on
- */
-void execute_command(const char** tokens,
-                     const gsize length,
-                     MkModuleContext* modules)
-{
-    // Use GModule to find the function for this command
-    gboolean command_is_supported = FALSE;
-
-    if (g_module_supported()) {
-        
-        GModule* module = g_module_open(NULL, 0); // Main program
-        CommandFunc fun;
-
-        // Expand all escape sequences
-        gchar** tokens_expanded = g_new(gchar*, length+1);
-        for (gsize i = 0; i < length; ++i)
-            tokens_expanded[i] = g_strcompress(tokens[i]);
-        tokens_expanded[length] = NULL;
-        
-        // Find the function
-        gchar* symbol_name = g_strconcat("mk_command_", tokens[0], NULL);
-        g_debug("%s()", symbol_name);
-        g_module_symbol(module, symbol_name, (gpointer*)&(fun));
-        g_free(symbol_name);
-
-        // Execute the function found
-        if (fun != NULL) {
-            command_is_supported = TRUE;
-            const gchar* error = fun((const gchar**)tokens_expanded,
-                                     length, modules);
-            if (error != NULL)
-                g_fprintf(stderr, "%s: %s\n", tokens[0], error);
-        }
+ */
+static void prepare_command(MkappParserData* data,
+                            const MkCommand* command,
+                            const gchar**    tokens,
+                            const gsize      length)
+{
+    MkModuleContext* modules = data->modules;
+    guint            n       = MIN(command->modules, length - 1);
+
+    modules->n_prepared = n;
+    if (n == 0)
+        return;
+
+    MkappPrepared* prepared = g_hash_table_lookup(data->prepared, command);
+    if (prepared == NULL) {
+        prepared = g_malloc0(sizeof(MkappPrepared));
+        g_hash_table_insert(data->prepared, (gpointer)command, prepared);
+    }
+
+    guint way = 0;
+    while (way < PREPARED_WAYS
+           && !prepared_matches(prepared->names[way], tokens + 1, n))
+        ++way;
 
-        g_module_close(module);
+    // Replace the oldest entry, interning the module names
+    if (way == PREPARED_WAYS) {
+        way            = prepared->next;
+        prepared->next = (way + 1) % PREPARED_WAYS;
+
+        for (guint i = 0; i < 2; ++i) {
+            g_free(prepared->names[way][i]);
+            prepared->names[way][i] = NULL;
+        }
+        for (guint i = 0; i < n; ++i) {
+            prepared->names[way][i] = g_strdup(tokens[i + 1]);
+            mk_module_handle_init(modules, &prepared->handles[way][i],
+                                  tokens[i + 1]);
+        }
     }
 
-    if (!command_is_supported)
+    for (guint i = 0; i < n; ++i)
+        modules->prepared[i] =
+            mk_module_handle_resolve(modules, &prepared->handles[way][i]);
+}
+
+
+/**
+ * Look up a command that is not built in: a function called
+ * "mk_command_...", where ... is the command name, defined by the program
+ * or a library it loaded.
+ * @param name name of the command
+ * @return     the function executing the command, or NULL if there is none
+ */
+static MkCommandFunc lookup_extension_command(const gchar* name)
+{
+    static GModule* program = NULL;
+    MkCommandFunc   fun     = NULL;
+
+    if (!g_module_supported())
+        return NULL;
+
+    // The main program is opened once and for all
+    if (program == NULL)
+        program = g_module_open(NULL, 0);
+
+    gchar* symbol_name = g_strconcat("mk_command_", name, NULL);
+    g_debug("%s()", symbol_name);
+    g_module_symbol(program, symbol_name, (gpointer*)&(fun));
+    g_free(symbol_name);
+
+    return fun;
+}
+
+
+/**
+ * Execute a command based on its token list. Built-in commands are looked
+ * up in the command table (see mkapp_commands.h) and have the modules they
+ * name resolved by prepare_command(), other ones are looked up with
+ * lookup_extension_command(). If the command exists, it is executed.
+ * @param data    parser data
+ * @param tokens  the tokens that make up the command, with their escape
+ *                sequences expanded, NULL-terminated
+ * @param length  number of tokens
+ */
+void execute_command(MkappParserData* data,
+                     const char**     tokens,
+                     const gsize      length)
+{
+    MkModuleContext* modules = data->modules;
+    const MkCommand* command = mk_commands_lookup(tokens[0]);
+    MkCommandFunc    fun     = command != NULL
+                             ? command->f
+                             : lookup_extension_command(tokens[0]);
+
+    if (fun == NULL) {
         g_fprintf(stderr, "%s: command not found.\n", tokens[0]);
+        return;
+    }
+
+    // Record commands obeyed from modules. The data of writeb is recorded
+    // as the output of the module already.
+    if (modules->recorder != NULL && modules->obeyed != NULL) {
+        GString* line = g_string_new(tokens[0]);
+        for (gsize i = 1; i < command_strings(tokens, length); ++i) {
+            g_string_append_c(line, ' ');
+            g_string_append(line, tokens[i]);
+        }
+        mk_recorder_write(modules->recorder, MK_RECORD_COMMAND,
+                          modules->obeyed, line->str, line->len);
+        g_string_free(line, TRUE);
+    }
+
+    // Commands obeyed while this one runs resolve modules of their own
+    guint     n_prepared  = modules->n_prepared;
+    MkModule* prepared[2] = { modules->prepared[0], modules->prepared[1] };
+
+    if (command != NULL)
+        prepare_command(data, command, tokens, length);
+    else
+        modules->n_prepared = 0;
+
+    const gchar* error = fun(tokens, length, modules);
+    if (error != NULL)
+        g_fprintf(stderr, "%s: %s\n", tokens[0], error);
+
+    modules->n_prepared  = n_prepared;
+    modules->prepared[0] = prepared[0];
+    modules->prepared[1] = prepared[1];
+}
+
+
+/**
+ * Initialize a source of commands.
+ * @param source the source
+ * @param parser parser of its commands
+ */
+static void source_init(MkappSource* source, MkParserContext* parser)
+{
+    source->parser  = parser;
+    source->batch   = NULL;
+    source->writeb  = NULL;
+    source->raw     = g_string_new("");
+    source->parsing = 0;
+    source->ended   = FALSE;
+}
+
+
+/**
+ * Drop what a source of commands left unfinished, once no more commands
+ * can come from it, and report it.
+ * @param source the source
+ */
+static void source_end(MkappSource* source)
+{
+    // The data of a writeb command ended early
+    if (source->writeb != NULL) {
+        g_fprintf(stderr, "writeb: data truncated\n");
+        g_strfreev(source->writeb);
+        source->writeb = NULL;
+        g_string_truncate(source->raw, 0);
+        source->parser->raw_length = 0;
+    }
+
+    if (source->batch != NULL) {
+        g_fprintf(stderr, "begin: batch not committed\n");
+        g_ptr_array_free(source->batch, TRUE);
+        source->batch = NULL;
+    }
+}
+
+
+/**
+ * Free what a source of commands holds, except its parser.
+ * @param source the source
+ */
+static void source_clear(MkappSource* source)
+{
+    if (source->batch != NULL)
+        g_ptr_array_free(source->batch, TRUE);
+    g_strfreev(source->writeb);
+    g_string_free(source->raw, TRUE);
+}
+
+
+/**
+ * Free the source of an obeyed module, along with its parser.
+ * @param source the source
+ */
+static void source_free(MkappSource* source)
+{
+    source_clear(source);
+    mk_parser_free(source->parser);
+    g_free(source);
+}
+
+
+static MkParserContext* source_parser_new(MkappParserData* data);
+
+
+/**
+ * Get the source of the commands being read, creating the source of an
+ * obeyed module the first time it sends commands.
+ * @param data parser data
+ * @return     the source
+ */
+static MkappSource* source_get(MkappParserData* data)
+{
+    const gchar* name = data->modules->obeyed;
+
+    if (name == NULL)
+        return &data->input;
+
+    MkappSource* source = g_hash_table_lookup(data->sources, name);
+    if (source == NULL) {
+        source = g_malloc(sizeof(MkappSource));
+        source_init(source, source_parser_new(data));
+        g_hash_table_insert(data->sources, g_strdup(name), source);
+    }
+
+    return source;
+}
+
+
+/**
+ * Run the commands of a batch in one pass, once they are all known to
+ * exist. Modules get the data written by the batch once it has run (see
+ * mk_module_batch_begin()).
+ * @param data  parser data
+ * @param batch the commands, as NULL-terminated token arrays
+ */
+static void batch_run(MkappParserData* data, GPtrArray* batch)
+{
+    gboolean valid = TRUE;
+
+    for (guint i = 0; i < batch->len; ++i) {
+        const gchar** tokens = g_ptr_array_index(batch, i);
+        if (!strcmp(tokens[0], "begin")) {
+            g_fprintf(stderr, "begin: batch already begun\n");
+            valid = FALSE;
+        } else if (mk_commands_lookup(tokens[0]) == NULL
+                   && lookup_extension_command(tokens[0]) == NULL) {
+            g_fprintf(stderr, "%s: command not found.\n", tokens[0]);
+            valid = FALSE;
+        }
+    }
+
+    if (!valid) {
+        g_fprintf(stderr, "commit: batch discarded\n");
+        return;
+    }
+
+    mk_module_batch_begin(data->modules);
+    for (guint i = 0; i < batch->len; ++i) {
+        const gchar** tokens = g_ptr_array_index(batch, i);
+        execute_command(data, tokens, g_strv_length((gchar**)tokens));
+    }
+    mk_module_batch_end(data->modules);
+}
+
+
+/**
+ * Handle the commands framing a batch ("begin;" and "commit;"), and keep
+ * the commands in between. Each source of commands, the input or an
+ * obeyed module, has its batch: commands from other sources run as usual
+ * while one is being read.
+ * @param data   parser data
+ * @param tokens the tokens that make up the command
+ * @param length number of tokens
+ * @return       whether the command was handled
+ */
+static gboolean batch_command(MkappParserData* data,
+                              const gchar**    tokens,
+                              const gsize      length)
+{
+    MkappSource* source = source_get(data);
+
+    if (source->batch == NULL) {
+        if (!strcmp(tokens[0], "commit")) {
+            g_fprintf(stderr, "commit: no batch begun\n");
+            return TRUE;
+        } else if (strcmp(tokens[0], "begin")) {
+            return FALSE;
+        } else if (length != 1) {
+            g_fprintf(stderr, "begin: usage: begin\n");
+            return TRUE;
+        }
+
+        source->batch = g_ptr_array_new_with_free_func(
+                            (GDestroyNotify)g_strfreev);
+        return TRUE;
+    }
+
+    if (strcmp(tokens[0], "commit")) {
+        g_ptr_array_add(source->batch, command_copy(tokens, length));
+        return TRUE;
+    }
+
+    // The batch is taken away first: commands it runs may begin another,
+    // or end the source
+    GPtrArray* batch = source->batch;
+    source->batch = NULL;
+
+    if (length != 1)
+        g_fprintf(stderr, "commit: usage: commit\n");
+    else
+        batch_run(data, batch);
+
+    g_ptr_array_free(batch, TRUE);
+    return TRUE;
+}
+
+
+/**
+ * Run a command, or keep it if it belongs to a batch.
+ * @param data   parser data
+ * @param tokens the tokens that make up the command, expanded
+ * @param length number of tokens
+ */
+static void run_command(MkappParserData* data,
+                        const gchar**    tokens,
+                        const gsize      length)
+{
+    ++(data->executing);
+    if (!batch_command(data, tokens, length))
+        execute_command(data, tokens, length);
+    --(data->executing);
+}
+
+
+/**
+ * Run the writeb command whose data is being read, once all of it has been.
+ * Data read in one piece is passed to the command from the input itself,
+ * without being copied.
+ * @param parser the parser
+ * @param chunk  data read
+ * @param length number of bytes read
+ * @param data   parser data
+ */
+static void writeb_read(MkParserContext* parser,
+                        const gchar*     chunk,
+                        gsize            length,
+                        MkappParserData* data)
+{
+    MkappSource* source = source_get(data);
+    GString*     raw    = NULL;
+
+    if (parser->raw_length > 0 || source->raw->len > 0) {
+        g_string_append_len(source->raw, chunk, length);
+        if (parser->raw_length > 0)
+            return;
+        raw         = source->raw;
+        source->raw = g_string_new("");
+        chunk       = raw->str;
+    }
+
+    // The command is taken away first: it may run another one
+    gchar**      writeb    = source->writeb;
+    const gchar* tokens[5] = { writeb[0], writeb[1], writeb[2], chunk, NULL };
+    source->writeb = NULL;
+
+    run_command(data, tokens, 4);
 
+    g_strfreev(writeb);
+    if (raw != NULL)
+        g_string_free(raw, TRUE);
+}
+
+
+/**
+ * Stop compiling the file being read, when the command read from it cannot
+ * be compiled.
+ * @param data    parser data
+ * @param command name of the command
+ */
+static void compiler_stop(MkappParserData* data, const gchar* command)
+{
+    if (data->compiler != NULL && data->executing == 0
+        && data->modules->obeyed == NULL) {
+        g_debug("%s: not compiling", command);
+        mk_compiler_free(data->compiler);
+        data->compiler = NULL;
+    }
+}
+
+
+/**
+ * Start reading the data of a writeb command: the number of bytes it gives
+ * that follow its ";". They are read as they are (see writeb_read()).
+ * Files with such commands are not compiled.
+ * @param parser the parser
+ * @param data   parser data
+ * @param tokens the tokens that make up the command, expanded
+ * @param length number of tokens
+ */
+static void writeb_begin(MkParserContext* parser,
+                         MkappParserData* data,
+                         const gchar**    tokens,
+                         const gsize      length)
+{
+    gsize size;
+
+    // Without its data, the command only reports how to use it
+    if (length != 3 || !mk_commands_data_length(tokens[2], &size)) {
+        run_command(data, tokens, MIN(length, 3));
+        return;
+    }
+
+    compiler_stop(data, tokens[0]);
+
+    source_get(data)->writeb = g_strdupv((gchar**)tokens);
+    mk_parser_read_raw(parser, size, (MkParserRawFunc)writeb_read);
 }
 
 
 void command_end(MkParserContext* parser, gchar c, MkappParserData* data)
 {
-    mk_parser_token_cut(parser);
+    gsize length = mk_parser_token_size(parser);
+    if (length > 0) {
+        // Commands obeyed from a module can be parsed while this one
+        // runs: each level of nested commands has an arena of its own
+        if (data->executing == data->arenas->len) {
+            MkappArena* arena = g_malloc(sizeof(MkappArena));
+            arena->chars   = g_string_new("");
+            arena->tokens  = g_ptr_array_new();
+            arena->invalid = FALSE;
+            g_ptr_array_add(data->arenas, arena);
+        }
 
-    if (parser->tokens != NULL && parser->tokens->len > 0) {
-        execute_command(mk_parser_token_get(parser),
-                        mk_parser_token_size(parser),
-                        data->modules);
+        MkappArena*   arena  = g_ptr_array_index(data->arenas,
+                                                 data->executing);
+        const gchar** tokens = arena_fill(arena, mk_parser_token_get(parser),
+                                          length);
         mk_parser_token_clear(parser);
+
+        if (!strcmp(tokens[0], "writeb")) {
+            writeb_begin(parser, data, tokens, length);
+            arena_reset(arena);
+            return;
+        }
+
+        // Only the commands of the file itself are compiled. Errors found
+        // while reading them would not be reported by the compiled script.
+        if (arena->invalid)
+            compiler_stop(data, tokens[0]);
+        if (data->compiler != NULL && data->executing == 0
+            && data->modules->obeyed == NULL)
+            mk_compiler_add(data->compiler, tokens, length);
+
+        run_command(data, tokens, length);
+        arena_reset(arena);
     }
-    
 }
 
 
 void eof_received(MkParserContext* parser, gchar c, MkappParserData* data)
 {
+    // A writeb command or a batch read from the input can no longer end
+    source_end(&data->input);
+
     mk_module_eof_received(data->modules);
 }
 
 
+#include "mkapp_grammar.h"
+
+
+/**
+ * Create a parser for the commands of a source.
+ * @param data parser data
+ * @return     the parser
+ */
+static MkParserContext* source_parser_new(MkappParserData* data)
+{
+    return mk_parser_new(&grammar_command, data);
+}
+
+
 MkParserContext* mk_app_parser_new(MkModuleContext* modules)
 {
     MkappParserData* data = g_malloc(sizeof(MkappParserData));
-    data->modules = modules;
+    data->modules   = modules;
+    data->arenas    = g_ptr_array_new();
+    data->executing = 0;
+    data->sources   = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+                                            (GDestroyNotify)source_free);
+    data->compiler  = NULL;
+    data->prepared  = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+                                            NULL,
+                                            (GDestroyNotify)prepared_free);
 
-    MkParserContext* parser = mk_parser_new(data);
+    MkParserContext* parser = source_parser_new(data);
     mk_parser_set_eof_func(parser, (MkParserFunc)eof_received);
-
-    mk_parser_configure_default(parser, (MkParserFunc)mk_parser_token_append);
-    mk_parser_enable_defaults(parser);
-    mk_parser_configure(parser, ';', (MkParserFunc)command_end);
-    mk_parser_configure_all(parser, " \t\n",
-                            (MkParserFunc)mk_parser_token_cut);
+    source_init(&data->input, parser);
 
     return parser;
 }
 
-/* TODO: mk_app_parser_free() */
+
+void mk_app_parser_parse_file(MkParserContext* parser,
+                              const gchar*     filename,
+                              gboolean         cache)
+{
+    MkappParserData* data = (MkappParserData*)(parser->user_data);
+
+    if (!cache) {
+        mk_parser_parse_file(parser, filename);
+        return;
+    }
+
+    gchar*      path     = mk_compiled_path(filename);
+    MkCompiled* compiled = mk_compiled_load(filename, path);
+
+    if (compiled != NULL) {
+        g_debug("Running %s", path);
+
+        const gchar** tokens = compiled->tokens;
+        for (guint32 i = 0; i < compiled->n_commands; ++i) {
+            gsize length = g_strv_length((gchar**)tokens);
+            run_command(data, tokens, length);
+            tokens += length + 1;
+        }
+
+        mk_compiled_free(compiled);
+        eof_received(parser, 0, data);
+
+    } else {
+        data->compiler = mk_compiler_new(filename);
+        mk_parser_parse_file(parser, filename);
+
+        if (data->compiler != NULL) {
+            mk_compiler_save(data->compiler, path);
+            mk_compiler_free(data->compiler);
+            data->compiler = NULL;
+        }
+    }
+
+    g_free(path);
+}
+
+
+void mk_app_parser_obey_end(MkParserContext* parser, const gchar* name)
+{
+    MkappParserData* data = (MkappParserData*)(parser->user_data);
+    gchar*           key;
+    MkappSource*     source;
+
+    if (!g_hash_table_lookup_extended(data->sources, name, (gpointer*)&key,
+                                      (gpointer*)&source))
+        return;
+
+    // A module may stop being obeyed because of its own commands: their
+    // parser is only freed once it returns
+    g_hash_table_steal(data->sources, name);
+    g_free(key);
+    source_end(source);
+    if (source->parsing > 0)
+        source->ended = TRUE;
+    else
+        source_free(source);
+}
+
+
+void mk_app_parser_interpret(MkParserContext* parser,
+                             const gchar*     chars,
+                             const gsize      length)
+{
+    MkappParserData* data   = (MkappParserData*)(parser->user_data);
+    MkappSource*     source = source_get(data);
+
+    ++source->parsing;
+    mk_parser_parse_buffer(source->parser, chars, length);
+    if (--source->parsing == 0 && source->ended)
+        source_free(source);
+}
+
+
+void mk_app_parser_free(MkParserContext* parser)
+{
+    MkappParserData* data = (MkappParserData*)(parser->user_data);
+
+    g_ptr_array_foreach(data->arenas, (GFunc)arena_free, NULL);
+    g_ptr_array_free(data->arenas, TRUE);
+    g_hash_table_unref(data->prepared);
+    g_hash_table_unref(data->sources);
+    source_clear(&data->input);
+    g_free(data);
+    mk_parser_free(parser);
+}
@@ -22,8 +22,28 @@
  *  - Basic rules (comments, quoted strings, ...) are inherited from
  *    the default parser.
  *
- * A valid command is any command for which an mk_command_(command name)
- * function exists.
+ * A valid command is a built-in command (see mkapp_commands.h), or any
+ * command for which the program defines an mk_command_(command name)
+ * function.
+ *
+ * Commands between "begin;" and "commit;" form a batch: they are read
+ * completely, checked to be valid, and only then run in one pass, the
+ * data they write to each module going to it at once (see
+ * mk_module_batch_begin()). A batch with an invalid command does not run.
+ * The input and each obeyed module have batches of their own. A batch is
+ * dropped when its source ends: the end of the input, or the module
+ * exiting or no longer being obeyed (see mk_app_parser_obey_end()).
+ *
+ * "writeb module length;" is followed by length bytes of data, right
+ * after its ";", which are not parsed: they are written as they are to
+ * the module, in one piece. The command is dropped if its source ends
+ * before all of them are read. Files with writeb commands are not
+ * compiled.
+ *
+ * The input and each obeyed module are parsed separately (see
+ * mk_app_parser_interpret()): a command, or the data of a writeb command,
+ * split across reads of a module is not mixed up with what other sources
+ * send in between.
  */
 
 #ifndef __MKAPP_PARSER_H__
@@ -39,4 +59,45 @@
  */
 MkParserContext* mk_app_parser_new(MkModuleContext* modules);
 
+/**
+ * Run the commands of an mkapp file. With the cache, the commands read from
+ * the file are saved as a compiled script (see compiled.h), which is run
+ * instead of parsing the file as long as the file does not change. A file
+ * with a token reported as invalid while it is read is not compiled, so
+ * that the error is reported each time it runs.
+ * @param parser   an mkapp parser
+ * @param filename the mkapp file
+ * @param cache    whether to use and save compiled scripts
+ */
+void mk_app_parser_parse_file(MkParserContext* parser,
+                              const gchar*     filename,
+                              gboolean         cache);
+
+/**
+ * Parse the output of an obeyed module, with a parser of its own. Meant to
+ * be passed to mk_module_set_interpreter(), with the parser as its data.
+ * @param parser an mkapp parser
+ * @param chars  characters received from the module being obeyed
+ * @param length number of characters
+ */
+void mk_app_parser_interpret(MkParserContext* parser,
+                             const gchar*     chars,
+                             const gsize      length);
+
+/**
+ * Drop what the commands obeyed from a module left unfinished, once the
+ * module exits or is no longer obeyed. Meant to be passed to
+ * mk_module_set_obey_end(), with the parser as the interpreter's data.
+ * @param parser an mkapp parser
+ * @param name   name of the module
+ */
+void mk_app_parser_obey_end(MkParserContext* parser, const gchar* name);
+
+/**
+ * Free an mkapp parser created with mk_app_parser_new(). The module
+ * context is not freed.
+ * @param parser the parser
+ */
+void mk_app_parser_free(MkParserContext* parser);
+
 #endif // __MKAPP_PARSER_H__
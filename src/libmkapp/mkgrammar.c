@@ -0,0 +1,795 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+/**
+ * @file
+ * Grammar compiler. Reads the description of the lexical states of a
+ * parser and writes, as a C header, the static parser tables that
+ * implement them. The header is meant to be included by a single C file
+ * and only defines static objects: a table named grammar_STATE for each
+ * state, and the functions running actions made of several steps.
+ *
+ * A description is made of lines. Empty lines and lines starting with #
+ * are ignored. Other lines are made of words separated by whitespace:
+ *  - include "FILE": read another description, relative to this one.
+ *  - state NAME: start describing a state. The lines that follow, until
+ *    the next state, configure the state's table.
+ *  - fragment NAME: same as state, but no table is written. Fragments
+ *    hold entries shared by several states.
+ *  - default ACTION: set the action of all the characters.
+ *  - use NAME: copy the entries of a state or fragment described before.
+ *  - "CHARS" ACTION or 'CHARS' ACTION: set the action of the characters
+ *    of a string, in which \\, \', \", \n, \r and \t can be used.
+ * Later lines override earlier ones. Characters that are not configured
+ * are ignored.
+ *
+ * An action is a sequence of steps run in order:
+ *  - append: append the character to the current token.
+ *  - cut: put the current token into the token list.
+ *  - pop: pop the parser's stack.
+ *  - push NAME: push the table of a state.
+ *  - switch NAME: replace the table on top of the stack.
+ *  - reparse: parse the character again with the table now in use.
+ *  - FUNCTION: call a C function of type MkParserFunc.
+ *  - ignore: do nothing, which must be the only step.
+ * Actions made of a single append, cut, pop, ignore or function call use
+ * the function directly, which lets mk_parser_parse_buffer() skip runs of
+ * appended or ignored characters.
+ *
+ * The compiler fails if a state is described twice, if an unknown state
+ * is used, pushed or switched to, if a description includes itself, or if
+ * the states can push more tables than MK_PARSER_MAX_DEPTH.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gprintf.h>
+
+#include "parser.h"
+
+#define PACKAGE_NAME         "mkgrammar"
+#define PACKAGE_VERSION      "0.1"
+#define PACKAGE_PARAM_STRING "FILE"
+
+
+/**
+ * Lexical state, or fragment. Actions are kept as their steps separated
+ * by single spaces: "" ignores the character and NULL leaves it
+ * unconfigured.
+ * @brief Lexical state.
+ */
+typedef struct {
+    gchar*   name;                          /// Name of the state
+    gboolean fragment;                      /// Is no table written for it?
+    gchar*   file;                          /// Where it is described
+    gint     line;                          /// Line of the description
+    gchar*   actions[MK_PARSER_ARRAY_SIZE]; /// Action of each character
+} MkGrammarState;
+
+
+static gchar**    m_files   = NULL; // Input files
+static gboolean   m_version = FALSE;
+static GPtrArray* m_states  = NULL; // States in order of description
+static gint       m_errors  = 0;    // Number of errors found
+static GHashTable* m_reading = NULL; // Files being read, by real path
+
+
+/**
+ * Command-line options.
+ */
+static GOptionEntry entries[] = {
+    { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY, &m_files,
+      "Grammar description file", NULL },
+    { "version", 'V', 0, G_OPTION_ARG_NONE,
+      (gpointer)&m_version, "Print version information", NULL },
+    { NULL }
+};
+
+
+/**
+ * Report an error in a description.
+ * @param file   the description
+ * @param line   line of the error
+ * @param format printf-like format of the message
+ */
+static void grammar_error(const gchar* file, gint line,
+                          const gchar* format, ...)
+{
+    va_list args;
+
+    g_fprintf(stderr, "%s:%d: ", file, line);
+    va_start(args, format);
+    g_vfprintf(stderr, format, args);
+    va_end(args);
+    g_fprintf(stderr, "\n");
+    ++m_errors;
+}
+
+
+/**
+ * Find a state by name.
+ * @param name name of the state
+ * @return     the state, or NULL if there is none
+ */
+static MkGrammarState* grammar_find(const gchar* name)
+{
+    for (guint i = 0; i < m_states->len; ++i) {
+        MkGrammarState* state = g_ptr_array_index(m_states, i);
+        if (!strcmp(state->name, name))
+            return state;
+    }
+
+    return NULL;
+}
+
+
+/**
+ * Check whether a word is a C identifier.
+ * @param word the word
+ * @return     whether it is
+ */
+static gboolean grammar_is_identifier(const gchar* word)
+{
+    if (!g_ascii_isalpha(word[0]) && word[0] != '_')
+        return FALSE;
+    for (const gchar* p = word; *p != '\0'; ++p)
+        if (!g_ascii_isalnum(*p) && *p != '_')
+            return FALSE;
+
+    return TRUE;
+}
+
+
+/**
+ * Split a line into words. Quoted words keep their quotes.
+ * @param text the line
+ * @return     the words, or NULL if a quote is not closed
+ */
+static GPtrArray* grammar_split(const gchar* text)
+{
+    GPtrArray*   words = g_ptr_array_new_with_free_func(g_free);
+    const gchar* p     = text;
+
+    while (*p != '\0') {
+        if (g_ascii_isspace(*p)) {
+            ++p;
+            continue;
+        }
+
+        const gchar* start = p;
+        if (*p == '"' || *p == '\'') {
+            gchar quote = *p++;
+            while (*p != '\0' && *p != quote)
+                p += (*p == '\\' && p[1] != '\0') ? 2 : 1;
+            if (*p == '\0') {
+                g_ptr_array_free(words, TRUE);
+                return NULL;
+            }
+            ++p;
+        } else {
+            while (*p != '\0' && !g_ascii_isspace(*p))
+                ++p;
+        }
+        g_ptr_array_add(words, g_strndup(start, p - start));
+    }
+
+    return words;
+}
+
+
+/**
+ * Get the characters of a quoted word.
+ * @param word the word, quotes included
+ * @return     the characters, or NULL if an escape sequence is unknown
+ */
+static GString* grammar_unquote(const gchar* word)
+{
+    GString* chars = g_string_new("");
+    gsize    end   = strlen(word) - 1;
+
+    for (gsize i = 1; i < end; ++i) {
+        gchar c = word[i];
+
+        if (c == '\\') {
+            switch (word[++i]) {
+            case '\\': c = '\\'; break;
+            case '\'': c = '\''; break;
+            case '"':  c = '"';  break;
+            case 'n':  c = '\n'; break;
+            case 'r':  c = '\r'; break;
+            case 't':  c = '\t'; break;
+            default:
+                g_string_free(chars, TRUE);
+                return NULL;
+            }
+        }
+        g_string_append_c(chars, c);
+    }
+
+    return chars;
+}
+
+
+/**
+ * Check the steps of an action and join them.
+ * @param words words of the line
+ * @param first index of the first step
+ * @param file  the description
+ * @param line  line of the action
+ * @return      the action, or NULL if it is invalid
+ */
+static gchar* grammar_action(GPtrArray* words, guint first,
+                             const gchar* file, gint line)
+{
+    GString* action = g_string_new("");
+
+    if (first >= words->len) {
+        grammar_error(file, line, "missing action");
+        g_string_free(action, TRUE);
+        return NULL;
+    }
+
+    for (guint i = first; i < words->len; ++i) {
+        const gchar* step = g_ptr_array_index(words, i);
+
+        if (!strcmp(step, "ignore")) {
+            if (words->len - first > 1) {
+                grammar_error(file, line, "ignore must be the only step");
+                g_string_free(action, TRUE);
+                return NULL;
+            }
+            continue;
+        }
+
+        if (action->len > 0)
+            g_string_append_c(action, ' ');
+
+        if (!strcmp(step, "push") || !strcmp(step, "switch")) {
+            if (i + 1 >= words->len
+                || !grammar_is_identifier(g_ptr_array_index(words, i + 1))) {
+                grammar_error(file, line, "%s: missing state", step);
+                g_string_free(action, TRUE);
+                return NULL;
+            }
+            g_string_append_printf(action, "%s %s", step,
+                                   (gchar*)g_ptr_array_index(words, ++i));
+        } else if (grammar_is_identifier(step)) {
+            g_string_append(action, step);
+        } else {
+            grammar_error(file, line, "%s: invalid step", step);
+            g_string_free(action, TRUE);
+            return NULL;
+        }
+    }
+
+    return g_string_free(action, FALSE);
+}
+
+
+/**
+ * Set the action of a character of a state.
+ * @param state  the state
+ * @param c      the character, or MK_PARSER_FIRST_CHAR for non-ASCII ones
+ * @param action the action, which is copied
+ */
+static void grammar_set(MkGrammarState* state, gint c, const gchar* action)
+{
+    gint i = c - MK_PARSER_FIRST_CHAR;
+
+    g_free(state->actions[i]);
+    state->actions[i] = g_strdup(action);
+}
+
+
+/**
+ * Get the path of a file with symbolic links and relative components
+ * resolved, so that the same file always has the same path.
+ * @param file the file
+ * @return     its real path, or a copy of file if it cannot be resolved,
+ *             to free with g_free()
+ */
+static gchar* grammar_real_path(const gchar* file)
+{
+    gchar* real = realpath(file, NULL);
+    gchar* path = g_strdup(real != NULL ? real : file);
+
+    free(real);
+    return path;
+}
+
+
+/**
+ * Read a grammar description.
+ * @param file the description
+ */
+static void grammar_read(const gchar* file)
+{
+    gchar*          text  = NULL;
+    GError*         error = NULL;
+    MkGrammarState* state = NULL;
+
+    if (!g_file_get_contents(file, &text, NULL, &error)) {
+        g_fprintf(stderr, "%s\n", error->message);
+        g_error_free(error);
+        ++m_errors;
+        return;
+    }
+
+    gchar* real = grammar_real_path(file);
+    g_hash_table_insert(m_reading, real, real);
+
+    gchar** lines = g_strsplit(text, "\n", -1);
+    g_free(text);
+
+    for (gint n = 0; lines[n] != NULL; ++n) {
+        gint       line  = n + 1;
+        GPtrArray* words = grammar_split(lines[n]);
+
+        if (words == NULL) {
+            grammar_error(file, line, "unterminated string");
+            continue;
+        }
+
+        const gchar* first = words->len > 0 ? g_ptr_array_index(words, 0)
+                                            : "#";
+        const gchar* arg   = words->len > 1 ? g_ptr_array_index(words, 1)
+                                            : NULL;
+
+        if (first[0] == '#') {
+            // Comment or empty line
+
+        } else if (!strcmp(first, "include")) {
+            GString* name = arg != NULL && (arg[0] == '"' || arg[0] == '\'')
+                ? grammar_unquote(arg) : NULL;
+            if (name == NULL || words->len != 2) {
+                grammar_error(file, line, "usage: include \"FILE\"");
+            } else {
+                gchar* dir  = g_path_get_dirname(file);
+                gchar* path = g_build_filename(dir, name->str, NULL);
+                gchar* real = grammar_real_path(path);
+                if (g_hash_table_contains(m_reading, real))
+                    grammar_error(file, line, "%s: included recursively",
+                                  name->str);
+                else
+                    grammar_read(path);
+                g_free(real);
+                g_free(path);
+                g_free(dir);
+            }
+            if (name != NULL)
+                g_string_free(name, TRUE);
+
+        } else if (!strcmp(first, "state") || !strcmp(first, "fragment")) {
+            state = NULL;
+            if (arg == NULL || words->len != 2
+                || !grammar_is_identifier(arg)) {
+                grammar_error(file, line, "usage: %s NAME", first);
+            } else if (grammar_find(arg) != NULL) {
+                MkGrammarState* other = grammar_find(arg);
+                grammar_error(file, line, "%s: already described at %s:%d",
+                              arg, other->file, other->line);
+            } else {
+                state = g_malloc0(sizeof(MkGrammarState));
+                state->name     = g_strdup(arg);
+                state->fragment = !strcmp(first, "fragment");
+                state->file     = g_strdup(file);
+                state->line     = line;
+                g_ptr_array_add(m_states, state);
+            }
+
+        } else if (state == NULL) {
+            grammar_error(file, line, "no state is being described");
+
+        } else if (!strcmp(first, "use")) {
+            MkGrammarState* other = arg != NULL ? grammar_find(arg) : NULL;
+            if (arg == NULL || words->len != 2) {
+                grammar_error(file, line, "usage: use NAME");
+            } else if (other == NULL || other == state) {
+                grammar_error(file, line, "%s: unknown state", arg);
+            } else {
+                for (gint i = 0; i < MK_PARSER_ARRAY_SIZE; ++i)
+                    if (other->actions[i] != NULL)
+                        grammar_set(state, i + MK_PARSER_FIRST_CHAR,
+                                    other->actions[i]);
+            }
+
+        } else if (!strcmp(first, "default")) {
+            gchar* action = grammar_action(words, 1, file, line);
+            if (action != NULL)
+                for (gint c = MK_PARSER_FIRST_CHAR;
+                     c <= MK_PARSER_LAST_CHAR; ++c)
+                    grammar_set(state, c, action);
+            g_free(action);
+
+        } else if (first[0] == '"' || first[0] == '\'') {
+            GString* chars  = grammar_unquote(first);
+            gchar*   action = grammar_action(words, 1, file, line);
+            if (chars == NULL)
+                grammar_error(file, line, "%s: invalid escape sequence",
+                              first);
+            gboolean ascii = TRUE;
+            for (gsize i = 0; chars != NULL && i < chars->len; ++i)
+                ascii = ascii && chars->str[i] >= 0;
+            if (!ascii)
+                grammar_error(file, line, "%s: not ASCII", first);
+            if (chars != NULL && ascii && action != NULL)
+                for (gsize i = 0; i < chars->len; ++i)
+                    grammar_set(state, chars->str[i], action);
+            if (chars != NULL)
+                g_string_free(chars, TRUE);
+            g_free(action);
+
+        } else {
+            grammar_error(file, line, "%s: unknown statement", first);
+        }
+
+        g_ptr_array_free(words, TRUE);
+    }
+
+    g_strfreev(lines);
+    g_hash_table_remove(m_reading, real);
+}
+
+
+/**
+ * Check that the states pushed or switched to by the actions of a state
+ * are described and are not fragments.
+ * @param state the state
+ */
+static void grammar_check(MkGrammarState* state)
+{
+    gboolean valid = TRUE;
+
+    // Report the first error of the state only
+    for (gint i = 0; valid && i < MK_PARSER_ARRAY_SIZE; ++i) {
+        if (state->actions[i] == NULL)
+            continue;
+
+        gchar** steps = g_strsplit(state->actions[i], " ", -1);
+        for (gsize j = 0; valid && steps[j] != NULL; ++j) {
+            if (strcmp(steps[j], "push") && strcmp(steps[j], "switch"))
+                continue;
+
+            MkGrammarState* target = grammar_find(steps[++j]);
+            if (target == NULL || target->fragment) {
+                grammar_error(state->file, state->line, "%s: %s %s: %s",
+                              state->name, steps[j-1], steps[j],
+                              target == NULL ? "unknown state"
+                                             : "cannot use a fragment");
+                valid = FALSE;
+            }
+        }
+        g_strfreev(steps);
+    }
+}
+
+
+/**
+ * Compute how many tables can be pushed on top of a state's, from the
+ * same figure for the other states.
+ * @param state  the state
+ * @param depths tables pushed on top of each state so far
+ * @return       tables pushed on top of the state
+ */
+static gint grammar_depth(MkGrammarState* state, const gint* depths)
+{
+    gint depth = 0;
+
+    for (gint i = 0; i < MK_PARSER_ARRAY_SIZE; ++i) {
+        if (state->actions[i] == NULL)
+            continue;
+
+        gchar** steps = g_strsplit(state->actions[i], " ", -1);
+        gint    level = 0;
+        for (gsize j = 0; steps[j] != NULL; ++j) {
+            if (!strcmp(steps[j], "pop")) {
+                --level;
+            } else if (!strcmp(steps[j], "push")
+                       || !strcmp(steps[j], "switch")) {
+                MkGrammarState* target = grammar_find(steps[j+1]);
+                gint            index  = 0;
+                while (g_ptr_array_index(m_states, index) != target)
+                    ++index;
+                if (!strcmp(steps[j++], "push"))
+                    ++level;
+                depth = MAX(depth, level + depths[index]);
+            }
+        }
+        g_strfreev(steps);
+    }
+
+    return depth;
+}
+
+
+/**
+ * Check that no sequence of actions can push more tables than a parser
+ * can hold. Tables pushed by C functions are not taken into account.
+ */
+static void grammar_check_depth(void)
+{
+    gint*    depths  = g_new0(gint, m_states->len);
+    gboolean changed = TRUE;
+
+    // The figures only increase, until they are all known or one of them
+    // is too high, which is always the case if states push each other
+    while (changed) {
+        changed = FALSE;
+        for (guint i = 0; i < m_states->len; ++i) {
+            MkGrammarState* state = g_ptr_array_index(m_states, i);
+            gint            depth = grammar_depth(state, depths);
+
+            if (depth <= depths[i])
+                continue;
+            if (!state->fragment && depth + 1 > MK_PARSER_MAX_DEPTH) {
+                grammar_error(state->file, state->line,
+                              "%s: more than %d tables can be pushed",
+                              state->name, MK_PARSER_MAX_DEPTH);
+                changed = FALSE;
+                break;
+            }
+            depths[i] = depth;
+            changed   = TRUE;
+        }
+    }
+
+    g_free(depths);
+}
+
+
+/**
+ * Get the expression of the function implementing an action.
+ * @param action  the action
+ * @param actions names of the functions of actions made of several steps
+ * @return        the expression
+ */
+static gchar* grammar_function(const gchar* action, GHashTable* actions)
+{
+    if (action == NULL || action[0] == '\0')
+        return g_strdup("NULL");
+    if (g_hash_table_lookup(actions, action) != NULL)
+        return g_strdup(g_hash_table_lookup(actions, action));
+    if (!strcmp(action, "append"))
+        return g_strdup("(MkParserFunc)mk_parser_token_append");
+    if (!strcmp(action, "cut"))
+        return g_strdup("(MkParserFunc)mk_parser_token_cut");
+    if (!strcmp(action, "pop"))
+        return g_strdup("(MkParserFunc)mk_parser_pop");
+
+    return g_strdup_printf("(MkParserFunc)%s", action);
+}
+
+
+/**
+ * Check whether an action must be run by a function of its own.
+ * @param action the action
+ * @return       whether it must
+ */
+static gboolean grammar_needs_function(const gchar* action)
+{
+    return action != NULL && (strchr(action, ' ') != NULL
+                               || !strcmp(action, "reparse"));
+}
+
+
+/**
+ * Write the function running an action made of several steps.
+ * @param name   name of the function
+ * @param action the action
+ */
+static void grammar_write_function(const gchar* name, const gchar* action)
+{
+    gchar** steps = g_strsplit(action, " ", -1);
+
+    g_printf("/* %s */\n", action);
+    g_printf("static void %s(MkParserContext* parser, gchar c, void* data)\n",
+             name);
+    g_printf("{\n");
+    for (gsize i = 0; steps[i] != NULL; ++i) {
+        if (!strcmp(steps[i], "append"))
+            g_printf("    mk_parser_token_append(parser, c);\n");
+        else if (!strcmp(steps[i], "cut"))
+            g_printf("    mk_parser_token_cut(parser);\n");
+        else if (!strcmp(steps[i], "pop"))
+            g_printf("    mk_parser_pop(parser);\n");
+        else if (!strcmp(steps[i], "reparse"))
+            g_printf("    mk_parser_parse_character(parser, c);\n");
+        else if (!strcmp(steps[i], "push") || !strcmp(steps[i], "switch")) {
+            g_printf("    mk_parser_%s(parser, &grammar_%s);\n",
+                     steps[i], steps[i+1]);
+            ++i;
+        } else
+            g_printf("    %s(parser, c, data);\n", steps[i]);
+    }
+    g_printf("}\n\n\n");
+
+    g_strfreev(steps);
+}
+
+
+/**
+ * Write a character set with the characters whose action is or is not a
+ * given one.
+ * @param state  the state
+ * @param field  name of the set in MkParserTable
+ * @param action the action
+ */
+static void grammar_write_set(MkGrammarState* state, const gchar* field,
+                              const gchar* action)
+{
+    guint8   ascii[16] = { 0 };
+    gboolean in[MK_PARSER_ARRAY_SIZE];
+
+    for (gint i = 0; i < MK_PARSER_ARRAY_SIZE; ++i) {
+        const gchar* a = state->actions[i] != NULL ? state->actions[i] : "";
+        in[i] = strcmp(a, action) != 0;
+    }
+    for (gint c = 0; c <= MK_PARSER_LAST_CHAR; ++c)
+        if (in[c - MK_PARSER_FIRST_CHAR])
+            ascii[c & 15] |= 1 << (c >> 4);
+
+    g_printf("    .%s = {\n", field);
+    g_printf("        .ascii     = {");
+    for (gint i = 0; i < 16; ++i) {
+        if (i == 8)
+            g_printf(",\n                      ");
+        else if (i > 0)
+            g_printf(",");
+        g_printf(" 0x%02x", ascii[i]);
+    }
+    g_printf(" },\n");
+    g_printf("        .non_ascii = %s\n", in[MK_PARSER_NON_ASCII] ? "TRUE"
+                                                                 : "FALSE");
+    g_printf("    }");
+}
+
+
+/**
+ * Write the table of a state.
+ * @param state   the state
+ * @param actions names of the functions of actions made of several steps
+ */
+static void grammar_write_table(MkGrammarState* state, GHashTable* actions)
+{
+    g_printf("/* %s (%s:%d) */\n", state->name, state->file, state->line);
+    g_printf("static const MkParserTable grammar_%s = {\n", state->name);
+    g_printf("    .f = {\n");
+    for (gint i = 0; i < MK_PARSER_ARRAY_SIZE; ++i) {
+        gint   c = i + MK_PARSER_FIRST_CHAR;
+        gchar* f = grammar_function(state->actions[i], actions);
+
+        if (c < 0)
+            g_printf("        /* non-ASCII */ %s,\n", f);
+        else if (g_ascii_isgraph(c) && c != '\\' && c != '\'')
+            g_printf("        /* '%c'  */      %s,\n", c, f);
+        else
+            g_printf("        /* 0x%02x */      %s,\n", c, f);
+        g_free(f);
+    }
+    g_printf("    },\n");
+    grammar_write_set(state, "append_stop", "append");
+    g_printf(",\n");
+    grammar_write_set(state, "skip_stop", "");
+    g_printf("\n};\n\n\n");
+}
+
+
+/**
+ * Write the header implementing the states read.
+ * @param file the description
+ */
+static void grammar_write(const gchar* file)
+{
+    GHashTable* actions = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                                NULL, g_free);
+
+    g_printf("/*\n");
+    g_printf(" * Generated by %s from %s. Do not edit.\n", PACKAGE_NAME, file);
+    g_printf(" */\n\n");
+
+    // Tables can refer to each other through the functions of actions
+    for (guint i = 0; i < m_states->len; ++i) {
+        MkGrammarState* state = g_ptr_array_index(m_states, i);
+        if (!state->fragment)
+            g_printf("static const MkParserTable grammar_%s;\n", state->name);
+    }
+    g_printf("\n\n");
+
+    for (guint i = 0; i < m_states->len; ++i) {
+        MkGrammarState* state = g_ptr_array_index(m_states, i);
+        if (state->fragment)
+            continue;
+
+        for (gint j = 0; j < MK_PARSER_ARRAY_SIZE; ++j) {
+            const gchar* action = state->actions[j];
+            if (!grammar_needs_function(action)
+                || g_hash_table_lookup(actions, action) != NULL)
+                continue;
+
+            gchar* name = g_strdup_printf("grammar_action_%u",
+                                          g_hash_table_size(actions));
+            grammar_write_function(name, action);
+            g_hash_table_insert(actions, (gpointer)action, name);
+        }
+    }
+
+    for (guint i = 0; i < m_states->len; ++i) {
+        MkGrammarState* state = g_ptr_array_index(m_states, i);
+        if (!state->fragment)
+            grammar_write_table(state, actions);
+    }
+
+    g_hash_table_destroy(actions);
+}
+
+
+/**
+ * Free a state.
+ * @param state the state
+ */
+static void grammar_free_state(MkGrammarState* state)
+{
+    for (gint i = 0; i < MK_PARSER_ARRAY_SIZE; ++i)
+        g_free(state->actions[i]);
+    g_free(state->name);
+    g_free(state->file);
+    g_free(state);
+}
+
+
+/**
+ * Main
+ */
+int main(int argc, char* argv[])
+{
+    // Read command-line arguments
+    GError* error = NULL;
+    GOptionContext* context;
+    context = g_option_context_new(PACKAGE_PARAM_STRING);
+    g_option_context_add_main_entries(context, entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_fprintf(stderr, "%s\n", error->message);
+        exit(EXIT_FAILURE);
+    }
+    g_option_context_free(context);
+
+    if (m_version) {
+        g_printf("%s %s\n", PACKAGE_NAME, PACKAGE_VERSION);
+        exit(EXIT_SUCCESS);
+    }
+
+    if (m_files == NULL || m_files[0] == NULL || m_files[1] != NULL) {
+        g_fprintf(stderr, "usage: %s %s\n", PACKAGE_NAME,
+                  PACKAGE_PARAM_STRING);
+        exit(EXIT_FAILURE);
+    }
+
+    m_states = g_ptr_array_new_with_free_func
+        ((GDestroyNotify)grammar_free_state);
+    m_reading = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+    grammar_read(m_files[0]);
+    for (guint i = 0; m_errors == 0 && i < m_states->len; ++i)
+        grammar_check(g_ptr_array_index(m_states, i));
+    if (m_errors == 0)
+        grammar_check_depth();
+    if (m_errors == 0)
+        grammar_write(m_files[0]);
+
+    g_ptr_array_free(m_states, TRUE);
+    g_hash_table_destroy(m_reading);
+    g_strfreev(m_files);
+
+    return m_errors == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
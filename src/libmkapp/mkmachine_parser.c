@@ -24,45 +24,18 @@ typedef struct {
 } MkmachineParserData;
 
 
-void disable_whitespace(MkParserContext* parser, gchar c, GHashTable* data)
-{
-    mk_parser_configure_all(parser, " \t", NULL);
-    mk_parser_token_append(parser, c);
-}
-
-
-void enable_whitespace(MkParserContext* parser, gchar c, GHashTable* data)
-{
-    mk_parser_configure_all(parser, " \t",
-                            (MkParserFunc)mk_parser_token_append);
-    mk_parser_configure_all(parser, "\n", (MkParserFunc)disable_whitespace);
-    mk_parser_token_append(parser, c);
-}
-
-
-void transition_end(MkParserContext* parser, gchar c, GHashTable* data)
-{
-    mk_parser_token_cut(parser);
-    mk_parser_pop(parser);
-}
-
-
-void transition_begin(MkParserContext*     parser,
-                      gchar                c,
-                      MkmachineParserData* data)
-{
-    mk_parser_token_cut(parser);
-    mk_parser_push(parser);
-    mk_parser_configure_default(parser, (MkParserFunc)enable_whitespace);
-    mk_parser_enable_defaults(parser);
-    mk_parser_configure(parser, '}', (MkParserFunc)transition_end);
-    mk_parser_configure_all(parser, " \t\n", NULL);
-}
-
-
-void src_state_end(MkParserContext* parser, gchar c, MkmachineParserData* data)
+/**
+ * Add the transitions of the state that has just been read, whose tokens
+ * are its name and a triplet of tokens per transition: input, destination
+ * state and output.
+ * @param parser the parser
+ * @param c      character to parse
+ * @param data   parser data
+ */
+static void add_transitions(MkParserContext*     parser,
+                            gchar                c,
+                            MkmachineParserData* data)
 {
-
     gsize size = mk_parser_token_size(parser);
     const gchar** tokens = mk_parser_token_get(parser);
 
@@ -86,69 +59,30 @@ void src_state_end(MkParserContext* parser, gchar c, MkmachineParserData* data)
     }
 
     mk_parser_token_clear(parser);
-    mk_parser_pop(parser);
 }
 
 
-void dst_state_end(MkParserContext*     parser,
-                   gchar                c,
-                   MkmachineParserData* data)
-{
-    mk_parser_pop(parser);
-    transition_begin(parser, c, data);
-}
-
-
-void dst_state_begin(MkParserContext*     parser,
-                     gchar                c,
-                     MkmachineParserData* data)
-{
-    mk_parser_pop(parser);
-    mk_parser_push(parser);
-    mk_parser_configure_default(parser, (MkParserFunc)mk_parser_token_append);
-    mk_parser_enable_defaults(parser);
-    mk_parser_configure(parser, '{', (MkParserFunc)dst_state_end);
-    mk_parser_configure_all(parser, " \t\n", NULL);
-}
-
-
-void rarrow_operator_begin(MkParserContext*            parser,
-                           gchar                c,
-                           MkmachineParserData* data)
-{
-    mk_parser_push(parser);
-    mk_parser_token_cut(parser);
-    mk_parser_configure(parser, '>', (MkParserFunc)dst_state_begin);
-}
-
-
-void empty_dst_transition_begin(MkParserContext*     parser,
-                                gchar                c,
-                                MkmachineParserData* data)
+/**
+ * Use the name of the state being read as the destination state of a
+ * transition that has none.
+ * @param parser the parser
+ * @param c      character to parse
+ * @param data   parser data
+ */
+static void repeat_src_state(MkParserContext*     parser,
+                             gchar                c,
+                             MkmachineParserData* data)
 {
     const gchar** tokens = mk_parser_token_get(parser);
     g_assert(mk_parser_token_size(parser) >= 1);
-    const gchar* src_state = g_strdup(tokens[0]);
+    gchar* src_state = g_strdup(tokens[0]);
 
-    mk_parser_token_cut(parser);
     mk_parser_token_add(parser, src_state);
-    transition_begin(parser, c, data);
+    g_free(src_state);
 }
 
 
-void src_state_begin(MkParserContext*     parser,
-                     gchar                c,
-                     MkmachineParserData* data)
-{
-    mk_parser_token_cut(parser);
-    mk_parser_push(parser);
-    mk_parser_configure_default(parser, (MkParserFunc)mk_parser_token_append);
-    mk_parser_enable_defaults(parser);
-    mk_parser_configure(parser, '=', (MkParserFunc)rarrow_operator_begin);
-    mk_parser_configure(parser, '{', (MkParserFunc)empty_dst_transition_begin);
-    mk_parser_configure(parser, '}', (MkParserFunc)src_state_end);
-    mk_parser_configure_all(parser, " \t\n", NULL);
-}
+#include "mkmachine_grammar.h"
 
 
 const gchar* mk_machine_parser_get_default_state(MkParserContext* parser)
@@ -166,14 +100,16 @@ MkParserContext* mk_machine_parser_new(GHashTable* transitions)
     data->default_state = NULL;
 
     // Initialize parser
-    MkParserContext* parser = mk_parser_new(data);
-    mk_parser_configure_default(parser, (MkParserFunc)mk_parser_token_append);
-    mk_parser_enable_defaults(parser);
-    mk_parser_configure(parser, '{', (MkParserFunc)src_state_begin);
-    mk_parser_configure_all(parser, " \t\n", NULL);
+    MkParserContext* parser = mk_parser_new(&grammar_machine, data);
 
     return parser;
 }
 
 
-/* TODO: mk_machine_parser_free() */
+void mk_machine_parser_free(MkParserContext* parser)
+{
+    MkmachineParserData* data = (MkmachineParserData*)(parser->user_data);
+    g_free(data->default_state);
+    g_free(data);
+    mk_parser_free(parser);
+}
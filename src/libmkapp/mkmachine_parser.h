@@ -46,3 +46,11 @@ const gchar* mk_machine_parser_get_default_state(MkParserContext* parser);
  */
 MkParserContext* mk_machine_parser_new(GHashTable* transitions);
 
+
+
+/**
+ * Free a state machine parser created with mk_machine_parser_new(). The
+ * transition table is not freed.
+ * @param parser the parser
+ */
+void mk_machine_parser_free(MkParserContext* parser);
@@ -11,11 +11,20 @@
  * http://www.gnu.org/copyleft/gpl.html
  */
 
+#define _GNU_SOURCE
+
 #include <stdlib.h>
 #include <string.h>
 #include <errno.h>
 
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <sys/wait.h>
 #include <signal.h>
 
@@ -26,6 +35,195 @@
 
 
 #define BUFFER_LENGTH 2048
+#define SPOOL_BUDGET  (16 << 20)
+#define SAMPLE_PERIOD 1
+#define REPLAY_SOURCE 1
+#define REPLAY_ALWAYS 2
+#define PAUSE_BACKLOG (64 << 10)
+#define PAUSE_PERIOD  10
+
+#define SHARD_BAD_COUNT  "invalid number of instances"
+#define SHARD_BAD_POLICY "unknown sharding policy"
+#define SHARD_BAD_KEY    "invalid sharding key"
+
+#define FEED_NOT_RUNNING "module not running"
+#define FEED_NOT_PROCESS "only processes can be fed"
+#define FEED_OPEN_FAILED "could not open file"
+#define FEED_NOT_REGULAR "not a regular file"
+#define FEED_SPOOLED     "data for the module is spooled"
+#define FEED_BATCH_EOF   "input of the module ends with the batch"
+#define FEED_NO_LENGTH   "length is zero"
+#define FEED_TOO_FAR     "offset and length go past the largest file size"
+#define FEED_PIPE_SIZE   (1 << 20)
+
+#define SCHED_QUANTUM (2 * BUFFER_LENGTH) // Bytes a module forwards per turn
+#define SCHED_BUDGET  (64 << 10)          // Bytes forwarded per iteration
+#define SCHED_BACKLOG (256 << 10)         // Bytes waiting before pausing
+
+#define TUNE_BAD_LANE "unknown lane"
+
+
+/**
+ * Piece of data waiting to be written to a module's standard input. The
+ * data is either held by the chunk or copied from part of a file (see
+ * mk_module_feed()), in which case it does not count as pending in memory.
+ */
+typedef struct {
+    gsize length; /// Number of data bytes, or where to stop in the file
+    gsize offset; /// Number of bytes already written, or where in the file
+    gint  fd;     /// File to copy the data from, or -1
+    gchar data[]; /// The data
+} MkChunk;
+
+
+/**
+ * Module name interned by a module context (see MkModuleHandle).
+ */
+typedef struct {
+    gchar*    name;    /// The name
+    MkModule* module;  /// Module with that name, or NULL
+    guint     version; /// Changed each time the module is added or removed
+} MkModuleName;
+
+
+/**
+ * Piece of data passed from one loop to another: data to write to a module
+ * or data output by a module, to forward to its listeners.
+ */
+typedef struct {
+    MkQueueLink link;    /// Link to the next item
+    MkModule*   module;  /// Module to write to or forward from, or NULL
+    gboolean    forward; /// Forward the data rather than write it?
+    gsize       length;  /// Number of data bytes
+    gchar       data[];  /// The data, nul-terminated
+} MkLoopChunk;
+
+
+static gint    m_sigchld_pipe[2] = { -1, -1 }; // Written to on SIGCHLD
+static GSList* m_contexts = NULL;              // All the module contexts
+
+static struct sigaction m_sigchld_previous;    // SIGCHLD handler replaced
+
+static const gchar* m_lanes[MK_LANES] = {      // Names of the lanes
+    "control", "interactive", "bulk"
+};
+
+
+/**
+ * SIGCHLD handler. Wake up the main loop so that it reaps the modules that
+ * have exited (see module_sigchld_received()), then call the handler that
+ * was installed before, if any, so that it learns about its own children.
+ * @param sig     signal number
+ * @param info    signal information
+ * @param context signal context
+ */
+static void module_sigchld(int sig, siginfo_t* info, void* context)
+{
+    gint saved_errno = errno;
+    if (write(m_sigchld_pipe[1], "", 1) < 0)
+        ; // The pipe is full: a wakeup is already pending
+    errno = saved_errno;
+
+    if (m_sigchld_previous.sa_flags & SA_SIGINFO)
+        m_sigchld_previous.sa_sigaction(sig, info, context);
+    else if (m_sigchld_previous.sa_handler != SIG_DFL
+             && m_sigchld_previous.sa_handler != SIG_IGN)
+        m_sigchld_previous.sa_handler(sig);
+}
+
+
+/**
+ * Reap a module's process if it has exited, collecting its resource usage,
+ * and clean up after it.
+ * @param module  the module
+ * @param options options for wait4(): WNOHANG or 0 to wait
+ * @return        whether the process was reaped
+ */
+static gboolean module_reap(MkModule* module, gint options)
+{
+    struct rusage ru;
+    gint          status;
+    pid_t         pid;
+
+    do {
+        pid = wait4(module->pid, &status, options, &ru);
+    } while (pid < 0 && errno == EINTR);
+
+    if (pid != module->pid)
+        return FALSE;
+
+    mk_usage_exit(&module->usage, &ru);
+    mk_module_on_exit(pid, status, module);
+    return TRUE;
+}
+
+
+/**
+ * Called from the main loop after SIGCHLD was caught, to reap all the
+ * modules that have exited. Modules are looked up again by process ID
+ * before being reaped, since cleaning up after one module can cause
+ * another one to be reaped and deleted.
+ * @param source the SIGCHLD pipe
+ * @param unused unused
+ * @param data   unused
+ * @return       TRUE to keep watching the pipe
+ */
+static gboolean module_sigchld_received(GIOChannel*  source,
+                                        GIOCondition unused,
+                                        gpointer     data)
+{
+    gchar buffer[64];
+    while (read(m_sigchld_pipe[0], buffer, sizeof(buffer)) > 0);
+
+    for (GSList* c = m_contexts; c != NULL; c = c->next) {
+        MkModuleContext* mc = c->data;
+        GList* pids = g_hash_table_get_keys(mc->children);
+
+        for (GList* p = pids; p != NULL; p = p->next) {
+            MkModule* module = g_hash_table_lookup(mc->children, p->data);
+            if (module != NULL)
+                module_reap(module, WNOHANG);
+        }
+
+        g_list_free(pids);
+    }
+
+    return TRUE;
+}
+
+
+/**
+ * Catch SIGCHLD to know when modules exit. Modules are reaped with wait4()
+ * rather than through glib's child watches, so that their resource usage
+ * can be collected. Only the modules' processes are reaped, and the signal
+ * is passed on to the handler installed before, so that child watches
+ * added earlier in the process keep working.
+ */
+static void module_catch_sigchld(void)
+{
+    if (m_sigchld_pipe[0] >= 0)
+        return;
+
+    if (pipe(m_sigchld_pipe))
+        g_critical("Could not create pipe: %s", g_strerror(errno));
+
+    for (gint i = 0; i < 2; ++i) {
+        fcntl(m_sigchld_pipe[i], F_SETFL, O_NONBLOCK);
+        fcntl(m_sigchld_pipe[i], F_SETFD, FD_CLOEXEC);
+    }
+
+    GIOChannel* chan = g_io_channel_unix_new(m_sigchld_pipe[0]);
+    g_io_add_watch(chan, G_IO_IN, (GIOFunc)module_sigchld_received, NULL);
+    g_io_channel_unref(chan);
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = module_sigchld;
+    sa.sa_flags     = SA_SIGINFO | SA_RESTART | SA_NOCLDSTOP;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGCHLD, &sa, &m_sigchld_previous);
+}
+
 
 MkModuleContext* mk_module_context_new(GMainLoop* loop)
 {
@@ -35,238 +233,1998 @@ MkModuleContext* mk_module_context_new(GMainLoop* loop)
                                         (GDestroyNotify)g_free,
                                         (GDestroyNotify)mk_module_delete);
 
-    mc->eof_received = FALSE;
-    mc->n_running    = 0;
-    mc->loop         = loop;
+    mc->eof_received     = FALSE;
+    mc->n_running        = 0;
+    mc->loop             = loop;
+    mc->interpreter      = NULL;
+    mc->interpreter_data = NULL;
+    mc->obey_end         = NULL;
+    mc->spool_dir        = g_strdup(g_get_tmp_dir());
+    mc->spool_budget     = SPOOL_BUDGET;
+    mc->pending_size     = 0;
+    mc->children         = g_hash_table_new(g_direct_hash, g_direct_equal);
+    mc->sample_source    = 0;
+    mc->recorder         = NULL;
+    mc->obeyed           = NULL;
+    mc->replayed         = NULL;
+    mc->loops            = NULL;
+    mc->names            = g_ptr_array_new();
+    mc->name_index       = g_hash_table_new(g_str_hash, g_str_equal);
+    mc->n_prepared       = 0;
+    mc->batching         = 0;
+    mc->batched          = g_ptr_array_new();
+    mc->sched_source     = 0;
+    for (guint lane = 0; lane < MK_LANES; ++lane)
+        mc->lanes[lane] = g_queue_new();
+
+    module_catch_sigchld();
+    m_contexts = g_slist_prepend(m_contexts, mc);
 
     return mc;
 }
 
 
-void mk_module_context_free(MkModuleContext* mc)
+void mk_module_context_free(MkModuleContext* mc)
+{
+    GHashTableIter iter;
+    gpointer       module;
+
+    m_contexts = g_slist_remove(m_contexts, mc);
+    if (mc->sample_source != 0)
+        g_source_remove(mc->sample_source);
+
+    // Modules are deleted in no particular order: unbind them all first
+    g_hash_table_iter_init(&iter, mc->modules);
+    while (g_hash_table_iter_next(&iter, NULL, &module))
+        while (((MkModule*)module)->listeners->len > 0)
+            mk_module_unbind(module,
+                             g_ptr_array_index(((MkModule*)module)->listeners,
+                                               0));
+
+    g_hash_table_unref(mc->modules);
+    g_ptr_array_free(mc->batched, TRUE);
+
+    // Deleted modules no longer wait in the lanes
+    if (mc->sched_source != 0)
+        g_source_remove(mc->sched_source);
+    for (guint lane = 0; lane < MK_LANES; ++lane)
+        g_queue_free(mc->lanes[lane]);
+
+    mk_module_unrecord(mc);
+    if (mc->replayed != NULL)
+        g_hash_table_unref(mc->replayed);
+
+    // Data still on its way to the modules deleted above is dropped
+    if (mc->loops != NULL)
+        mk_loop_set_free(mc->loops);
+
+    guint i;
+    for (i = 0; i < mc->names->len; ++i) {
+        MkModuleName* interned = g_ptr_array_index(mc->names, i);
+        g_free(interned->name);
+        g_free(interned);
+    }
+    g_ptr_array_free(mc->names, TRUE);
+    g_hash_table_unref(mc->name_index);
+
+    g_hash_table_unref(mc->children);
+    g_free(mc->spool_dir);
+    g_free(mc);
+}
+
+
+static void module_handle_item(MkLoopChunk* chunk, MkModuleContext* mc);
+
+
+void mk_module_set_loops(MkModuleContext* mc, const guint workers)
+{
+    if (mc->loops != NULL) {
+        mk_loop_set_free(mc->loops);
+        mc->loops = NULL;
+    }
+
+    if (workers > 0)
+        mc->loops = mk_loop_set_new(workers, (MkLoopFunc)module_handle_item,
+                                    mc);
+}
+
+
+void mk_module_set_spool(MkModuleContext* mc,
+                         const gchar*     dir,
+                         const gsize      budget)
+{
+    g_free(mc->spool_dir);
+    mc->spool_dir    = g_strdup(dir != NULL ? dir : g_get_tmp_dir());
+    mc->spool_budget = budget;
+}
+
+
+void mk_module_set_interpreter(MkModuleContext*    mc,
+                               MkModuleInterpreter interpreter,
+                               void*               data)
+{
+    mc->interpreter      = interpreter;
+    mc->interpreter_data = data;    
+}
+
+
+void mk_module_set_obey_end(MkModuleContext* mc, MkModuleObeyEnd end)
+{
+    mc->obey_end = end;
+}
+
+
+/**
+ * Let the interpreter know that a module's output is no longer obeyed.
+ * @param module the module
+ */
+static void module_obey_end(MkModule* module)
+{
+    MkModuleContext* mc = module->context;
+
+    if (mc->obey_end != NULL)
+        mc->obey_end(mc->interpreter_data, module->name);
+}
+
+
+MkModule* mk_module_lookup(MkModuleContext* mc, const gchar* name)
+{
+    return g_hash_table_lookup(mc->modules, name);
+}
+
+
+/**
+ * Intern a module name.
+ * @param mc   module context
+ * @param name module name
+ * @return     index of the interned name
+ */
+static guint module_intern(MkModuleContext* mc, const gchar* name)
+{
+    gpointer index;
+
+    if (g_hash_table_lookup_extended(mc->name_index, name, NULL, &index))
+        return GPOINTER_TO_UINT(index);
+
+    MkModuleName* interned = g_malloc(sizeof(MkModuleName));
+    interned->name    = g_strdup(name);
+    interned->module  = mk_module_lookup(mc, name);
+    interned->version = 0;
+
+    g_hash_table_insert(mc->name_index, interned->name,
+                        GUINT_TO_POINTER(mc->names->len));
+    g_ptr_array_add(mc->names, interned);
+
+    return mc->names->len - 1;
+}
+
+
+/**
+ * Record that the module designated by a name changed, if the name is
+ * interned.
+ * @param mc     module context
+ * @param name   module name
+ * @param module module now designated by the name, or NULL
+ */
+static void module_name_changed(MkModuleContext* mc,
+                                const gchar*     name,
+                                MkModule*        module)
+{
+    gpointer index;
+
+    if (!g_hash_table_lookup_extended(mc->name_index, name, NULL, &index))
+        return;
+
+    MkModuleName* interned = g_ptr_array_index(mc->names,
+                                               GPOINTER_TO_UINT(index));
+    interned->module = module;
+    ++interned->version;
+}
+
+
+void mk_module_handle_init(MkModuleContext* mc,
+                           MkModuleHandle*  handle,
+                           const gchar*     name)
+{
+    handle->index = module_intern(mc, name);
+
+    MkModuleName* interned = g_ptr_array_index(mc->names, handle->index);
+    handle->version = interned->version;
+    handle->module  = interned->module;
+}
+
+
+MkModule* mk_module_handle_resolve(MkModuleContext* mc,
+                                   MkModuleHandle*  handle)
+{
+    MkModuleName* interned = g_ptr_array_index(mc->names, handle->index);
+
+    if (handle->version != interned->version) {
+        handle->version = interned->version;
+        handle->module  = interned->module;
+    }
+
+    return handle->module;
+}
+
+
+void mk_module_add(MkModuleContext* mc, MkModule* module)
+{
+    g_hash_table_insert(mc->modules, g_strdup(module->name), module);
+    module_name_changed(mc, module->name, module);
+}
+
+
+void mk_module_remove(MkModuleContext* mc, MkModule* module)
+{
+    module_name_changed(mc, module->name, NULL);
+    g_hash_table_remove(mc->modules, module->name);
+}
+
+
+void ptr_array_free_strings(GPtrArray* array)
+{
+    int i;
+    for(i = 0; i < array->len; ++i)
+        g_free(g_ptr_array_index(array, i));
+    g_ptr_array_free(array, TRUE);
+}
+
+
+MkModule* mk_module_new(MkModuleContext* mc, const gchar* name, const gchar* cmd)
+{
+    // Allocate resources
+    MkModule* module       = g_malloc(sizeof(MkModule));
+    module->context      = mc;
+    module->name         = g_strdup(name);
+    module->listeners    = g_ptr_array_new();
+    module->pid          = -1;
+    module->args         = g_ptr_array_new();
+    module->writers      = 0;
+    module->listen       = FALSE;
+    module->zombie       = FALSE;
+    module->obey         = FALSE;
+    module->in           = NULL;
+    module->pending      = g_queue_new();
+    module->pending_size = 0;
+    module->spool        = NULL;
+    module->spooling     = FALSE;
+    module->in_source    = 0;
+    module->eof_pending  = FALSE;
+    module->tuning       = NULL;
+    memset(&module->usage, 0, sizeof(MkUsage));
+    module->builtin      = NULL;
+    module->exit_source  = 0;
+    module->lazy         = FALSE;
+    module->idle         = 0;
+    module->idle_source  = 0;
+    module->last_input   = 0;
+    module->instances    = NULL;
+    module->group        = NULL;
+    module->shard        = MK_SHARD_ROUND_ROBIN;
+    module->shard_key    = NULL;
+    module->next_shard   = 0;
+    module->line         = NULL;
+    module->loop         = -1;
+    module->io_loop      = NULL;
+    module->backlog      = 0;
+    module->taps         = NULL;
+    module->capture      = NULL;
+    module->batch        = NULL;
+    module->batch_eof    = FALSE;
+    module->lane         = MK_LANE_INTERACTIVE;
+    module->scheduled    = g_queue_new();
+    module->sched_size   = 0;
+    module->sched_lane   = -1;
+    module->deficit      = 0;
+    module->sched_paused = FALSE;
+
+    // Initialize the null-terminated argument list with argv[0]
+    gchar* arg0 = g_strdup(cmd);
+    g_ptr_array_add(module->args, arg0);
+    g_ptr_array_add(module->args, NULL);
+    return module;
+}
+
+
+/**
+ * Account for data kept in memory for a module, or on its way to it from
+ * another loop. Worker loops can do this at the same time.
+ * @param module the module
+ * @param delta  number of bytes added, or removed if negative
+ */
+static void module_count_pending(MkModule* module, gssize delta)
+{
+    g_atomic_pointer_add(&module->backlog, delta);
+    g_atomic_pointer_add(&module->context->pending_size, delta);
+}
+
+
+/**
+ * Forget the data a module was to be sent or forward from another loop.
+ * @param chunk  data passed from one loop to another
+ * @param module the module
+ */
+static void module_purge_item(MkLoopChunk* chunk, MkModule* module)
+{
+    if (chunk->module == module) {
+        if (!chunk->forward)
+            module_count_pending(module, -(gssize)chunk->length);
+        chunk->module = NULL;
+    }
+}
+
+
+/**
+ * Free a piece of data waiting to be written to a module.
+ * @param chunk the data
+ */
+static void module_free_chunk(MkChunk* chunk)
+{
+    if (chunk->fd >= 0)
+        close(chunk->fd);
+    g_free(chunk);
+}
+
+
+/**
+ * Throw away all the data waiting to be written to a module.
+ * @param module the module
+ */
+static void module_discard_pending(MkModule* module)
+{
+    MkChunk* chunk;
+    while ((chunk = g_queue_pop_head(module->pending)) != NULL)
+        module_free_chunk(chunk);
+
+    module_count_pending(module, -(gssize)module->pending_size);
+    module->pending_size = 0;
+
+    if (module->spool != NULL) {
+        mk_spool_free(module->spool);
+        module->spool = NULL;
+    }
+}
+
+
+static void module_sched_drop(MkModule* module);
+
+
+/**
+ * Drop the data held for a module by a batch of commands.
+ * @param module the module
+ */
+static void module_batch_drop(MkModule* module)
+{
+    if (module->batch == NULL)
+        return;
+
+    g_ptr_array_remove(module->context->batched, module);
+    g_string_free(module->batch, TRUE);
+    module->batch     = NULL;
+    module->batch_eof = FALSE;
+}
+
+
+static void module_write(MkModule* module, const gchar* data, const gsize len);
+
+
+/**
+ * Write the data held for a module by a batch of commands now, and end
+ * its input if the batch did, for commands that cannot wait for the end
+ * of the batch.
+ * @param module the module
+ */
+static void module_batch_flush(MkModule* module)
+{
+    if (module->batch == NULL)
+        return;
+
+    GString* batch    = module->batch;
+    gboolean eof      = module->batch_eof;
+    module->batch     = NULL;
+    module->batch_eof = FALSE;
+    g_ptr_array_remove(module->context->batched, module);
+
+    if (batch->len > 0)
+        module_write(module, batch->str, batch->len);
+    g_string_free(batch, TRUE);
+    if (eof)
+        mk_module_eof(module);
+}
+
+
+void mk_module_delete(MkModule* module)
+{
+    g_debug("Deleting module %s\n", module->name);
+
+    // Nothing can be written to a module once it has left the table
+    module_batch_drop(module);
+
+    // Stop the modules writing to this one. They are in the module table,
+    // which this module has been removed from.
+    if (module->writers > 0) {
+        GHashTableIter iter;
+        gpointer       writer;
+
+        g_hash_table_iter_init(&iter, module->context->modules);
+        while (g_hash_table_iter_next(&iter, NULL, &writer))
+            mk_module_unbind(writer, module);
+    }
+
+    // Instances go with their group. Those still running are deleted when
+    // they exit.
+    if (module->instances != NULL) {
+        for (guint i = 0; i < module->instances->len; ++i) {
+            MkModule* instance = g_ptr_array_index(module->instances, i);
+            instance->group = NULL;
+            mk_module_delete(instance);
+        }
+        g_ptr_array_free(module->instances, TRUE);
+        module->instances = NULL;
+    }
+
+    // If the module is still running, wait until it is dead and declare that
+    // it scheduled for deletion. mk_module_delete() will have to be called
+    // again when the module is really dead (see mk_module_on_exit()).
+    if (mk_module_is_running(module)) {
+        module->zombie = TRUE;
+    } else {
+        // Unbind the module from its listeners
+        while (module->listeners->len > 0) {
+            MkModule* dest_module = g_ptr_array_index(module->listeners, 0);
+            mk_module_unbind(module, dest_module);
+        }
+
+        module_discard_pending(module);
+        g_queue_free(module->pending);
+        module_sched_drop(module);
+        g_queue_free(module->scheduled);
+
+        if (module->tuning != NULL)
+            mk_tuning_free(module->tuning);
+        if (module->shard_key != NULL)
+            g_regex_unref(module->shard_key);
+        if (module->line != NULL)
+            g_string_free(module->line, TRUE);
+        mk_module_uncapture(module);
+
+        if (module->context->loops != NULL)
+            mk_loop_set_foreach_item(module->context->loops,
+                                     (GFunc)module_purge_item, module);
+
+        g_free(module->name);
+        g_ptr_array_free(module->listeners, TRUE);
+        ptr_array_free_strings(module->args);
+        g_free(module);
+    }
+}
+
+
+gboolean mk_module_binding_exists(MkModule* out_module, MkModule* in_module)
+{
+    for (gsize i = 0; i < out_module->listeners->len; ++i) {
+        MkModule* listener = g_ptr_array_index(out_module->listeners, i);
+        if (listener == in_module)
+            return TRUE;
+    }    
+
+    return FALSE;
+}
+
+
+void mk_module_bind(MkModule* out_module, MkModule* in_module)
+{
+    if (!mk_module_binding_exists(out_module, in_module)) {
+        g_ptr_array_add(out_module->listeners, in_module);
+        ++(in_module->writers);
+    }
+}
+
+
+void mk_module_unbind(MkModule* out_module, MkModule* in_module)
+{
+    if (mk_module_binding_exists(out_module, in_module)) {
+        g_ptr_array_remove(out_module->listeners, in_module);
+        --(in_module->writers);
+        mk_module_untap(out_module, in_module);
+    }
+}
+
+
+/**
+ * Find the tap on a binding.
+ * @param out_module module providing the output
+ * @param in_module  module listening to out_module's output
+ * @return           the tap's index in out_module's taps, or -1
+ */
+static gint module_find_tap(MkModule* out_module, MkModule* in_module)
+{
+    if (out_module->taps != NULL)
+        for (guint i = 0; i < out_module->taps->len; ++i)
+            if (((MkTap*)g_ptr_array_index(out_module->taps, i))->in
+                == in_module)
+                return i;
+
+    return -1;
+}
+
+
+const gchar* mk_module_tap(MkModule*    out_module,
+                           MkModule*    in_module,
+                           const gchar* sampling,
+                           const gchar* path)
+{
+    const gchar* error;
+    MkTap*       tap = mk_tap_new(in_module, sampling, path, &error);
+
+    if (tap == NULL)
+        return error;
+
+    mk_module_untap(out_module, in_module);
+    if (out_module->taps == NULL)
+        out_module->taps = g_ptr_array_new();
+    g_ptr_array_add(out_module->taps, tap);
+
+    return NULL;
+}
+
+
+gboolean mk_module_untap(MkModule* out_module, MkModule* in_module)
+{
+    gint i = module_find_tap(out_module, in_module);
+    if (i < 0)
+        return FALSE;
+
+    mk_tap_free(g_ptr_array_remove_index(out_module->taps, i));
+
+    // Modules without taps do not check for them
+    if (out_module->taps->len == 0) {
+        g_ptr_array_free(out_module->taps, TRUE);
+        out_module->taps = NULL;
+    }
+
+    return TRUE;
+}
+
+
+gboolean mk_module_capture(MkModule*    module,
+                           const gchar* path,
+                           const gsize  rotate,
+                           const gsize  sync)
+{
+    MkCapture* capture = mk_capture_new(path, rotate, sync);
+    if (capture == NULL)
+        return FALSE;
+
+    mk_module_uncapture(module);
+    module->capture = capture;
+    return TRUE;
+}
+
+
+gboolean mk_module_uncapture(MkModule* module)
+{
+    if (module->capture == NULL)
+        return FALSE;
+
+    mk_capture_free(module->capture);
+    module->capture = NULL;
+    return TRUE;
+}
+
+
+void mk_module_set_lazy(MkModule* module, const guint idle)
+{
+    module->lazy = TRUE;
+    module->idle = idle;
+
+    if (module->instances != NULL)
+        for (guint i = 0; i < module->instances->len; ++i)
+            mk_module_set_lazy(g_ptr_array_index(module->instances, i), idle);
+}
+
+
+const gchar* mk_module_shard(MkModule*    module,
+                             const guint  count,
+                             const gchar* policy)
+{
+    MkShardPolicy shard = MK_SHARD_ROUND_ROBIN;
+    GRegex*       key   = NULL;
+
+    if (count == 0 || module->instances != NULL)
+        return SHARD_BAD_COUNT;
+
+    if (policy == NULL || !g_strcmp0(policy, "rr")) {
+        shard = MK_SHARD_ROUND_ROBIN;
+    } else if (!g_strcmp0(policy, "least")) {
+        shard = MK_SHARD_LEAST;
+    } else if (g_str_has_prefix(policy, "hash:")) {
+        shard = MK_SHARD_HASH;
+        key   = g_regex_new(policy + 5, G_REGEX_OPTIMIZE | G_REGEX_RAW, 0,
+                            NULL);
+        if (key == NULL)
+            return SHARD_BAD_KEY;
+    } else {
+        return SHARD_BAD_POLICY;
+    }
+
+    module->shard     = shard;
+    module->shard_key = key;
+    module->line      = g_string_new(NULL);
+    module->instances = g_ptr_array_sized_new(count);
+
+    // Instances run the group's command with the group's settings
+    for (guint i = 0; i < count; ++i) {
+        gchar*    name     = g_strdup_printf("%s[%u]", module->name, i);
+        MkModule* instance = mk_module_new(module->context, name,
+                                           g_ptr_array_index(module->args, 0));
+        g_free(name);
+
+        mk_module_append_args(instance, module->args->len - 2,
+                              (const gchar**)module->args->pdata + 1);
+        instance->lazy     = module->lazy;
+        instance->idle     = module->idle;
+        instance->spooling = module->spooling;
+        instance->loop     = module->loop;
+        instance->group    = module;
+        instance->line     = g_string_new(NULL);
+        g_ptr_array_add(module->instances, instance);
+    }
+
+    return NULL;
+}
+
+
+void mk_module_set_loop(MkModule* module, const gint loop)
+{
+    module->loop = loop;
+
+    if (module->instances != NULL)
+        for (guint i = 0; i < module->instances->len; ++i)
+            mk_module_set_loop(g_ptr_array_index(module->instances, i), loop);
+}
+
+
+const gchar* mk_module_tune(MkModule* module, const gchar* option)
+{
+    if (module->instances != NULL) {
+        const gchar* error = NULL;
+        for (guint i = 0; i < module->instances->len && error == NULL; ++i)
+            error = mk_module_tune(g_ptr_array_index(module->instances, i),
+                                   option);
+        return error;
+    }
+
+    // The lane is not a setting of the process
+    if (g_str_has_prefix(option, "lane=")) {
+        for (guint lane = 0; lane < MK_LANES; ++lane)
+            if (!strcmp(option + strlen("lane="), m_lanes[lane])) {
+                module->lane = lane;
+                return NULL;
+            }
+        return TUNE_BAD_LANE;
+    }
+
+    if (module->tuning == NULL)
+        module->tuning = mk_tuning_new();
+
+    return mk_tuning_set(module->tuning, option);
+}
+
+
+void mk_module_append_args(MkModule* module, const gsize argc, const gchar** argv)
+{
+    // Remove the NULL element, add the new elements and put back the NULL
+    g_ptr_array_remove_index(module->args, module->args->len-1);
+    for (gsize i = 0; i < argc; ++i) {
+        g_ptr_array_add(module->args, g_strdup(argv[i]));
+    }
+    g_ptr_array_add(module->args, NULL);
+}
+
+
+/**
+ * Check whether a module has data waiting to be written to it.
+ * @param module the module
+ * @return       whether data is pending in memory or in the spool
+ */
+static gboolean module_has_pending(MkModule* module)
+{
+    return !g_queue_is_empty(module->pending)
+        || (module->spool != NULL && mk_spool_length(module->spool) > 0);
+}
+
+
+/**
+ * Write as much data as possible to a module's standard input without
+ * blocking.
+ * @param module the module
+ * @param data   what to write
+ * @param length number of data bytes
+ * @return       number of bytes written, or -1 if an error occurred
+ */
+static gssize module_write_some(MkModule*    module,
+                                const gchar* data,
+                                const gsize  length)
+{
+    gint   fd = g_io_channel_unix_get_fd(module->in);
+    gssize n;
+
+    do {
+        n = write(fd, data, length);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        if (errno == EAGAIN)
+            return 0;
+        g_critical("Error writing to %s: %s", module->name, g_strerror(errno));
+    }
+
+    return n;
+}
+
+
+/**
+ * Copy as much of a file as possible to a module's standard input without
+ * blocking. The data goes from the file to the pipe within the kernel,
+ * with splice(). Files that cannot be spliced are copied through a small
+ * buffer.
+ * @param module the module
+ * @param chunk  part of the file to copy, which is made to end where the
+ *               file ends if it is shorter
+ * @return       number of bytes written, or -1 if an error occurred
+ */
+static gssize module_splice_some(MkModule* module, MkChunk* chunk)
+{
+    gint   fd     = g_io_channel_unix_get_fd(module->in);
+    gsize  length = chunk->length - chunk->offset;
+    loff_t offset = chunk->offset;
+    gssize n;
+
+    do {
+        n = splice(chunk->fd, &offset, fd, NULL, MIN(length, FEED_PIPE_SIZE),
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0 && errno == EINVAL) {
+        gchar buf[BUFFER_LENGTH];
+
+        n = pread(chunk->fd, buf, MIN(length, BUFFER_LENGTH), chunk->offset);
+        if (n > 0)
+            return module_write_some(module, buf, n);
+    }
+
+    if (n == 0) {
+        chunk->length = chunk->offset;
+    } else if (n < 0) {
+        if (errno == EAGAIN)
+            return 0;
+        g_critical("Error feeding %s: %s", module->name, g_strerror(errno));
+    }
+
+    return n;
+}
+
+
+/**
+ * Write as much pending data as possible to a module's standard input.
+ * Data kept in memory is older than data in the spool, so it is written
+ * first.
+ * @param module the module
+ * @return       whether data is still pending
+ */
+static gboolean module_flush_pending(MkModule* module)
+{
+    while (!g_queue_is_empty(module->pending)) {
+        MkChunk* chunk = g_queue_peek_head(module->pending);
+        gssize   n = chunk->fd >= 0
+            ? module_splice_some(module, chunk)
+            : module_write_some(module, chunk->data + chunk->offset,
+                                chunk->length - chunk->offset);
+        if (n < 0) {
+            module_discard_pending(module);
+            return FALSE;
+        } else if (n == 0 && chunk->offset < chunk->length) {
+            return TRUE;
+        }
+
+        chunk->offset += n;
+        if (chunk->fd < 0) {
+            module->pending_size -= n;
+            module_count_pending(module, -n);
+        }
+
+        if (chunk->offset == chunk->length)
+            module_free_chunk(g_queue_pop_head(module->pending));
+    }
+
+    while (module->spool != NULL && mk_spool_length(module->spool) > 0) {
+        gsize        length;
+        const gchar* data = mk_spool_peek(module->spool, &length);
+        gssize       n    = module_write_some(module, data, length);
+        if (n < 0) {
+            module_discard_pending(module);
+            return FALSE;
+        } else if (n == 0) {
+            return TRUE;
+        }
+
+        mk_spool_consume(module->spool, n);
+    }
+
+    return FALSE;
+}
+
+
+/**
+ * Wait until a module's standard input can be written to.
+ * @param module the module
+ */
+static void module_wait_writeable(MkModule* module)
+{
+    struct pollfd pfd;
+    pfd.fd     = g_io_channel_unix_get_fd(module->in);
+    pfd.events = POLLOUT;
+
+    while (poll(&pfd, 1, -1) < 0 && errno == EINTR);
+}
+
+
+/**
+ * Write all the pending data and then the data provided to a module,
+ * blocking until the module has read everything.
+ * @param module the module
+ * @param data   what to write
+ * @param length number of data bytes
+ */
+static void module_write_blocking(MkModule*    module,
+                                  const gchar* data,
+                                  gsize        length)
+{
+    while (module_flush_pending(module))
+        module_wait_writeable(module);
+
+    while (length > 0) {
+        gssize n = module_write_some(module, data, length);
+        if (n < 0)
+            return;
+        else if (n == 0)
+            module_wait_writeable(module);
+
+        data   += n;
+        length -= n;
+    }
+}
+
+
+/**
+ * Called when a module's standard input can be written to, to write the
+ * data that was kept for it.
+ * @param source the module's standard input
+ * @param unused unused
+ * @param module the module
+ * @return       whether the source must still be watched
+ */
+static gboolean module_write_pending(GIOChannel*  source,
+                                     GIOCondition unused,
+                                     MkModule*    module)
+{
+    if (module_flush_pending(module))
+        return TRUE;
+
+    module->in_source = 0;
+    if (module->eof_pending)
+        mk_module_eof(module);
+
+    return FALSE;
+}
+
+
+/**
+ * Start writing a module's pending data as soon as it can read it.
+ * @param module the module
+ */
+static void module_watch_pending(MkModule* module)
+{
+    if (module->in_source == 0 && module->in != NULL)
+        module->in_source = mk_loop_add_watch(module->io_loop, module->in,
+                                              G_IO_OUT | G_IO_ERR | G_IO_HUP,
+                                              (GIOFunc)module_write_pending,
+                                              module);
+}
+
+
+/**
+ * Keep data that cannot be written to a module yet. Data is kept in
+ * memory as long as the context's budget allows it. Beyond that, it goes
+ * to the module's spool if spooling is enabled, or else it is written
+ * synchronously from the main loop. Worker loops keep it in memory rather
+ * than block.
+ * @param module the module
+ * @param data   what to keep
+ * @param length number of data bytes
+ */
+static void module_keep(MkModule* module, const gchar* data, const gsize length)
+{
+    MkModuleContext* mc = module->context;
+
+    // Once data has gone to the spool, everything must follow it there to
+    // stay in order.
+    gboolean to_spool = module->spool != NULL
+                        && mk_spool_length(module->spool) > 0;
+
+    if (!to_spool && (gsize)g_atomic_pointer_get(&mc->pending_size) + length
+                     > mc->spool_budget) {
+        if (module->spooling) {
+            to_spool = TRUE;
+        } else if (mk_module_is_running(module) && module->in != NULL
+                   && mk_loop_current() == NULL) {
+            module_write_blocking(module, data, length);
+            return;
+        }
+    }
+
+    if (to_spool) {
+        if (module->spool == NULL)
+            module->spool = mk_spool_new(mc->spool_dir, module->name);
+        if (module->spool != NULL
+            && mk_spool_append(module->spool, data, length)) {
+            if (mk_module_is_running(module))
+                module_watch_pending(module);
+            return;
+        }
+        g_warning("Could not spool data for %s: keeping it in memory",
+                  module->name);
+    }
+
+    MkChunk* chunk = g_malloc(sizeof(MkChunk) + length);
+    chunk->length = length;
+    chunk->offset = 0;
+    chunk->fd     = -1;
+    memcpy(chunk->data, data, length);
+    g_queue_push_tail(module->pending, chunk);
+    module->pending_size += length;
+    module_count_pending(module, length);
+
+    if (mk_module_is_running(module))
+        module_watch_pending(module);
+}
+
+
+/**
+ * Get the amount of data written to a module that it has not read yet:
+ * data kept for it and data in its standard input pipe.
+ * @param module the module
+ * @return       number of bytes
+ */
+static gsize module_queued(MkModule* module)
+{
+    gsize queued = module->pending_size;
+    gint  unread;
+
+    if (module->spool != NULL)
+        queued += mk_spool_length(module->spool);
+    if (module->in != NULL
+        && !ioctl(g_io_channel_unix_get_fd(module->in), FIONREAD, &unread))
+        queued += unread;
+
+    return queued;
+}
+
+
+/**
+ * Hash a sharding key (64-bit FNV-1a).
+ * @param key    the key
+ * @param length number of key bytes
+ * @return       hash value
+ */
+static guint64 module_hash_key(const gchar* key, gsize length)
+{
+    guint64 hash = 14695981039346656037ULL;
+
+    for (gsize i = 0; i < length; ++i) {
+        hash ^= (guchar)key[i];
+        hash *= 1099511628211ULL;
+    }
+
+    return hash;
+}
+
+
+/**
+ * Map a hash value to one of count buckets with Lamping and Veach's jump
+ * consistent hash: when a bucket is added, only 1/count of the keys move.
+ * @param hash  hash value
+ * @param count number of buckets
+ * @return      bucket number
+ */
+static guint module_jump_hash(guint64 hash, const guint count)
+{
+    gint64 bucket = 0;
+    gint64 next   = 0;
+
+    while (next < count) {
+        bucket = next;
+        hash   = hash * 2862933555777941757ULL + 1;
+        next   = (bucket + 1) * ((gdouble)(1LL << 31)
+                                 / (gdouble)((hash >> 33) + 1));
+    }
+
+    return bucket;
+}
+
+
+/**
+ * Choose the instance of a group a line goes to.
+ * @param group  the group
+ * @param line   the line
+ * @param length number of line bytes
+ * @param queued amount of data queued for each instance (MK_SHARD_LEAST)
+ * @return       instance number
+ */
+static guint module_choose_instance(MkModule*    group,
+                                    const gchar* line,
+                                    gsize        length,
+                                    const gsize* queued)
+{
+    guint count = group->instances->len;
+
+    if (group->shard == MK_SHARD_HASH) {
+        GMatchInfo* info  = NULL;
+        gboolean    found = g_regex_match_full(group->shard_key, line, length,
+                                               0, 0, &info, NULL);
+        gint        start = -1;
+        gint        end   = -1;
+
+        // Hash the first capture group, or the whole match
+        if (found && (g_match_info_get_match_count(info) < 2
+                      || !g_match_info_fetch_pos(info, 1, &start, &end)
+                      || start < 0))
+            g_match_info_fetch_pos(info, 0, &start, &end);
+        g_match_info_free(info);
+
+        if (found)
+            return module_jump_hash(module_hash_key(line + start, end - start),
+                                    count);
+    }
+
+    // Ties go round-robin, so that idle instances share the load
+    guint chosen = group->next_shard++ % count;
+
+    if (group->shard == MK_SHARD_LEAST)
+        for (guint i = 1; i < count; ++i) {
+            guint candidate = (chosen + i) % count;
+            if (queued[candidate] < queued[chosen])
+                chosen = candidate;
+        }
+
+    return chosen;
+}
+
+
+/**
+ * Dispatch the lines written to a group among its instances. Lines for the
+ * same instance are written to it at once. A partial line is kept until it
+ * is complete.
+ * @param group  the group
+ * @param data   what was written
+ * @param length number of data bytes
+ * @param flush  whether to dispatch a partial line too
+ */
+static void module_dispatch(MkModule*    group,
+                            const gchar* data,
+                            const gsize  length,
+                            gboolean     flush)
+{
+    guint     count   = group->instances->len;
+    GString** batches = g_new0(GString*, count);
+    gsize*    queued  = NULL;
+
+    if (group->shard == MK_SHARD_LEAST) {
+        queued = g_new(gsize, count);
+        for (guint i = 0; i < count; ++i)
+            queued[i] = module_queued(g_ptr_array_index(group->instances, i));
+    }
+
+    g_string_append_len(group->line, data, length);
+
+    const gchar* line = group->line->str;
+    const gchar* end  = line + group->line->len;
+    while (line < end) {
+        const gchar* eol = memchr(line, '\n', end - line);
+        if (eol == NULL && !flush)
+            break;
+
+        gsize n = (eol != NULL ? eol + 1 : end) - line;
+        guint i = module_choose_instance(group, line, n, queued);
+        if (batches[i] == NULL)
+            batches[i] = g_string_sized_new(group->line->len);
+        g_string_append_len(batches[i], line, n);
+        if (queued != NULL)
+            queued[i] += n;
+
+        line += n;
+    }
+    g_string_erase(group->line, 0, line - group->line->str);
+
+    for (guint i = 0; i < count; ++i) {
+        if (batches[i] == NULL)
+            continue;
+        mk_module_write(g_ptr_array_index(group->instances, i),
+                        batches[i]->str, batches[i]->len);
+        g_string_free(batches[i], TRUE);
+    }
+
+    g_free(batches);
+    g_free(queued);
+}
+
+
+void mk_module_batch_begin(MkModuleContext* mc)
+{
+    ++mc->batching;
+}
+
+
+void mk_module_batch_end(MkModuleContext* mc)
+{
+    if (--mc->batching > 0)
+        return;
+
+    // Writing may run commands obeyed from built-in modules, which may
+    // delete modules still in the list: take them out one at a time
+    while (mc->batched->len > 0) {
+        MkModule* module  = g_ptr_array_remove_index(mc->batched, 0);
+        GString*  batch   = module->batch;
+        gboolean  eof     = module->batch_eof;
+        module->batch     = NULL;
+        module->batch_eof = FALSE;
+
+        mk_module_write(module, batch->str, batch->len);
+        g_string_free(batch, TRUE);
+        if (eof)
+            mk_module_eof(module);
+    }
+}
+
+
+/**
+ * Hold data written to a module while a batch of commands runs.
+ * @param module the module
+ * @param data   what to write
+ * @param length number of data bytes
+ */
+static void module_batch_write(MkModule*    module,
+                               const gchar* data,
+                               const gsize  length)
+{
+    if (module->batch == NULL) {
+        module->batch = g_string_sized_new(length);
+        g_ptr_array_add(module->context->batched, module);
+    }
+
+    g_string_append_len(module->batch, data, length);
+}
+
+
+/**
+ * Write data to a module, or keep it until the module can read it.
+ * @param module the module
+ * @param data   what to write
+ * @param len    number of data bytes
+ */
+static void module_write(MkModule* module, const gchar* data, const gsize len)
+{
+    module->usage.bytes_in += len;
+    module->last_input      = g_get_monotonic_time();
+
+    // Groups share their input among their instances
+    if (module->instances != NULL) {
+        module_dispatch(module, data, len, FALSE);
+        return;
+    }
+
+    // Lazy modules start with the first data written to them, or again
+    // once they have been shut down for idleness. Data is kept until
+    // they can read it.
+    if (module->lazy && (!mk_module_is_running(module)
+                         || (module->builtin != NULL ? module->builtin->eof
+                                                     : module->in == NULL))) {
+        module_keep(module, data, len);
+        mk_module_run(module);
+        return;
+    }
+
+    // If the module is not running, keep the data for later if spooling
+    // was requested. Otherwise, do not try to write.
+    if (!mk_module_is_running(module)) {
+        if (module->spooling) {
+            module_keep(module, data, len);
+        } else {
+            g_warning("Could not write to %s: module not running\n",
+                      module->name);
+        }
+        return;
+    }
+
+    // Built-in modules process data right away
+    if (module->builtin != NULL) {
+        mk_builtin_write(module->builtin, data, len);
+        return;
+    }
+
+    // Do not write if the module's input is not writeable. This can happen
+    // the channel was shut down after a call to mk_module_eof() but the
+    // process did notexit yet.
+    if (!module->in || module->eof_pending) {
+        g_warning("Could not write to %s: module not writeable\n",
+                  module->name);
+        return;
+    }
+
+    // Write right away unless older data is still waiting. Keep whatever
+    // the module is not ready to read.
+    gsize written = 0;
+    if (!module_has_pending(module)) {
+        gssize n = module_write_some(module, data, len);
+        if (n < 0)
+            return;
+        written = n;
+    }
+
+    if (written < len)
+        module_keep(module, data + written, len - written);
+}
+
+
+void mk_module_write(MkModule* module, const gchar* data, const gsize length)
+{
+    gsize len = (length == (gsize)-1) ? strlen(data) : length;
+    if (len == 0)
+        return;
+
+    // Commands run in a batch write everything at once when it ends
+    if (module->context->batching > 0 && mk_loop_current() == NULL)
+        module_batch_write(module, data, len);
+    else
+        module_write(module, data, len);
+}
+
+
+const gchar* mk_module_feed(MkModule*    module,
+                            const gchar* path,
+                            const gsize  offset,
+                            const gsize  length)
+{
+    // Offsets in the file are signed, and the end must not wrap around
+    const guint64 max = MIN((guint64)G_MAXSIZE, (guint64)G_MAXINT64);
+    if (length == 0)
+        return FEED_NO_LENGTH;
+    if (offset > max || (length != (gsize)-1 && length > max - offset))
+        return FEED_TOO_FAR;
+
+    // The file comes after the data written earlier in a batch
+    if (module->batch_eof)
+        return FEED_BATCH_EOF;
+    module_batch_flush(module);
+
+    if (module->instances != NULL || module->builtin != NULL
+        || mk_builtin_is_builtin(g_ptr_array_index(module->args, 0)))
+        return FEED_NOT_PROCESS;
+
+    if (!mk_module_is_running(module) || module->in == NULL
+        || module->eof_pending)
+        return FEED_NOT_RUNNING;
+
+    // The spool is written after the data waiting in memory, where the
+    // file would go: it would get ahead of the data spooled before it
+    if (module->spool != NULL && mk_spool_length(module->spool) > 0)
+        return FEED_SPOOLED;
+
+    gint fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return FEED_OPEN_FAILED;
+
+    struct stat st;
+    if (fstat(fd, &st) || !S_ISREG(st.st_mode)) {
+        close(fd);
+        return FEED_NOT_REGULAR;
+    }
+
+    // Without a length, the file is copied up to its end
+    gsize end = length == (gsize)-1 ? G_MAXSIZE : offset + length;
+
+    // The file is copied as the module reads it, after the data already
+    // waiting and before the data written next
+    MkChunk* chunk = g_malloc(sizeof(MkChunk));
+    chunk->length = end;
+    chunk->offset = offset;
+    chunk->fd     = fd;
+    g_queue_push_tail(module->pending, chunk);
+
+    // A larger pipe lets each splice() move more data. The kernel may
+    // refuse, which only costs more wakeups.
+    fcntl(g_io_channel_unix_get_fd(module->in), F_SETPIPE_SZ, FEED_PIPE_SIZE);
+
+    module_watch_pending(module);
+    return NULL;
+}
+
+
+/**
+ * Pass data to another loop, to write it to a module or to forward it from
+ * a module. Data to write counts as pending for the module until then.
+ * @param loop    the loop, or NULL for the main loop
+ * @param module  the module
+ * @param data    the data
+ * @param length  number of data bytes
+ * @param forward whether to forward the data rather than write it
+ */
+static void module_post(MkLoop*      loop,
+                        MkModule*    module,
+                        const gchar* data,
+                        const gsize  length,
+                        gboolean     forward)
+{
+    MkLoopChunk* chunk = g_malloc(sizeof(MkLoopChunk) + length + 1);
+
+    chunk->module  = module;
+    chunk->forward = forward;
+    chunk->length  = length;
+    memcpy(chunk->data, data, length);
+    chunk->data[length] = '\0';
+
+    if (!forward)
+        module_count_pending(module, length);
+    mk_loop_post(module->context->loops, loop, &chunk->link);
+}
+
+
+/**
+ * Write data to a module from whatever loop this is called from. A worker
+ * loop writes to the modules it does the I/O of, and passes data for the
+ * other modules to the loop doing their I/O. Lazy modules may have to be
+ * run, which is left to the main loop.
+ * @param module the module
+ * @param data   what to write
+ * @param length number of data bytes
+ */
+static void module_deliver(MkModule* module, const gchar* data, gsize length)
+{
+    MkLoop* current = mk_loop_current();
+    MkLoop* owner   = module->lazy ? NULL : module->io_loop;
+
+    if (current == NULL || current == owner)
+        mk_module_write(module, data, length);
+    else
+        module_post(owner, module, data, length, FALSE);
+}
+
+
+void mk_module_write_to_listeners(MkModule*    module,
+                                  const gchar* data, 
+                                  const gsize  length)
+{
+    if (length == 0)
+        return;
+
+    module->usage.bytes_out += length;
+
+    // Send a copy of data to all the listeners
+    for (guint i = 0; i < module->listeners->len; ++i) {
+
+        MkModule* dest_module = g_ptr_array_index(module->listeners, i);
+
+        if (dest_module != NULL)
+            module_deliver(dest_module, data, length);
+    }
+
+    // Append to the capture file, and stop if it cannot be written to
+    if (module->capture != NULL
+        && !mk_capture_write(module->capture, data, length)) {
+        g_warning("Could not capture the output of %s: %s", module->name,
+                  g_strerror(errno));
+        mk_module_uncapture(module);
+    }
+
+    // Copy samples of the tapped bindings
+    if (module->taps != NULL)
+        for (guint i = 0; i < module->taps->len; ++i)
+            mk_tap_write(g_ptr_array_index(module->taps, i), data, length);
+
+    // Write to our own standard output if listening has been requested
+    if (module->listen) {
+        fwrite(data, 1, length, stdout);
+        fflush(stdout);
+    }
+
+    // Interpret the commands if obedience has been requested
+    if (module->obey && module->context->interpreter != NULL) {
+        // Let the interpreter know where the commands come from
+        const gchar* obeyed = module->context->obeyed;
+        module->context->obeyed = module->name;
+
+        module->context->interpreter(module->context->interpreter_data,
+                                     data, length);
+
+        module->context->obeyed = obeyed;
+    }
+}
+
+
+static void module_forward(MkModule* module, const gchar* data, gsize length);
+
+
+/**
+ * Forward the complete lines output by an instance as the output of its
+ * group, so that lines from different instances do not get mixed. A
+ * partial line is kept until it is complete.
+ * @param instance the instance
+ * @param data     output data
+ * @param length   number of data bytes
+ * @param flush    whether to forward a partial line too
+ */
+static void module_forward_lines(MkModule*    instance,
+                                 const gchar* data,
+                                 gsize        length,
+                                 gboolean     flush)
+{
+    GString*     line = instance->line;
+    const gchar* eol;
+
+    g_string_append_len(line, data, length);
+    if (line->len == 0)
+        return;
+
+    eol = flush ? line->str + line->len - 1
+                : g_strrstr_len(line->str, line->len, "\n");
+    if (eol == NULL)
+        return;
+
+    // The group's listeners may write back to the instance
+    gsize  n     = eol + 1 - line->str;
+    gchar* lines = g_strndup(line->str, n);
+    g_string_erase(line, 0, n);
+    module_forward(instance->group, lines, n);
+    g_free(lines);
+}
+
+
+/**
+ * Forward data output by a module to its listeners, recording it if
+ * requested.
+ * @param module the module
+ * @param data   output data, nul-terminated
+ * @param length number of data bytes
+ */
+static void module_forward(MkModule* module, const gchar* data, gsize length)
+{
+    MkModuleContext* mc = module->context;
+
+    // Worker loops only route data between modules
+    if (mk_loop_current() != NULL
+        && (module->group != NULL || module->listen || module->obey
+            || mc->recorder != NULL)) {
+        module_post(NULL, module, data, length, TRUE);
+        return;
+    }
+
+    // The output of instances is that of their group
+    if (module->group != NULL) {
+        module->usage.bytes_out += length;
+        module_forward_lines(module, data, length, FALSE);
+        return;
+    }
+
+    if (mc->recorder != NULL)
+        mk_recorder_write(mc->recorder, MK_RECORD_CHUNK,
+                          module->name, data, length);
+    mk_module_write_to_listeners(module, data, length);
+}
+
+
+/**
+ * Take a module out of the lane it waits in.
+ * @param module the module
+ */
+static void module_sched_leave(MkModule* module)
+{
+    if (module->sched_lane >= 0) {
+        g_queue_remove(module->context->lanes[module->sched_lane], module);
+        module->sched_lane = -1;
+    }
+    module->deficit = 0;
+}
+
+
+/**
+ * Start reading a module's output again once enough of what it output
+ * has been forwarded.
+ * @param module the module
+ */
+static void module_sched_resume(MkModule* module)
+{
+    if (!module->sched_paused || module->sched_size > SCHED_BACKLOG / 2)
+        return;
+
+    module->sched_paused = FALSE;
+    mk_loop_add_watch(module->io_loop, module->out,
+                      G_IO_IN | G_IO_ERR | G_IO_HUP,
+                      (GIOFunc)mk_module_forward_out, module);
+}
+
+
+/**
+ * Forward the output of a module that waits in its lane.
+ * @param module the module
+ * @param all    whether to forward all of it, rather than as much as its
+ *               deficit allows
+ * @return       number of bytes forwarded
+ */
+static gsize module_sched_forward(MkModule* module, gboolean all)
+{
+    gsize forwarded = 0;
+
+    while (!g_queue_is_empty(module->scheduled)) {
+        MkChunk* chunk = g_queue_peek_head(module->scheduled);
+        if (!all && chunk->length > module->deficit)
+            break;
+
+        g_queue_pop_head(module->scheduled);
+        module->sched_size -= chunk->length;
+        if (!all)
+            module->deficit -= chunk->length;
+        forwarded += chunk->length;
+
+        module_forward(module, chunk->data, chunk->length);
+        g_free(chunk);
+    }
+
+    return forwarded;
+}
+
+
+/**
+ * Forward the output waiting in the lanes, in the order of the lanes. In
+ * each lane, the modules take turns, each adding a quantum to its deficit
+ * and forwarding its output while the deficit covers it. Each call
+ * forwards a limited number of bytes, giving the main loop a chance to
+ * read new output, in the control lane for instance, in between.
+ * @param mc module context
+ * @return   whether output is still waiting
+ */
+static gboolean module_sched_dispatch(MkModuleContext* mc)
+{
+    gsize budget = SCHED_BUDGET;
+
+    for (guint lane = 0; lane < MK_LANES && budget > 0; ++lane) {
+        guint turns = g_queue_get_length(mc->lanes[lane]);
+
+        while (turns-- > 0 && budget > 0
+               && !g_queue_is_empty(mc->lanes[lane])) {
+            MkModule* module = g_queue_peek_head(mc->lanes[lane]);
+
+            module->deficit += SCHED_QUANTUM;
+            budget -= MIN(budget, module_sched_forward(module, FALSE));
+
+            // Forwarding runs commands, which may have taken the module
+            // out of the lane already (see module_sched_flush())
+            if (module->sched_lane != lane)
+                continue;
+
+            g_queue_remove(mc->lanes[lane], module);
+            if (g_queue_is_empty(module->scheduled)) {
+                module->sched_lane = -1;
+                module->deficit    = 0;
+            } else {
+                g_queue_push_tail(mc->lanes[lane], module);
+            }
+            module_sched_resume(module);
+        }
+    }
+
+    for (guint lane = 0; lane < MK_LANES; ++lane)
+        if (!g_queue_is_empty(mc->lanes[lane]))
+            return TRUE;
+
+    mc->sched_source = 0;
+    return FALSE;
+}
+
+
+/**
+ * Schedule the forwarding of data output by a module (see
+ * module_sched_dispatch()). Only the main loop schedules: worker loops
+ * forward right away.
+ * @param module the module
+ * @param data   output data
+ * @param length number of data bytes
+ */
+static void module_schedule(MkModule* module, const gchar* data, gsize length)
+{
+    MkModuleContext* mc   = module->context;
+    MkLane           lane = module->obey ? MK_LANE_CONTROL : module->lane;
+
+    // Commands are interpreted right away, unless older output is waiting
+    if (mk_loop_current() != NULL
+        || (lane == MK_LANE_CONTROL && module->sched_lane < 0)) {
+        module_forward(module, data, length);
+        return;
+    }
+
+    MkChunk* chunk = g_malloc(sizeof(MkChunk) + length + 1);
+    chunk->length = length;
+    chunk->offset = 0;
+    chunk->fd     = -1;
+    memcpy(chunk->data, data, length);
+    chunk->data[length] = '\0';
+
+    g_queue_push_tail(module->scheduled, chunk);
+    module->sched_size += length;
+
+    if (module->sched_lane < 0) {
+        module->sched_lane = lane;
+        g_queue_push_tail(mc->lanes[lane], module);
+    }
+
+    if (mc->sched_source == 0)
+        mc->sched_source = g_idle_add((GSourceFunc)module_sched_dispatch, mc);
+}
+
+
+/**
+ * Forward all the output of a module that waits in its lane.
+ * @param module the module
+ */
+static void module_sched_flush(MkModule* module)
+{
+    module_sched_forward(module, TRUE);
+    module_sched_leave(module);
+}
+
+
+/**
+ * Drop the output of a module that waits in its lane.
+ * @param module the module
+ */
+static void module_sched_drop(MkModule* module)
+{
+    while (!g_queue_is_empty(module->scheduled))
+        g_free(g_queue_pop_head(module->scheduled));
+    module->sched_size = 0;
+    module_sched_leave(module);
+}
+
+
+/**
+ * Handle data passed from one loop to another.
+ * @param chunk the data
+ * @param mc    module context
+ */
+static void module_handle_item(MkLoopChunk* chunk, MkModuleContext* mc)
+{
+    if (chunk->module == NULL)
+        return;
+
+    if (chunk->forward) {
+        module_schedule(chunk->module, chunk->data, chunk->length);
+    } else {
+        module_count_pending(chunk->module, -(gssize)chunk->length);
+        module_deliver(chunk->module, chunk->data, chunk->length);
+    }
+}
+
+
+/**
+ * Check whether a module's standard output is tuned to be a pty.
+ * @param module the module
+ * @return       whether the module writes to a pty
+ */
+static gboolean module_has_pty(MkModule* module)
 {
-    g_hash_table_unref(mc->modules);
-    g_free(mc);
-
+    return module->tuning != NULL
+        && module->tuning->stdout_mode == MK_STDOUT_PTY;
 }
 
 
-void mk_module_set_interpreter(MkModuleContext*    mc,
-                               MkModuleInterpreter interpreter,
-                               void*               data)
+/**
+ * Check whether a module's output only goes to its capture file, so that
+ * it can be moved there without being read. splice() cannot read from a
+ * pty, though, and must not get ahead of the output read before, which
+ * waits in a lane until it is forwarded.
+ * @param module the module
+ * @return       whether the output only goes to the capture file
+ */
+static gboolean module_captured_only(MkModule* module)
 {
-    mc->interpreter      = interpreter;
-    mc->interpreter_data = data;    
+    return module->capture != NULL && module->listeners->len == 0
+        && !module->listen && !module->obey && module->group == NULL
+        && module->context->recorder == NULL && !module_has_pty(module)
+        && module->sched_size == 0 && module->sched_lane < 0;
 }
 
 
-MkModule* mk_module_lookup(MkModuleContext* mc, const gchar* name)
+/**
+ * Check whether data can be read from a channel without blocking.
+ * @param channel the channel
+ * @return        whether data (or end-of-file) is available
+ */
+static gboolean module_readable(GIOChannel* channel)
 {
-    return g_hash_table_lookup(mc->modules, name);
+    if (g_io_channel_get_buffer_condition(channel) & G_IO_IN)
+        return TRUE;
+
+    struct pollfd pfd;
+    pfd.fd     = g_io_channel_unix_get_fd(channel);
+    pfd.events = POLLIN;
+
+    return poll(&pfd, 1, 0) > 0;
 }
 
 
-void mk_module_add(MkModuleContext* mc, MkModule* module)
+gboolean mk_module_record(MkModuleContext* mc, const gchar* path)
 {
-    g_hash_table_insert(mc->modules, g_strdup(module->name), module);
+    MkRecorder* recorder = mk_recorder_new(path);
+    if (recorder == NULL)
+        return FALSE;
+
+    mk_module_unrecord(mc);
+    mc->recorder = recorder;
+    return TRUE;
 }
 
 
-void mk_module_remove(MkModuleContext* mc, MkModule* module)
+void mk_module_unrecord(MkModuleContext* mc)
 {
-    g_hash_table_remove(mc->modules, module->name);
+    if (mc->recorder != NULL) {
+        mk_recorder_free(mc->recorder);
+        mc->recorder = NULL;
+    }
 }
 
 
-void ptr_array_free_strings(GPtrArray* array)
+void mk_module_set_replayed(MkModuleContext* mc,
+                            const gchar*     name,
+                            gboolean         always)
 {
-    int i;
-    for(i = 0; i < array->len; ++i)
-        g_free(g_ptr_array_index(array, i));
-    g_ptr_array_free(array, TRUE);
+    if (mc->replayed == NULL)
+        mc->replayed = g_hash_table_new_full(g_str_hash, g_str_equal,
+                                             g_free, NULL);
+
+    // Values are REPLAY_ALWAYS or REPLAY_SOURCE
+    g_hash_table_insert(mc->replayed, g_strdup(name),
+                        GINT_TO_POINTER(always ? REPLAY_ALWAYS
+                                               : REPLAY_SOURCE));
 }
 
 
-MkModule* mk_module_new(MkModuleContext* mc, const gchar* name, const gchar* cmd)
+void mk_module_sample(MkModuleContext* mc)
 {
-    // Allocate resources
-    MkModule* module    = g_malloc(sizeof(MkModule));
-    module->context   = mc;
-    module->name      = g_strdup(name);
-    module->listeners = g_ptr_array_new();
-    module->pid       = -1;
-    module->args      = g_ptr_array_new();
-    module->writers   = 0;
-    module->listen    = FALSE;
-    module->zombie    = FALSE;
-    module->obey      = FALSE;
+    GHashTableIter iter;
+    gpointer       module;
 
-    // Initialize the null-terminated argument list with argv[0]
-    gchar* arg0 = g_strdup(cmd);
-    g_ptr_array_add(module->args, arg0);
-    g_ptr_array_add(module->args, NULL);
-    return module;
+    g_hash_table_iter_init(&iter, mc->children);
+    while (g_hash_table_iter_next(&iter, NULL, &module))
+        mk_usage_sample(&((MkModule*)module)->usage, ((MkModule*)module)->pid);
 }
 
 
-void mk_module_delete(MkModule* module)
+/**
+ * Sample the resource usage of a context's modules. Sampling stops when
+ * no module is running anymore.
+ * @param mc module context
+ * @return   whether sampling must go on
+ */
+static gboolean module_sample_timeout(MkModuleContext* mc)
 {
-    g_debug("Deleting module %s\n", module->name);
-
-    // If the module is still running, wait until it is dead and declare that
-    // it scheduled for deletion. mk_module_delete() will have to be called
-    // again when the module is really dead (see mk_module_on_exit()).
-    if (module->pid > 0) {
-        module->zombie = TRUE;
-    } else {
-        // Unbind the module from its listeners
-        for (guint i = 0; i < module->listeners->len; ++i) {
-            MkModule* dest_module = g_ptr_array_index(module->listeners, i);
-            mk_module_unbind(module, dest_module);
-        }
-
-        // TODO: unbind from writers
+    mk_module_sample(mc);
 
-        g_free(module->name);
-        g_ptr_array_free(module->listeners, FALSE);
-        ptr_array_free_strings(module->args);
-        g_free(module);
+    if (g_hash_table_size(mc->children) == 0) {
+        mc->sample_source = 0;
+        return FALSE;
     }
+
+    return TRUE;
 }
 
 
-gboolean mk_module_binding_exists(MkModule* out_module, MkModule* in_module)
+/**
+ * Shut a lazy module down if it has not been sent data for long enough.
+ * Otherwise, check again when it could have been idle for long enough.
+ * Data still pending counts as input.
+ * @param module the module
+ * @return       FALSE: a new timer is set up if needed
+ */
+static gboolean module_idle_timeout(MkModule* module)
 {
-    for (gsize i = 0; i < out_module->listeners->len; ++i) {
-        MkModule* listener = g_ptr_array_index(out_module->listeners, i);
-        if (listener == in_module)
-            return TRUE;
-    }    
+    gint64 idle = g_get_monotonic_time() - module->last_input;
+    gint64 left = (gint64)module->idle * G_USEC_PER_SEC - idle;
+
+    if (module_has_pending(module) && left <= 0)
+        left = (gint64)module->idle * G_USEC_PER_SEC;
 
+    if (left > 0) {
+        module->idle_source = g_timeout_add
+            (left / 1000 + 1, (GSourceFunc)module_idle_timeout, module);
+        return FALSE;
+    }
+
+    g_debug("MkModule %s is idle: shutting it down.", module->name);
+    module->idle_source = 0;
+    mk_module_eof(module);
     return FALSE;
 }
 
 
-void mk_module_bind(MkModule* out_module, MkModule* in_module)
+/**
+ * Start checking whether a module that was just run becomes idle.
+ * @param module the module
+ */
+static void module_watch_idle(MkModule* module)
 {
-    if (!mk_module_binding_exists(out_module, in_module)) {
-        g_ptr_array_add(out_module->listeners, in_module);
-        ++(in_module->writers);
+    if (module->lazy && module->idle > 0 && module->idle_source == 0) {
+        module->last_input  = g_get_monotonic_time();
+        module->idle_source = g_timeout_add_seconds
+            (module->idle, (GSourceFunc)module_idle_timeout, module);
     }
 }
 
 
-void mk_module_unbind(MkModule* out_module, MkModule* in_module)
+/**
+ * Cleanup after a module has stopped running, be it a process or a
+ * built-in module.
+ * @param module the module
+ */
+static void module_exited(MkModule* module)
 {
-    if (mk_module_binding_exists(out_module, in_module)) {
-        g_ptr_array_remove(out_module->listeners, in_module);
-        --(in_module->writers);
-    }
-}
+    MkModuleContext* mc = module->context;
 
+    if (module->group != NULL)
+        module_forward_lines(module, NULL, 0, TRUE);
 
-void mk_module_append_args(MkModule* module, const gsize argc, const gchar** argv)
-{
-    // Remove the NULL element, add the new elements and put back the NULL
-    g_ptr_array_remove_index(module->args, module->args->len-1);
-    for (gsize i = 0; i < argc; ++i) {
-        g_ptr_array_add(module->args, g_strdup(argv[i]));
+    // All the module's output has been obeyed
+    if (module->obey)
+        module_obey_end(module);
+
+    // Data that could not be written is lost, unless it must be kept
+    // until the module runs again.
+    module->eof_pending = FALSE;
+    if (!module->spooling && !module->lazy && module_has_pending(module)) {
+        g_warning("%s exited before reading all its input", module->name);
+        module_discard_pending(module);
     }
-    g_ptr_array_add(module->args, NULL);
+
+    // Delete the module if mk_module_delete has already been called
+    // on it while it was running. A lazy module that was sent data while
+    // it was shutting down runs again.
+    if (module->zombie)
+        mk_module_delete(module);
+    else if (module->lazy && module_has_pending(module))
+        mk_module_run(module);
+
+    // Quit if execution is finished and a main loop has been provided
+    --(mc->n_running);
+    g_debug("MkModules running: %d", mc->n_running);
+    if (mk_module_finished(mc) && mc->loop)
+        g_main_loop_quit(mc->loop);
 }
 
 
-void mk_module_write(MkModule* module, const gchar* data, const gsize length)
+/**
+ * End a built-in module that has produced all its output.
+ * @param module the module
+ * @return       FALSE to remove the idle source
+ */
+static gboolean module_builtin_exit(MkModule* module)
 {
-    GError* error = NULL;
-    
-    // If the module is not running, do not try to write 
-    if (!mk_module_is_running(module)) {
-        g_warning("Could not write to %s: module not running\n",
-                  module->name);
-        return;
-    }
+    g_debug("MkModule %s exited.", module->name);
 
-    // Do not write if the module's input is not writeable. This can happen
-    // the channel was shut down after a call to mk_module_eof() but the
-    // process did notexit yet.
-    if (!module->in) {
-        g_warning("Could not write to %s: module not writeable\n",
-                  module->name);
-        return;
+    module->exit_source    = 0;
+    module->usage.exited   = g_get_monotonic_time();
+    if (module->idle_source != 0) {
+        g_source_remove(module->idle_source);
+        module->idle_source = 0;
     }
+    mk_builtin_free(module->builtin);
+    module->builtin = NULL;
 
-    // Write data
-    gsize written;
-    g_io_channel_write_chars(module->in, data, length, &written, &error);
-    if (error != NULL) {
-        g_critical("Error writing to %s: %s", module->name, error->message);
-        return;
-    }
+    module_exited(module);
+    return FALSE;
+}
 
-    // Flush
-    g_io_channel_flush(module->in, &error);
-    if (error != NULL) {
-        g_critical("Error writing to %s: %s", module->name, error->message);
-        return;
-    }
 
+/**
+ * Called when a built-in module will not produce any more output. It
+ * exits from the main loop, like a process would, since this can happen
+ * while its input or output is being processed.
+ * @param module the module
+ */
+static void module_builtin_done(MkModule* module)
+{
+    if (module->exit_source == 0)
+        module->exit_source = g_idle_add((GSourceFunc)module_builtin_exit,
+                                         module);
 }
 
 
-void mk_module_write_to_listeners(MkModule*    module,
-                                  const gchar* data, 
-                                  const gsize  length)
+/**
+ * Start a built-in module, and feed it the data kept while it was not
+ * running.
+ * @param module the module
+ */
+static void module_run_builtin(MkModule* module)
 {
-    if (length == 0)
+    const gchar* error;
+
+    module->builtin = mk_builtin_new((const gchar**)module->args->pdata,
+                                     (MkBuiltinOutputFunc)module_forward,
+                                     (MkBuiltinDoneFunc)module_builtin_done,
+                                     module, &error);
+    if (module->builtin == NULL) {
+        g_warning("Could not run %s: %s", module->name, error);
         return;
-
-    // Send a copy of data to all the listeners
-    for (guint i = 0; i < module->listeners->len; ++i) {
-
-        MkModule* dest_module = g_ptr_array_index(module->listeners, i);
-
-        if (dest_module != NULL)
-            mk_module_write(dest_module, data, length);
     }
 
-    // Write to our own standard output if listening has been requested
-    if (module->listen) {
-        g_printf("%s", data);
-        fflush(stdout);
+    mk_usage_start(&module->usage);
+    ++module->context->n_running;
+    g_debug("MkModules running: %d", module->context->n_running);
+    module_watch_idle(module);
+
+    MkChunk* chunk;
+    while ((chunk = g_queue_pop_head(module->pending)) != NULL) {
+        module->pending_size -= chunk->length - chunk->offset;
+        module_count_pending(module, -(gssize)(chunk->length - chunk->offset));
+        mk_builtin_write(module->builtin, chunk->data + chunk->offset,
+                         chunk->length - chunk->offset);
+        module_free_chunk(chunk);
     }
 
-    // Interpret the commands if obedience has been requested
-    if (module->obey && module->context->interpreter != NULL) {
-        gsize len = length;
-        if (len < 0)
-            len = strlen(data);
-            
-        for(gsize i = 0; i < len; ++i)
-            module->context->interpreter
-                (module->context->interpreter_data, data[i]);
+    while (module->spool != NULL && mk_spool_length(module->spool) > 0) {
+        gsize        length;
+        const gchar* data = mk_spool_peek(module->spool, &length);
+        mk_builtin_write(module->builtin, data, length);
+        mk_spool_consume(module->spool, length);
     }
 }
 
 
 void mk_module_on_exit(GPid pid, gint status, MkModule* module)
 {
-    g_debug("MkModule %s exited with status %d.", module->name, status>>8);
-
-    MkModuleContext* mc = module->context;
-
-    // Write any remaining data from the module to its listeners
-    mk_module_forward_out(module->out, 0, module);
+    g_debug("MkModule %s exited with status %d "
+            "(user %.2fs, system %.2fs, max. RSS %ld KiB).",
+            module->name, status>>8, module->usage.user_time,
+            module->usage.system_time, module->usage.max_rss);
+
+    g_hash_table_remove(module->context->children, GINT_TO_POINTER(pid));
+
+    // Write any remaining data from the module to its listeners, after
+    // the data waiting in its lane. There can be more than one buffer full
+    // of it.
+    do
+        module_sched_flush(module);
+    while (mk_module_forward_out(module->out, 0, module)
+           && module_readable(module->out));
+    module_sched_flush(module);
+    module->sched_paused = FALSE;
     mk_module_forward_err(module->err, 0, module);
 
     // Remove the watch on stdout and stderr and shut down IO channels.
     // The module's standard input could be already closed (see
     // mk_module_eof() and mk_module_kill()).
     while (g_source_remove_by_user_data(module));
+    if (module->io_loop != NULL) {
+        while (mk_loop_remove_by_user_data(module->io_loop, module));
+        --module->io_loop->modules;
+        module->io_loop = NULL;
+    }
+    module->in_source   = 0;
+    module->idle_source = 0;
 
     if (module->in) {
         g_io_channel_shutdown(module->in, TRUE, NULL);
         g_io_channel_unref(module->in);
+        module->in = NULL;
     }
 
     g_io_channel_shutdown(module->out, TRUE, NULL);
@@ -276,19 +2234,54 @@ void mk_module_on_exit(GPid pid, gint status, MkModule* module)
 
     // Close the pid (does nothing under UNIX)
     g_spawn_close_pid(pid);
-
-    // Delete the module if mk_module_delete has already been called
-    // on it while it was running.
     module->pid = -1;
-    if (module->zombie)
-        mk_module_delete(module);
 
-    // Quit if execution is finished and a main loop has been provided
-    --(mc->n_running);
-    g_debug("MkModules running: %d", mc->n_running);
-    if (mk_module_finished(mc) && mc->loop)
-        g_main_loop_quit(mc->loop);
+    module_exited(module);
+}
+
+
+/**
+ * Check whether a worker loop must stop reading a module's output for a
+ * while. The main loop blocks writing to modules when the context's memory
+ * budget is exceeded (see module_keep()), which worker loops cannot do
+ * without stopping the modules they read from. Instead, they stop reading
+ * from the modules writing to those that have a backlog.
+ * @param module the module
+ * @return       whether to stop reading from the module
+ */
+static gboolean module_must_pause(MkModule* module)
+{
+    MkModuleContext* mc = module->context;
+
+    if ((gsize)g_atomic_pointer_get(&mc->pending_size) <= mc->spool_budget)
+        return FALSE;
+
+    for (guint i = 0; i < module->listeners->len; ++i) {
+        MkModule* listener = g_ptr_array_index(module->listeners, i);
+        if (!listener->spooling
+            && (gsize)g_atomic_pointer_get(&listener->backlog) > PAUSE_BACKLOG)
+            return TRUE;
+    }
+
+    return FALSE;
+}
+
+
+/**
+ * Start reading a module's output again, once a worker loop no longer
+ * needs to stop.
+ * @param module the module
+ * @return       whether to check again later
+ */
+static gboolean module_resume(MkModule* module)
+{
+    if (module_must_pause(module))
+        return TRUE;
 
+    mk_loop_add_watch(module->io_loop, module->out,
+                      G_IO_IN | G_IO_ERR | G_IO_HUP,
+                      (GIOFunc)mk_module_forward_out, module);
+    return FALSE;
 }
 
 
@@ -301,10 +2294,47 @@ gboolean mk_module_forward_out(GIOChannel*  source,
     GError*   error = NULL;
     GIOStatus status;
 
+    if (mk_loop_current() != NULL && module_must_pause(module)) {
+        mk_loop_add_timeout(module->io_loop, PAUSE_PERIOD,
+                            (GSourceFunc)module_resume, module);
+        return FALSE;
+    }
+
+    // Neither does the main loop read more from a module while too much of
+    // its output waits to be forwarded (see module_sched_resume())
+    if (mk_loop_current() == NULL && module->sched_size > SCHED_BACKLOG) {
+        module->sched_paused = TRUE;
+        return FALSE;
+    }
+
+    // Output that only goes to the capture file is moved there by the
+    // kernel, once the data already read by the channel is gone
+    if (module_captured_only(module)
+        && !(g_io_channel_get_buffer_condition(source) & G_IO_IN)) {
+        gssize n = mk_capture_splice(module->capture,
+                                     g_io_channel_unix_get_fd(source));
+        if (n > 0) {
+            module->usage.bytes_out += n;
+            return TRUE;
+        } else if (n == 0 || errno == EAGAIN) {
+            return n != 0;
+        }
+
+        g_warning("Could not capture the output of %s: %s", module->name,
+                  g_strerror(errno));
+        mk_module_uncapture(module);
+    }
+
     // Read data
     status = g_io_channel_read_chars(source, buf, BUFFER_LENGTH-1,
                                      &length, &error);
 
+    // Reading from a pty fails with EIO rather than reaching end-of-file
+    // once the module has closed it
+    if (status == G_IO_STATUS_ERROR && module_has_pty(module)) {
+        g_clear_error(&error);
+        return FALSE;
+    }
 
     // Check for errors
     if (error != NULL)
@@ -318,7 +2348,7 @@ gboolean mk_module_forward_out(GIOChannel*  source,
 
     case G_IO_STATUS_NORMAL:
         buf[length] = '\0';
-        mk_module_write_to_listeners(module, buf, length);
+        module_schedule(module, buf, length);
         break;
 
     case G_IO_STATUS_EOF:
@@ -382,31 +2412,73 @@ void mk_module_run(MkModule* module)
     GError* error = NULL;
     gint in_fd, out_fd, err_fd;
 
-    if (module->pid > 0) {
+    if (mk_module_is_running(module)) {
         g_debug("MkModule %s already running.", module->name);
         return;
     }
 
+    // Replayed modules must not produce output of their own
+    gint replayed = module->context->replayed == NULL ? 0
+        : GPOINTER_TO_INT(g_hash_table_lookup(module->context->replayed,
+                                              module->name));
+    if (replayed == REPLAY_ALWAYS
+        || (replayed == REPLAY_SOURCE && module->writers == 0)) {
+        g_debug("MkModule %s is replayed: not starting it.", module->name);
+        return;
+    }
+
+    if (module->instances != NULL) {
+        mk_usage_start(&module->usage);
+        for (guint i = 0; i < module->instances->len; ++i)
+            mk_module_run(g_ptr_array_index(module->instances, i));
+        return;
+    }
+
     g_debug("Starting module %s...", module->name);
 
+    if (mk_builtin_is_builtin(g_ptr_array_index(module->args, 0))) {
+        module_run_builtin(module);
+        return;
+    }
+
+    // Preload libstdbuf or open a pty for the standard output, as tuned
+    gchar** env = mk_tuning_environ(module->tuning);
+    gint    pty = mk_tuning_open_pty(module->tuning);
+
+    if (pty < 0 && module_has_pty(module))
+        g_warning("Could not open a pty for %s: %s", module->name,
+                  g_strerror(errno));
+
     // Spawn the process
     g_spawn_async_with_pipes(NULL,
                              (gchar**)(module->args->pdata),
-                             NULL,
+                             env,
                              G_SPAWN_SEARCH_PATH
                              | G_SPAWN_DO_NOT_REAP_CHILD,
-                             NULL,
-                             NULL,
+                             module->tuning != NULL
+                             ? (GSpawnChildSetupFunc)mk_tuning_apply : NULL,
+                             module->tuning,
                              &(module->pid),
                              &in_fd,
                              &out_fd,
                              &err_fd,
                              &error);
+
+    g_strfreev(env);
+    mk_tuning_close_pty(module->tuning);
         
     if (error != NULL) {
         g_warning("Could not run %s: %s", module->name, error->message);
+        if (pty >= 0)
+            close(pty);
         return;
     }
+
+    // The process writes to the pty rather than to the pipe
+    if (pty >= 0) {
+        close(out_fd);
+        out_fd = pty;
+    }
         
     // Connect file descriptors. Output and error must be non-blocking.
     // Otherwise, g_io_channel_read_chars will block trying to fill the
@@ -419,61 +2491,136 @@ void mk_module_run(MkModule* module)
     g_io_channel_set_flags(module->out, G_IO_FLAG_NONBLOCK, NULL);
     g_io_channel_set_flags(module->err, G_IO_FLAG_NONBLOCK, NULL);
 
-    // Start forwarding stdout to listeners and stderr to stderr
-    g_io_add_watch(module->out, G_IO_IN | G_IO_ERR | G_IO_HUP,
-                   (GIOFunc)mk_module_forward_out, module);
-    g_io_add_watch(module->err, G_IO_IN | G_IO_ERR | G_IO_HUP,
-                   (GIOFunc)mk_module_forward_err, module);
-
-    // Cleanup when the child exits. Glib catches SIGCHLD to know when
-    // to call the child watch function. If the process has already exited,
-    // though, we must react by ourselves.
-    module->source = g_child_watch_add(module->pid,
-                                       (GChildWatchFunc)mk_module_on_exit,
-                                       module);
-    ++module->context->n_running;
-    g_debug("MkModules running: %d", module->context->n_running);
+    // Output is forwarded as it is, be it text or not: it can be the data
+    // of writeb commands
+    g_io_channel_set_encoding(module->out, NULL, NULL);
 
-    gint status;
-    if (waitpid(module->pid, &status, WNOHANG) > 0) {
-        mk_module_on_exit(module->pid, status, module);
+    // Standard input is non-blocking too, so that a module that does not
+    // read its input fast enough does not block everything else. What it
+    // cannot read right away is kept until it can.
+    g_io_channel_set_flags(module->in, G_IO_FLAG_NONBLOCK, NULL);
+
+    // Choose the worker loop doing the module's I/O, if any
+    MkModuleContext* mc = module->context;
+    if (mc->loops != NULL) {
+        guint workers = mk_loop_set_workers(mc->loops);
+        module->io_loop = module->loop >= 0
+            ? mk_loop_set_worker(mc->loops, module->loop % workers)
+            : mk_loop_set_least_used(mc->loops);
+        ++module->io_loop->modules;
     }
 
+    if (module_has_pending(module))
+        module_watch_pending(module);
+
+    // Start forwarding stdout to listeners and stderr to stderr
+    mk_loop_add_watch(module->io_loop, module->out,
+                      G_IO_IN | G_IO_ERR | G_IO_HUP,
+                      (GIOFunc)mk_module_forward_out, module);
+    mk_loop_add_watch(module->io_loop, module->err,
+                      G_IO_IN | G_IO_ERR | G_IO_HUP,
+                      (GIOFunc)mk_module_forward_err, module);
+
+    // Cleanup when the child exits. The module will be reaped when SIGCHLD
+    // is caught. If the process has already exited, though, we must react
+    // by ourselves.
+    g_hash_table_insert(mc->children, GINT_TO_POINTER(module->pid), module);
+    mk_usage_start(&module->usage);
+    if (mc->sample_source == 0)
+        mc->sample_source = g_timeout_add_seconds
+            (SAMPLE_PERIOD, (GSourceFunc)module_sample_timeout, mc);
+
+    ++mc->n_running;
+    g_debug("MkModules running: %d", mc->n_running);
+    module_watch_idle(module);
+
+    module_reap(module, WNOHANG);
+
 }
 
 
 void mk_module_kill(MkModule* module)
 {
-    if (module->pid > 0) {
+    // Like pending data, data held by a batch is dropped
+    if (!module->spooling)
+        module_batch_drop(module);
+
+    if (module->instances != NULL) {
+        for (guint i = 0; i < module->instances->len; ++i)
+            mk_module_kill(g_ptr_array_index(module->instances, i));
+
+    } else if (module->builtin != NULL) {
+        mk_builtin_stop(module->builtin);
+
+    } else if (module->pid > 0) {
         // Kill the process
         if (kill(module->pid, SIGTERM))
             g_warning("Could not kill child process: %s", g_strerror(errno));
 
+        // Stop writing pending data, unless it must be kept for later
+        if (module->in_source != 0) {
+            mk_loop_remove_source(module->io_loop, module->in_source);
+            module->in_source = 0;
+        }
+        module->eof_pending = FALSE;
+        if (!module->spooling)
+            module_discard_pending(module);
+
         // Close stdin to stop writing to the module
-        g_io_channel_shutdown(module->in, TRUE, NULL);
-        g_io_channel_unref(module->in);
-        module->in = NULL;
+        if (module->in) {
+            g_io_channel_shutdown(module->in, TRUE, NULL);
+            g_io_channel_unref(module->in);
+            module->in = NULL;
+        }
     }
 }
 
 
 void mk_module_wait(MkModule* module)
 {
-    // If the module is running, wait until it exits. Then, call
-    // mk_module_on_exit() manually: since we called waitpid() ourselves,
-    // glib won't take care of it anymore.
-    if (module->pid > 0) {
-        int status;
-        pid_t pid = waitpid(module->pid, &status, 0);
-        mk_module_on_exit(pid, status, module);
-        g_source_remove(module->source);
+    // The module may need the data a batch holds for it, and the end of
+    // its input, before it can exit
+    module_batch_flush(module);
+
+    if (module->instances != NULL) {
+        for (guint i = 0; i < module->instances->len; ++i)
+            mk_module_wait(g_ptr_array_index(module->instances, i));
+
+    // Built-in modules process their input synchronously, except for the
+    // lines a throttle holds: once these are out, only their exit is left.
+    // Until their input ends, they cannot exit.
+    } else if (module->builtin != NULL) {
+        if (module->builtin->eof)
+            mk_builtin_drain(module->builtin);
+        if (module->exit_source != 0) {
+            g_source_remove(module->exit_source);
+            module_builtin_exit(module);
+        }
+
+    // If the module is running, wait until it exits and clean up.
+    } else if (module->pid > 0) {
+        // The module may need the data it was sent before it can exit
+        if (module->in != NULL) {
+            module_write_blocking(module, NULL, 0);
+            if (module->eof_pending)
+                mk_module_eof(module);
+        }
+
+        module_reap(module, 0);
     }
 }
 
 
 gboolean mk_module_is_running(MkModule* module)
 {
-    return module->pid > 0;
+    if (module->instances != NULL) {
+        for (guint i = 0; i < module->instances->len; ++i)
+            if (mk_module_is_running(g_ptr_array_index(module->instances, i)))
+                return TRUE;
+        return FALSE;
+    }
+
+    return module->pid > 0 || module->builtin != NULL;
 }
 
 
@@ -515,6 +2662,40 @@ void mk_module_eof(MkModule* module)
 {
     GError* error = NULL;
 
+    // The end of the input comes after the data held by a batch
+    if (module->batch != NULL && mk_loop_current() == NULL) {
+        module->batch_eof = TRUE;
+        return;
+    }
+
+    // A group's last line may have no newline
+    if (module->instances != NULL) {
+        module_dispatch(module, NULL, 0, TRUE);
+        for (guint i = 0; i < module->instances->len; ++i)
+            mk_module_eof(g_ptr_array_index(module->instances, i));
+        return;
+    }
+
+    if (module->builtin != NULL) {
+        mk_builtin_eof(module->builtin);
+        return;
+    }
+
+    if (module->in == NULL)
+        return;
+
+    // Close stdin only after the module has read what it was sent
+    if (module_has_pending(module)) {
+        module->eof_pending = TRUE;
+        return;
+    }
+
+    if (module->in_source != 0) {
+        mk_loop_remove_source(module->io_loop, module->in_source);
+        module->in_source = 0;
+    }
+    module->eof_pending = FALSE;
+
     g_io_channel_shutdown(module->in, TRUE, &error);
     g_io_channel_unref(module->in);
     module->in = NULL;
@@ -525,6 +2706,26 @@ void mk_module_eof(MkModule* module)
 }
 
 
+void mk_module_spool(MkModule* module)
+{
+    module->spooling = TRUE;
+
+    if (module->instances != NULL)
+        for (guint i = 0; i < module->instances->len; ++i)
+            mk_module_spool(g_ptr_array_index(module->instances, i));
+}
+
+
+void mk_module_unspool(MkModule* module)
+{
+    module->spooling = FALSE;
+
+    if (module->instances != NULL)
+        for (guint i = 0; i < module->instances->len; ++i)
+            mk_module_unspool(g_ptr_array_index(module->instances, i));
+}
+
+
 void mk_module_obey(MkModule* module)
 {
     module->obey = TRUE;
@@ -533,5 +2734,8 @@ void mk_module_obey(MkModule* module)
 
 void mk_module_disobey(MkModule* module)
 {
-    module->obey = FALSE;
+    if (module->obey) {
+        module->obey = FALSE;
+        module_obey_end(module);
+    }
 }
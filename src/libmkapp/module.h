@@ -24,14 +24,47 @@
 
 #include <glib.h>
 
+#include "builtin.h"
+#include "capture.h"
+#include "loop.h"
+#include "record.h"
+#include "spool.h"
+#include "tap.h"
+#include "tune.h"
+#include "usage.h"
+
 
 /**
  * MkModule interpreter function type, called when a module's obey flag is set
  * to true, to interpred its output as commands.
+ * @param data   arbitrary pointer passed to mk_module_set_interpreter()
+ * @param chars  characters received
+ * @param length number of characters
+ */
+typedef void(*MkModuleInterpreter)(void* data, const gchar* chars,
+                                   const gsize length);
+
+/**
+ * Function type called when a module stops being obeyed, or exits while
+ * obeyed, so that the interpreter can drop what the module's commands left
+ * unfinished.
  * @param data arbitrary pointer passed to mk_module_set_interpreter()
- * @param c    character received
+ * @param name name of the module
+ */
+typedef void(*MkModuleObeyEnd)(void* data, const gchar* name);
+
+
+/**
+ * Priority lanes. The main loop forwards the output of modules in the
+ * control lane first, then in the interactive lane, then in the bulk lane.
+ * @brief Priority lane.
  */
-typedef void(*MkModuleInterpreter)(void* data, const char c);
+typedef enum {
+    MK_LANE_CONTROL,     /// Commands, from obeyed modules
+    MK_LANE_INTERACTIVE, /// Output of modules by default
+    MK_LANE_BULK,        /// Data streams that can wait
+    MK_LANES             /// Number of lanes
+} MkLane;
 
 
 /**
@@ -46,6 +79,26 @@ typedef void(*MkModuleInterpreter)(void* data, const char c);
  * If an interpreter function is provided, it will be called to handle
  * all the characters received from a module that has its obey flag on.
  *
+ * By default, everything happens in the main loop. With worker loops (see
+ * mk_module_set_loops()), the I/O of module processes is spread among
+ * them, while commands are still executed from the main loop.
+ *
+ * The output that the main loop reads from modules, or that worker loops
+ * pass to it, is forwarded by a scheduler rather than right away. Modules
+ * with output waiting take turns within their lane, each forwarding up to
+ * a quantum of bytes in its turn (deficit round-robin), and the scheduler
+ * forwards a limited number of bytes per main loop iteration, so that no
+ * module delays the others. The output of obeyed modules goes to the
+ * control lane, and is interpreted right away when none of it is waiting.
+ *
+ * While a batch of commands runs (see mk_module_batch_begin()), the data
+ * written to modules from the main loop is held, so that each module gets
+ * it at once when the batch ends.
+ *
+ * Module names are interned by the context (see MkModuleHandle). The
+ * interpreter can resolve the modules named by a command beforehand and
+ * leave them in the prepared array for the command to use.
+ *
  * @brief MkModule running context.
  */
 typedef struct {
@@ -54,31 +107,112 @@ typedef struct {
     gint                n_running;        /// Number of modules running
     GMainLoop*          loop;             /// Program's main loop
     MkModuleInterpreter interpreter;      /// MkModule command interpreter
+    MkModuleObeyEnd     obey_end;         /// Called when obeying ends
     void*               interpreter_data; /// Data for interpreter
+    gchar*              spool_dir;        /// Where to create spool files
+    gsize               spool_budget;     /// Max. bytes pending in memory
+    gsize               pending_size;     /// Bytes pending in memory
+    GHashTable*         children;         /// Running modules (key=pid)
+    guint               sample_source;    /// Usage sampling timer
+    MkRecorder*         recorder;         /// Where to record traffic, or NULL
+    const gchar*        obeyed;           /// Module being obeyed, or NULL
+    GHashTable*         replayed;         /// Modules not to run, or NULL
+    MkLoopSet*          loops;            /// Worker loops, or NULL
+    GPtrArray*          names;            /// Interned module names
+    GHashTable*         name_index;       /// Index of each interned name
+    struct MkModule*    prepared[2];      /// Modules resolved for a command
+    guint               n_prepared;       /// Number of modules resolved
+    guint               batching;         /// Depth of batches being run
+    GPtrArray*          batched;          /// Modules with data held by batch
+    GQueue*             lanes[MK_LANES];  /// Modules with output waiting
+    guint               sched_source;     /// Idle source forwarding output
 } MkModuleContext;
 
 
+/**
+ * Handle on a module name interned by a module context. The index of a
+ * name never changes, while its version changes each time a module with
+ * that name is added or removed. A handle remembers the module it was last
+ * resolved to and the version of the name at that time, so that it can be
+ * resolved again without hashing the name, and keeps following the name
+ * when the module is redefined.
+ *
+ * @brief Interned module name.
+ */
+typedef struct {
+    guint            index;   /// Index of the name within the context
+    guint            version; /// Version of the name last resolved
+    struct MkModule* module;  /// Module last resolved to, or NULL
+} MkModuleHandle;
+
+
+/**
+ * How the lines written to a group of module instances are dispatched.
+ */
+typedef enum {
+    MK_SHARD_ROUND_ROBIN, /// Each instance in turn
+    MK_SHARD_LEAST,       /// Instance with the least data waiting
+    MK_SHARD_HASH         /// Consistent hash of a key found in the line
+} MkShardPolicy;
+
+
 /**
  * A module is any executable file launched within its own process. Modules
  * must have a unique name and can have their standard inputs and output
  * connected freely.
  *
+ * A module can also be a group of instances of the same command, sharing
+ * its input line by line (see mk_module_shard()). The instances belong to
+ * the group and are not in the context's module table.
+ *
  * @brief Command launched in its own process.
  */
-typedef struct {
-    MkModuleContext* context;   /// Context the module belongs to
-    gchar*           name;      /// Unique module name
-    GPtrArray*       listeners; /// MkModules interested in a module's output
-    GPid             pid;       /// Process ID
-    GPtrArray*       args;      /// Executable file and arguments
-    GIOChannel*      in;        /// Standard input
-    GIOChannel*      out;       /// Standard output
-    GIOChannel*      err;       /// Standard error
-    guint            source;    /// Glib event source
-    gint             writers;   /// Number of modules this one listens to
-    gboolean         listen;    /// Are we listening to this module's output?
-    gboolean         zombie;    /// Is this module supposed to be dead?
-    gboolean         obey;      /// Shall we obey this module?
+typedef struct MkModule {
+    MkModuleContext* context;      /// Context the module belongs to
+    gchar*           name;         /// Unique module name
+    GPtrArray*       listeners;    /// MkModules interested in the output
+    GPid             pid;          /// Process ID
+    GPtrArray*       args;         /// Executable file and arguments
+    GIOChannel*      in;           /// Standard input
+    GIOChannel*      out;          /// Standard output
+    GIOChannel*      err;          /// Standard error
+    gint             writers;      /// Number of modules this one listens to
+    gboolean         listen;       /// Are we listening to the output?
+    gboolean         zombie;       /// Is this module supposed to be dead?
+    gboolean         obey;         /// Shall we obey this module?
+    GQueue*          pending;      /// Data waiting to be written to stdin
+    gsize            pending_size; /// Number of bytes in pending
+    MkSpool*         spool;        /// Pending data that did not fit in memory
+    gboolean         spooling;     /// Keep data written while not running?
+    guint            in_source;    /// Watch writing pending data to stdin
+    gboolean         eof_pending;  /// Close stdin once pending is written
+    MkTuning*        tuning;       /// Process settings, or NULL
+    MkUsage          usage;        /// Resources used and data routed
+    MkBuiltin*       builtin;      /// Running built-in module, or NULL
+    guint            exit_source;  /// Idle source ending a built-in module
+    gboolean         lazy;         /// Run when data is first written?
+    guint            idle;         /// Seconds without input before eof, or 0
+    guint            idle_source;  /// Timer checking for idleness
+    gint64           last_input;   /// When data was last written
+    GPtrArray*       instances;    /// Instances of a group, or NULL
+    struct MkModule* group;        /// Group of an instance, or NULL
+    MkShardPolicy    shard;        /// How a group dispatches lines
+    GRegex*          shard_key;    /// Key of MK_SHARD_HASH lines
+    guint            next_shard;   /// Next instance for MK_SHARD_ROUND_ROBIN
+    GString*         line;         /// Partial line of a group or instance
+    gint             loop;         /// Worker loop requested, or -1
+    MkLoop*          io_loop;      /// Worker loop doing the I/O, or NULL
+    gsize            backlog;      /// Bytes in memory for the module (atomic)
+    GPtrArray*       taps;         /// Taps on bindings to listeners, or NULL
+    MkCapture*       capture;      /// Where the output is captured, or NULL
+    GString*         batch;        /// Data held until the batch ends, or NULL
+    gboolean         batch_eof;    /// Close stdin once batch is written
+    MkLane           lane;         /// Lane of the output, unless obeyed
+    GQueue*          scheduled;    /// Output waiting to be forwarded
+    gsize            sched_size;   /// Number of bytes in scheduled
+    gint             sched_lane;   /// Lane the module waits in, or -1
+    gsize            deficit;      /// Bytes it may forward in its turn
+    gboolean         sched_paused; /// Stopped reading until output is sent
 } MkModule;
 
 
@@ -109,6 +243,45 @@ void mk_module_set_interpreter(MkModuleContext*    mc,
                                void*               data);
 
 
+/**
+ * Configure the function to call when a module stops being obeyed, or
+ * exits while obeyed. It is passed the data given to
+ * mk_module_set_interpreter().
+ * @param mc  module context
+ * @param end function to call, or NULL
+ */
+void mk_module_set_obey_end(MkModuleContext* mc, MkModuleObeyEnd end);
+
+
+/**
+ * Configure how data that cannot be written to a module right away is
+ * kept. Up to budget bytes are kept in memory for all the modules of the
+ * context. Beyond that, the data for modules with spooling enabled is
+ * appended to spool files created in dir, and writing to the other modules
+ * blocks until they have read their pending data.
+ * @param mc     module context
+ * @param dir    directory for spool files, or NULL for the default
+ * @param budget number of bytes that can be kept in memory
+ */
+void mk_module_set_spool(MkModuleContext* mc,
+                         const gchar*     dir,
+                         const gsize      budget);
+
+
+/**
+ * Run the I/O of module processes on worker loops, each on its own thread.
+ * A process is assigned to a worker loop when it starts: the one requested
+ * with mk_module_set_loop(), or else the one with the fewest modules.
+ * Built-in modules stay on the main loop. The output of group instances
+ * and of modules that are listened to, obeyed or recorded is handled from
+ * the main loop too. This must be called before any module runs.
+ * @param mc      module context
+ * @param workers number of worker loops, or 0 to do everything from the
+ *                main loop
+ */
+void mk_module_set_loops(MkModuleContext* mc, const guint workers);
+
+
 /**
  * Find a module within the context's module table.
  * @param mc   module context
@@ -118,6 +291,48 @@ void mk_module_set_interpreter(MkModuleContext*    mc,
 MkModule* mk_module_lookup(MkModuleContext* mc, const gchar* name);
 
 
+/**
+ * Start a batch of commands. Until the batch ends, data written to modules
+ * from the main loop is held, and so is the end of their input: commands
+ * changing bindings or running modules all apply before any data flows.
+ * Batches can be nested.
+ * @param mc module context
+ */
+void mk_module_batch_begin(MkModuleContext* mc);
+
+
+/**
+ * End a batch of commands started with mk_module_batch_begin(). Once the
+ * outermost batch ends, the data held for each module is written to it at
+ * once, in the order modules were first written to.
+ * @param mc module context
+ */
+void mk_module_batch_end(MkModuleContext* mc);
+
+
+/**
+ * Get a handle on a module name, interning the name if it was not yet.
+ * Interned names are kept for the lifetime of the context.
+ * @param mc     module context
+ * @param handle handle to initialize
+ * @param name   module name
+ */
+void mk_module_handle_init(MkModuleContext* mc,
+                           MkModuleHandle*  handle,
+                           const gchar*     name);
+
+
+/**
+ * Find the module a handle's name currently designates. The name is not
+ * hashed: the handle is only refreshed if the version of its name changed.
+ * @param mc     module context
+ * @param handle handle initialized with mk_module_handle_init()
+ * @return       module found, or NULL if no module has that name
+ */
+MkModule* mk_module_handle_resolve(MkModuleContext* mc,
+                                   MkModuleHandle*  handle);
+
+
 /**
  * Add a module to a context's module table.
  * @param mc     module context
@@ -173,6 +388,29 @@ void mk_module_bind(MkModule* out_module, MkModule* in_module);
  */
 void mk_module_unbind(MkModule* out_module, MkModule* in_module);
 
+/**
+ * Copy a sample of the data going through a binding, replacing any tap
+ * already on it (see tap.h). The tap is removed with the binding.
+ * @param out_module module providing the output
+ * @param in_module  module listening to out_module's output
+ * @param sampling   "1/N" or "BYTES/s", or NULL to copy every line
+ * @param path       file to append samples to, or NULL for the standard
+ *                   output
+ * @return           an error string, or NULL if the tap was set up
+ */
+const gchar* mk_module_tap(MkModule*    out_module,
+                           MkModule*    in_module,
+                           const gchar* sampling,
+                           const gchar* path);
+
+/**
+ * Remove the tap on a binding.
+ * @param out_module module providing the output
+ * @param in_module  module listening to out_module's output
+ * @return           whether there was a tap
+ */
+gboolean mk_module_untap(MkModule* out_module, MkModule* in_module);
+
 /**
  * Append arguments to a module's argument list.
  * @param module the module
@@ -184,13 +422,89 @@ void mk_module_append_args(MkModule* module,
                            const gchar** argv);
 
 /**
- * Write data to a module's standard input.
+ * Make a module lazy: it will be run when data is first written to it,
+ * rather than by mk_module_run() only. Optionally, its standard input is
+ * closed after some time without input, and it is run again when more
+ * data comes.
+ * @param module the module
+ * @param idle   seconds without input before the module is shut down,
+ *               or 0 to keep it running
+ */
+void mk_module_set_lazy(MkModule* module, const guint idle);
+
+/**
+ * Turn a module into a group of count instances of its command, named
+ * "name[0]" to "name[count-1]". Each line written to the group goes to
+ * one instance, chosen according to a policy:
+ *  - "rr":          round-robin
+ *  - "least":       instance with the least data waiting to be read
+ *  - "hash:REGEX":  consistent hash of the first capture group of REGEX in
+ *                   the line (or of the whole match), so that lines with
+ *                   the same key go to the same instance. Lines without a
+ *                   key go round-robin.
+ * Complete output lines of the instances are forwarded as the group's
+ * output. Running, killing, waiting for, closing or tuning the group
+ * applies to all its instances. This must be called before the module is
+ * run, after it has been made lazy if it must be.
+ * @param module the module
+ * @param count  number of instances
+ * @param policy dispatch policy, or NULL for round-robin
+ * @return       an error string, or NULL if the module was sharded
+ */
+const gchar* mk_module_shard(MkModule*    module,
+                             const guint  count,
+                             const gchar* policy);
+
+/**
+ * Choose the worker loop a module's process is assigned to when it runs.
+ * Loop numbers wrap around the number of worker loops, and are ignored if
+ * there is none.
+ * @param module the module
+ * @param loop   worker loop number, or -1 for the least used one
+ */
+void mk_module_set_loop(MkModule* module, const gint loop);
+
+/**
+ * Set one of the scheduling and resource options applied to a module's
+ * process when it is spawned (see tune.h). Options take effect the next
+ * time the module runs, except "lane=LANE" (control, interactive or bulk),
+ * which chooses the lane of the module's output right away.
+ * @param module the module
+ * @param option an "option=value" string
+ * @return       an error string, or NULL if the option was set
+ */
+const gchar* mk_module_tune(MkModule* module, const gchar* option);
+
+/**
+ * Write data to a module's standard input. Data the module is not ready
+ * to read yet is kept and written as soon as it can be. If the module is
+ * not running, the data is dropped, unless spooling is enabled for the
+ * module, in which case it is written after the module starts.
  * @param module module to write to
  * @param data   what to write
- * @param length number of data bytes
+ * @param length number of data bytes, or -1 if data is a nul-terminated
+ *               string
  */
 void mk_module_write(MkModule* module, const gchar* data, const gsize length);
 
+/**
+ * Copy part of a file to a running module's standard input, as the module
+ * reads it. The data goes from the file to the module within the kernel,
+ * without being read into memory. It is written after the data already
+ * waiting for the module, and before the data written next. A file cannot
+ * be fed while data for the module is spooled (see mk_module_spool()).
+ * @param module module to write to, which must be a process
+ * @param path   file to copy, which must be a regular file
+ * @param offset where to start in the file
+ * @param length number of bytes to copy, not 0, or -1 to copy up to the
+ *               end of the file
+ * @return       an error string, or NULL if the file is being copied
+ */
+const gchar* mk_module_feed(MkModule*    module,
+                            const gchar* path,
+                            const gsize  offset,
+                            const gsize  length);
+
 /**
  * Write data to all the listeners of a module.
  * @param data   the data
@@ -201,6 +515,43 @@ void mk_module_write_to_listeners(MkModule*    module,
                                   const gchar* data,
                                   const gsize  length);
 
+/**
+ * Start recording the data read from all modules, and the commands obeyed
+ * from them, to a file. Any previous recording is stopped.
+ * @param mc   module context
+ * @param path recording file name
+ * @return     whether the file could be created
+ */
+gboolean mk_module_record(MkModuleContext* mc, const gchar* path);
+
+
+/**
+ * Stop recording traffic.
+ * @param mc module context
+ */
+void mk_module_unrecord(MkModuleContext* mc);
+
+
+/**
+ * Mark a module as replayed: its output comes from a recording, so
+ * mk_module_run() will not start it.
+ * @param mc     module context
+ * @param name   module name
+ * @param always if FALSE, the module is only replayed if it does not
+ *               listen to any other module when it is run
+ */
+void mk_module_set_replayed(MkModuleContext* mc,
+                            const gchar*     name,
+                            gboolean         always);
+
+
+/**
+ * Update the resource usage figures of all the running modules of a
+ * context. This is done periodically while modules are running.
+ * @param mc module context
+ */
+void mk_module_sample(MkModuleContext* mc);
+
 /**
  * Cleanup after a module has exited.
  * @param pid    process ID
@@ -248,7 +599,10 @@ void mk_module_run(MkModule* module);
 void mk_module_kill(MkModule* module);
 
 /**
- * Wait for a module to exit.
+ * Wait for a module to exit. Data held for the module by a batch of
+ * commands, and the end of its input, are written first. A built-in module
+ * exits once its input has ended and it has output everything: waiting for
+ * one whose input has not ended returns right away.
  * @param module the module
  */
 void mk_module_wait(MkModule* module);
@@ -294,6 +648,42 @@ gboolean mk_module_finished(MkModuleContext* mc);
  */
 void mk_module_eof(MkModule* module);
 
+/**
+ * Append a module's output to a file, in addition to sending it to the
+ * module's listeners, replacing any capture already set up (see
+ * capture.h).
+ * @param module the module
+ * @param path   file name
+ * @param rotate size at which the file is rotated, or 0
+ * @param sync   number of bytes between two fdatasync() calls, or 0
+ * @return       whether the file could be opened
+ */
+gboolean mk_module_capture(MkModule*    module,
+                           const gchar* path,
+                           const gsize  rotate,
+                           const gsize  sync);
+
+/**
+ * Stop capturing a module's output.
+ * @param module the module
+ * @return       whether the output was captured
+ */
+gboolean mk_module_uncapture(MkModule* module);
+
+/**
+ * Keep the data written to a module while it is not running, and write it
+ * when it starts.
+ * @param module the module
+ */
+void mk_module_spool(MkModule* module);
+
+/**
+ * Stop keeping the data written to a module while it is not running. Data
+ * already kept is still written when the module starts.
+ * @param module the module
+ */
+void mk_module_unspool(MkModule* module);
+
 /**
  * Start obeying a module. All its output will be interpreted using the
  * interpreter set using module_set_interpreter.
@@ -302,7 +692,9 @@ void mk_module_eof(MkModule* module);
 void mk_module_obey(MkModule* module);
 
 /**
- * Stop obeying a module.
+ * Stop obeying a module. Commands it left unfinished are dropped (see
+ * mk_module_set_obey_end()), as they are when an obeyed module
+ * exits.
  * @param module the module to stop obeying
  */
 void mk_module_disobey(MkModule* module);
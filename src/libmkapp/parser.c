@@ -13,19 +13,245 @@
 
 #include <glib.h>
 #include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "parser.h"
 
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__)) \
+    && !defined(MK_PARSER_NO_SIMD)
+#define PARSER_SIMD
+#include <immintrin.h>
+#endif
 
-MkParserContext* mk_parser_new(void* user_data)
+
+#include "parser_grammar.h"
+
+
+/**
+ * Function finding the first character of a buffer that is in a set.
+ * @param set    the set
+ * @param data   the buffer
+ * @param length number of characters in the buffer
+ * @return       index of the first character in the set, or length
+ */
+typedef gsize(*MkParserScanFunc)(const MkParserCharSet* set,
+                                 const gchar*           data,
+                                 gsize                  length);
+
+
+/**
+ * Get the index of a character in the function map.
+ * @param c the character
+ * @return  its index
+ */
+static inline gint parser_index(const gchar c)
+{
+    gint i = (gint)c - MK_PARSER_FIRST_CHAR;
+
+    // Non-ascii characters are all treated equally, like the first one
+    if (i >= MK_PARSER_ARRAY_SIZE || i < 0)
+        i = MK_PARSER_NON_ASCII;
+
+    return i;
+}
+
+
+/**
+ * Add a character to a set or remove it from the set.
+ * @param set the set
+ * @param c   the character, or MK_PARSER_FIRST_CHAR for non-ASCII ones
+ * @param in  whether the character is in the set
+ */
+static void parser_set_update(MkParserCharSet* set, const gchar c, gboolean in)
+{
+    if (c < 0) {
+        set->non_ascii = in;
+    } else if (in) {
+        set->ascii[c & 15] |= 1 << (c >> 4);
+    } else {
+        set->ascii[c & 15] &= ~(1 << (c >> 4));
+    }
+}
+
+
+/**
+ * Put all the characters in a set, or none.
+ * @param set the set
+ * @param in  whether the characters are in the set
+ */
+static void parser_set_fill(MkParserCharSet* set, gboolean in)
+{
+    memset(set->ascii, in ? 0xff : 0, sizeof(set->ascii));
+    set->non_ascii = in;
+}
+
+
+/**
+ * Find the first character of a buffer that is in a set, one character at
+ * a time.
+ * @param set    the set
+ * @param data   the buffer
+ * @param length number of characters in the buffer
+ * @return       index of the first character in the set, or length
+ */
+static gsize parser_scan_scalar(const MkParserCharSet* set,
+                                const gchar*           data,
+                                gsize                  length)
+{
+    for (gsize i = 0; i < length; ++i) {
+        gchar c = data[i];
+        if (c < 0 ? set->non_ascii : (set->ascii[c & 15] >> (c >> 4)) & 1)
+            return i;
+    }
+
+    return length;
+}
+
+
+#ifdef PARSER_SIMD
+/**
+ * Find the first character of a buffer that is in a set, 16 characters at
+ * a time. The low nibble of each character selects its row of the set,
+ * and its high nibble the bit to test in the row. Non-ASCII characters
+ * select no bit.
+ * @param set    the set
+ * @param data   the buffer
+ * @param length number of characters in the buffer
+ * @return       index of the first character in the set, or length
+ */
+__attribute__((target("ssse3")))
+static gsize parser_scan_ssse3(const MkParserCharSet* set,
+                               const gchar*           data,
+                               gsize                  length)
+{
+    const __m128i rows   = _mm_loadu_si128((const __m128i*)set->ascii);
+    const __m128i bits   = _mm_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                         0, 0, 0, 0, 0, 0, 0, 0);
+    const __m128i nibble = _mm_set1_epi8(0x0f);
+    gsize         i      = 0;
+
+    for (; i + 16 <= length; i += 16) {
+        __m128i v   = _mm_loadu_si128((const __m128i*)(data + i));
+        __m128i row = _mm_shuffle_epi8(rows, _mm_and_si128(v, nibble));
+        __m128i bit = _mm_shuffle_epi8(bits, _mm_and_si128(_mm_srli_epi16(v, 4),
+                                                           nibble));
+        __m128i out = _mm_cmpeq_epi8(_mm_and_si128(row, bit),
+                                     _mm_setzero_si128());
+        guint   hit = ~_mm_movemask_epi8(out) & 0xffff;
+
+        if (set->non_ascii)
+            hit |= _mm_movemask_epi8(v);
+        if (hit != 0)
+            return i + __builtin_ctz(hit);
+    }
+
+    return i + parser_scan_scalar(set, data + i, length - i);
+}
+
+
+/**
+ * Find the first character of a buffer that is in a set, 32 characters at
+ * a time (see parser_scan_ssse3()).
+ * @param set    the set
+ * @param data   the buffer
+ * @param length number of characters in the buffer
+ * @return       index of the first character in the set, or length
+ */
+__attribute__((target("avx2")))
+static gsize parser_scan_avx2(const MkParserCharSet* set,
+                              const gchar*           data,
+                              gsize                  length)
+{
+    const __m256i rows   = _mm256_broadcastsi128_si256
+        (_mm_loadu_si128((const __m128i*)set->ascii));
+    const __m256i bits   = _mm256_setr_epi8(1, 2, 4, 8, 16, 32, 64, -128,
+                                            0, 0, 0, 0, 0, 0, 0, 0,
+                                            1, 2, 4, 8, 16, 32, 64, -128,
+                                            0, 0, 0, 0, 0, 0, 0, 0);
+    const __m256i nibble = _mm256_set1_epi8(0x0f);
+    gsize         i      = 0;
+
+    for (; i + 32 <= length; i += 32) {
+        __m256i v   = _mm256_loadu_si256((const __m256i*)(data + i));
+        __m256i row = _mm256_shuffle_epi8(rows, _mm256_and_si256(v, nibble));
+        __m256i bit = _mm256_shuffle_epi8
+            (bits, _mm256_and_si256(_mm256_srli_epi16(v, 4), nibble));
+        __m256i out = _mm256_cmpeq_epi8(_mm256_and_si256(row, bit),
+                                        _mm256_setzero_si256());
+        guint   hit = ~(guint)_mm256_movemask_epi8(out);
+
+        if (set->non_ascii)
+            hit |= (guint)_mm256_movemask_epi8(v);
+        if (hit != 0)
+            return i + __builtin_ctz(hit);
+    }
+
+    return i + parser_scan_ssse3(set, data + i, length - i);
+}
+#endif
+
+
+/**
+ * Find the first character of a buffer that is in a set, with the fastest
+ * instructions the processor has.
+ * @param set    the set
+ * @param data   the buffer
+ * @param length number of characters in the buffer
+ * @return       index of the first character in the set, or length
+ */
+static gsize parser_scan(const MkParserCharSet* set,
+                         const gchar*           data,
+                         gsize                  length)
+{
+    static MkParserScanFunc scan = NULL;
+
+    if (scan == NULL) {
+        scan = parser_scan_scalar;
+#ifdef PARSER_SIMD
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2"))
+            scan = parser_scan_avx2;
+        else if (__builtin_cpu_supports("ssse3"))
+            scan = parser_scan_ssse3;
+#endif
+    }
+
+    return scan(set, data, length);
+}
+
+
+const MkParserTable* mk_parser_table_once(MkParserTable**   table,
+                                          MkParserBuildFunc build)
+{
+    if (g_once_init_enter(table)) {
+        MkParserTable* t = g_malloc(sizeof(MkParserTable));
+        mk_parser_configure_default(t, NULL);
+        build(t);
+        g_once_init_leave(table, t);
+    }
+
+    return *table;
+}
+
+
+MkParserContext* mk_parser_new(const MkParserTable* table, void* user_data)
 {
     MkParserContext* parser = g_malloc(sizeof(MkParserContext));
 
+    parser->table[0]      = table;
     parser->eof_func      = NULL;
     parser->user_data     = user_data;
     parser->depth         = 1;
+    parser->chars         = g_string_new("");
+    parser->starts        = g_array_new(FALSE, FALSE, sizeof(gsize));
+    parser->current       = -1;
     parser->tokens        = g_ptr_array_new();
-    parser->current_token = NULL;
-    mk_parser_configure_default(parser, NULL);
+    parser->buffer        = NULL;
+    parser->raw_func      = NULL;
+    parser->raw_length    = 0;
 
     return parser;
 }
@@ -33,6 +259,10 @@ MkParserContext* mk_parser_new(void* user_data)
 
 void mk_parser_free(MkParserContext* parser)
 {
+    g_string_free(parser->chars, TRUE);
+    g_array_free(parser->starts, TRUE);
+    g_ptr_array_free(parser->tokens, TRUE);
+    g_free(parser->buffer);
     g_free(parser);
 }
 
@@ -43,11 +273,16 @@ void mk_parser_set_eof_func(MkParserContext* parser, MkParserFunc f)
 }
 
 
-void mk_parser_push(MkParserContext* parser)
+void mk_parser_push(MkParserContext* parser, const MkParserTable* table)
 {
     g_assert(parser->depth < MK_PARSER_MAX_DEPTH);
-    ++(parser->depth);
-    mk_parser_configure_default(parser, NULL);
+    parser->table[parser->depth++] = table;
+}
+
+
+void mk_parser_switch(MkParserContext* parser, const MkParserTable* table)
+{
+    parser->table[parser->depth-1] = table;
 }
 
 
@@ -58,126 +293,211 @@ void mk_parser_pop(MkParserContext* parser)
 }
 
 
-void mk_parser_configure(MkParserContext* parser,
-                         const gchar      c,
-                         MkParserFunc     f)
+void mk_parser_configure(MkParserTable* table,
+                         const gchar    c,
+                         MkParserFunc   f)
 {
     g_assert(c >= MK_PARSER_FIRST_CHAR && c <= MK_PARSER_LAST_CHAR);
     int i = (int)c - MK_PARSER_FIRST_CHAR;
-    parser->f[parser->depth-1][i] = f;
+    table->f[i] = f;
+
+    // Keep track of the runs of characters parse_buffer() can skip
+    parser_set_update(&table->append_stop, c,
+                      f != (MkParserFunc)mk_parser_token_append);
+    parser_set_update(&table->skip_stop, c, f != NULL);
 }
 
 
-void mk_parser_configure_range(MkParserContext* parser,
-                               const gchar      c1,
-                               const gchar      c2,
-                               MkParserFunc     f)
+void mk_parser_configure_range(MkParserTable* table,
+                               const gchar    c1,
+                               const gchar    c2,
+                               MkParserFunc   f)
 {
     if (c1 < c2) {
         for (gchar c = c1; c < c2; ++c)
-            mk_parser_configure(parser, c, f);
-        mk_parser_configure(parser, c2, f);
+            mk_parser_configure(table, c, f);
+        mk_parser_configure(table, c2, f);
     } else {
         for (gchar c = c2; c < c1; ++c)
-            mk_parser_configure(parser, c, f);
-        mk_parser_configure(parser, c1, f);
+            mk_parser_configure(table, c, f);
+        mk_parser_configure(table, c1, f);
     }
 }
 
 
-void mk_parser_configure_all(MkParserContext* parser,
-                             const gchar*     chars,
-                             MkParserFunc        f)
+void mk_parser_configure_all(MkParserTable* table,
+                             const gchar*   chars,
+                             MkParserFunc   f)
 {
     for(gsize i = 0; chars[i] != '\0'; ++i) {
-        mk_parser_configure(parser, chars[i], f);
+        mk_parser_configure(table, chars[i], f);
     }
 }
 
 
-void mk_parser_configure_default(MkParserContext* parser, MkParserFunc f)
+void mk_parser_configure_default(MkParserTable* table, MkParserFunc f)
 {
-    mk_parser_configure_range(parser,
-                              MK_PARSER_FIRST_CHAR,
-                              MK_PARSER_LAST_CHAR,
-                              f);
+    for (gsize i = 0; i < MK_PARSER_ARRAY_SIZE; ++i)
+        table->f[i] = f;
+
+    parser_set_fill(&table->append_stop,
+                    f != (MkParserFunc)mk_parser_token_append);
+    parser_set_fill(&table->skip_stop, f != NULL);
 }
 
 
-void mk_parser_parse_character(MkParserContext* parser, const gchar c)
+/**
+ * Hand raw bytes to the function reading them (see mk_parser_read_raw()).
+ * @param parser the parser
+ * @param data   the bytes
+ * @param length number of bytes available
+ * @return       number of bytes handed to the function
+ */
+static gsize parser_raw(MkParserContext* parser,
+                        const gchar*     data,
+                        gsize            length)
 {
-    MkParserFunc f;
-    int i = (int)c - MK_PARSER_FIRST_CHAR;
+    gsize n = MIN(length, parser->raw_length);
 
-    // Non-ascii characters are all treated equally
-    if (i > MK_PARSER_LAST_CHAR || i < 0)
-        i = MK_PARSER_NON_ASCII;
+    parser->raw_length -= n;
+    parser->raw_func(parser, data, n, parser->user_data);
+
+    return n;
+}
+
+
+void mk_parser_read_raw(MkParserContext* parser,
+                        gsize            length,
+                        MkParserRawFunc  f)
+{
+    parser->raw_func   = f;
+    parser->raw_length = length;
+
+    if (length == 0)
+        f(parser, "", 0, parser->user_data);
+}
+
+
+void mk_parser_parse_character(MkParserContext* parser, const gchar c)
+{
+    if (parser->raw_length > 0) {
+        parser_raw(parser, &c, 1);
+        return;
+    }
 
-    f = parser->f[parser->depth-1][i];
+    MkParserFunc f = parser->table[parser->depth-1]->f[parser_index(c)];
     if (f != NULL)
         f(parser, c, parser->user_data);
 }
 
 
+void mk_parser_parse_buffer(MkParserContext* parser,
+                            const gchar*     data,
+                            const gsize      length)
+{
+    const gchar* end = data + length;
+
+    // Appending a character or ignoring it does not change the parser's
+    // state, so whole runs of them are handled at once
+    while (data < end) {
+        const MkParserTable* table = parser->table[parser->depth-1];
+        MkParserFunc         f     = table->f[parser_index(*data)];
+
+        if (parser->raw_length > 0) {
+            data += parser_raw(parser, data, end - data);
+        } else if (f == (MkParserFunc)mk_parser_token_append) {
+            gsize n = parser_scan(&table->append_stop, data, end - data);
+            if (parser->current < 0)
+                parser->current = parser->chars->len;
+            g_string_append_len(parser->chars, data, n);
+            data += n;
+        } else if (f == NULL) {
+            data += parser_scan(&table->skip_stop, data, end - data);
+        } else {
+            f(parser, *data, parser->user_data);
+            ++data;
+        }
+    }
+}
+
+
 void mk_parser_token_append(MkParserContext* parser, gchar c)
 {
-    if (parser->current_token == NULL)
-        parser->current_token = g_string_new("");
-    g_string_append_c(parser->current_token, c);
+    if (parser->current < 0)
+        parser->current = parser->chars->len;
+    g_string_append_c(parser->chars, c);
 }
 
 
 void mk_parser_token_cut(MkParserContext* parser)
 {
-    if (parser->current_token != NULL) {
-        g_ptr_array_add(parser->tokens, parser->current_token->str);
-        g_string_free(parser->current_token, FALSE);
-        parser->current_token = NULL;
+    if (parser->current >= 0) {
+        gsize start = parser->current;
+        g_string_append_c(parser->chars, '\0');
+        g_array_append_val(parser->starts, start);
+        parser->current = -1;
     }
 }
 
 
 void mk_parser_token_add(MkParserContext* parser, const gchar* token)
 {
-    g_ptr_array_add(parser->tokens, g_strdup(token));
+    gsize length = strlen(token) + 1;
+    gsize start  = parser->current >= 0 ? (gsize)parser->current
+                                         : parser->chars->len;
+
+    // Tokens are kept in order, before the one being built
+    g_string_insert_len(parser->chars, start, token, length);
+    g_array_append_val(parser->starts, start);
+    if (parser->current >= 0)
+        parser->current += length;
 }
 
 
 void mk_parser_token_clear(MkParserContext* parser)
 {
-    g_ptr_array_foreach(parser->tokens, (GFunc)g_free, NULL);
-    g_ptr_array_free(parser->tokens, TRUE);
-    parser->tokens = g_ptr_array_new();
+    gsize length = 0;
+
+    // Keep the token being built, moving it to the start of the buffer
+    if (parser->current >= 0) {
+        length = parser->chars->len - parser->current;
+        memmove(parser->chars->str, parser->chars->str + parser->current,
+                length);
+        parser->current = 0;
+    }
+
+    g_string_truncate(parser->chars, length);
+    g_array_set_size(parser->starts, 0);
 }
 
 
 const gchar** mk_parser_token_get(MkParserContext* parser)
 {
+    g_ptr_array_set_size(parser->tokens, 0);
+    for (guint i = 0; i < parser->starts->len; ++i)
+        g_ptr_array_add(parser->tokens, parser->chars->str
+                        + g_array_index(parser->starts, gsize, i));
+    g_ptr_array_add(parser->tokens, NULL);
+
     return (const gchar**)(parser->tokens->pdata);
 }
 
 
 gsize mk_parser_token_size(MkParserContext* parser)
 {
-    return parser->tokens->len;
+    return parser->starts->len;
 }
 
 
 void mk_parser_dquote_begin(MkParserContext* parser, gchar c, void* data)
 {
-    mk_parser_push(parser);
-    mk_parser_configure_default(parser, (MkParserFunc)mk_parser_token_append);
-    mk_parser_configure(parser, '"', (MkParserFunc)mk_parser_pop);
-    mk_parser_configure(parser, '\\', mk_parser_escape_begin);
+    mk_parser_push(parser, &grammar_dquote);
 }
 
 
 void mk_parser_squote_begin(MkParserContext* parser, gchar c, void* data)
 {
-    mk_parser_push(parser);
-    mk_parser_configure_default(parser, (MkParserFunc)mk_parser_token_append);
-    mk_parser_configure(parser, '\'', (MkParserFunc)mk_parser_pop);
-    mk_parser_configure(parser, '\\', mk_parser_strict_escape_begin);
+    mk_parser_push(parser, &grammar_squote);
 }
 
 
@@ -190,8 +510,7 @@ void mk_parser_comment_end(MkParserContext* parser, gchar c, void* data)
 
 void mk_parser_comment_begin(MkParserContext* parser, gchar c, void* data)
 {
-    mk_parser_push(parser);
-    mk_parser_configure(parser, '\n', mk_parser_comment_end);
+    mk_parser_push(parser, &grammar_comment);
 }
 
 
@@ -217,8 +536,7 @@ void mk_parser_strict_escape_begin(MkParserContext* parser,
                                    gchar            c,
                                    void*            data)
 {
-    mk_parser_push(parser);
-    mk_parser_configure_default(parser, mk_parser_strict_escape_end);
+    mk_parser_push(parser, &grammar_strict_escape);
 }
 
 
@@ -241,17 +559,28 @@ void mk_parser_escape_end(MkParserContext* parser, gchar c, void* data)
 
 void mk_parser_escape_begin(MkParserContext* parser, gchar c, void* data)
 {
-    mk_parser_push(parser);
-    mk_parser_configure_default(parser, mk_parser_escape_end);
+    mk_parser_push(parser, &grammar_escape);
 }
 
 
-void mk_parser_enable_defaults(MkParserContext* parser)
+void mk_parser_enable_defaults(MkParserTable* table)
 {
-    mk_parser_configure(parser, '"', mk_parser_dquote_begin);
-    mk_parser_configure(parser, '\'', mk_parser_squote_begin);
-    mk_parser_configure(parser, '#', mk_parser_comment_begin);
-    mk_parser_configure(parser, '\\', mk_parser_escape_begin);
+    mk_parser_configure(table, '"', mk_parser_dquote_begin);
+    mk_parser_configure(table, '\'', mk_parser_squote_begin);
+    mk_parser_configure(table, '#', mk_parser_comment_begin);
+    mk_parser_configure(table, '\\', mk_parser_escape_begin);
+}
+
+
+/**
+ * Let the parser know that the end of its input was reached.
+ * @param parser the parser
+ */
+static void parser_parse_eof(MkParserContext* parser)
+{
+    parser->raw_length = 0;
+    if (parser->eof_func != NULL)
+        parser->eof_func(parser, 0, parser->user_data);
 }
 
 
@@ -259,59 +588,65 @@ gboolean mk_parser_parse_channel(GIOChannel*      source,
                                  GIOCondition     unused,
                                  MkParserContext* parser)
 {
-    while(1) {
-        gchar*    data;
-        gsize     length;
-        GError*   error = NULL;
-        GIOStatus status;
-        
-        status = g_io_channel_read_line(source, &data, &length, NULL, &error);
-
-        switch(status) {
-        case G_IO_STATUS_ERROR:
-            // An error occurred
-            g_free(data);
-            g_critical("Input/output error.");
-            return FALSE;
-            
-        case G_IO_STATUS_NORMAL:
-            // Success
-            for (gsize i = 0; i < length; ++i)
-                mk_parser_parse_character(parser, data[i]);
-            break;
-            
-        case G_IO_STATUS_EOF:
-            // End of file. Quit as soon as all the modules have stopped.
-            g_free(data);
-            if (parser->eof_func != NULL)
-                parser->eof_func(parser, 0, parser->user_data);
-            
-            return FALSE;
-            
-        case G_IO_STATUS_AGAIN:
-            // Resource temporarily unavailable
-            g_free(data);
+    gint   fd = g_io_channel_unix_get_fd(source);
+    gssize n;
+
+    if (parser->buffer == NULL)
+        parser->buffer = g_malloc(MK_PARSER_BUFFER_SIZE);
+
+    do {
+        n = read(fd, parser->buffer, MK_PARSER_BUFFER_SIZE);
+    } while (n < 0 && errno == EINTR);
+
+    if (n < 0) {
+        // Resource temporarily unavailable?
+        if (errno == EAGAIN)
             return TRUE;
-        }
 
-        g_free(data);
+        g_critical("Input/output error: %s.", g_strerror(errno));
+        return FALSE;
+    }
+
+    // End of file. Quit as soon as all the modules have stopped.
+    if (n == 0) {
+        parser_parse_eof(parser);
+        return FALSE;
     }
 
+    mk_parser_parse_buffer(parser, parser->buffer, n);
     return TRUE;
 }
 
 
 void mk_parser_parse_file(MkParserContext* parser, const gchar* filename)
 {
-    GError* error = NULL;
-    GIOChannel* chan = g_io_channel_new_file(filename, "r", &error);
+    struct stat st;
+    gint        fd = open(filename, O_RDONLY | O_CLOEXEC);
 
-    if (error != NULL) {
-        g_critical("Could not read %s: %s", filename, error->message);
-        g_free(error);
+    if (fd < 0) {
+        g_critical("Could not read %s: %s", filename, g_strerror(errno));
         return;
     }
 
+    // Regular files are parsed in place. Anything else is read by blocks.
+    gchar* map = MAP_FAILED;
+    if (!fstat(fd, &st) && S_ISREG(st.st_mode) && st.st_size > 0) {
+        map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map != MAP_FAILED)
+            madvise(map, st.st_size, MADV_SEQUENTIAL);
+    }
+
+    if (map != MAP_FAILED) {
+        close(fd);
+        mk_parser_parse_buffer(parser, map, st.st_size);
+        munmap(map, st.st_size);
+        parser_parse_eof(parser);
+        return;
+    }
+
+    GIOChannel* chan = g_io_channel_unix_new(fd);
+    g_io_channel_set_close_on_unref(chan, TRUE);
+
     while(mk_parser_parse_channel(chan, 0, parser));
     g_io_channel_unref(chan);
 }
@@ -15,14 +15,30 @@
 /**
  * @file
  * Generic text parser.
- *  - The parser maintains a parsing array in which indices are numbers of
- *    ASCII characters and values are callback functions that must be
- *    called whenever the character is encountered.
+ *  - The parser dispatches characters with a table in which indices are
+ *    numbers of ASCII characters and values are callback functions that
+ *    must be called whenever the character is encountered.
+ *  - Tables are generated at build time by mkgrammar from a description
+ *    of lexical states (*.grammar), or built once at run time with
+ *    mk_parser_table_once() and the mk_parser_configure...() functions.
+ *    Either way, they are shared by all the parsers and never modified.
  *  - Callback functions are passed the parser structure as a first argument.
- *  - Callback functions can push the current parsing array and create a new
- *    one, or pop the current parsing array to restore the previous one.
+ *  - Callback functions can push a table on the parser's stack, replace
+ *    the table on top of it, or pop it to restore the previous one. None
+ *    of these copy the table.
  *  - Utility functions are provided to handle the most common parsing
  *    features, such as comments and token strings.
+ *  - The characters of all the tokens are kept one after the other in a
+ *    single buffer that is reused from one token list to the next, so that
+ *    building tokens does not allocate memory once the buffer is large
+ *    enough.
+ *  - Runs of characters that are only appended to the current token, or
+ *    that are ignored, are handled at once by mk_parser_parse_buffer(),
+ *    which finds where they end with SIMD instructions when the processor
+ *    has them.
+ *  - Callback functions can have a number of the bytes that follow handed
+ *    to a function as they are, without going through the tables (see
+ *    mk_parser_read_raw()).
  */
 
 
@@ -35,11 +51,23 @@
 #define MK_PARSER_FIRST_CHAR -1
 #define MK_PARSER_LAST_CHAR   127
 #define MK_PARSER_ARRAY_SIZE  129
-#define MK_PARSER_NON_ASCII  -1
+#define MK_PARSER_NON_ASCII   0
+#define MK_PARSER_BUFFER_SIZE (64 << 10)
 
 
 struct MkParserContext;
 
+/**
+ * A set of characters, laid out so that 16 characters at a time can be
+ * looked up with a byte shuffle. Bit N of ascii[L] stands for ASCII
+ * character 16 * N + L. Non-ASCII characters are all in the set or not.
+ * @brief Character set.
+ */
+typedef struct {
+    guint8   ascii[16]; /// Bit N of ascii[L] is set if 16N+L is in the set
+    gboolean non_ascii; /// Are non-ASCII characters in the set?
+} MkParserCharSet;
+
 /**
  * Parser callback function type. A function of this kind is called
  * for every character that must be parsed.
@@ -51,31 +79,82 @@ typedef void(*MkParserFunc)(struct MkParserContext* parser,
                             const gchar             c,
                             void*                   user_data);
 
+/**
+ * Raw data callback function type. A function of this kind is handed the
+ * bytes read with mk_parser_read_raw(), in as few pieces as the input
+ * allows.
+ * @param parser    the parser, whose raw_length is the number of bytes
+ *                  left to read after these ones
+ * @param data      raw bytes
+ * @param length    number of bytes
+ * @param user_data arbitrary data configured with user_data
+ */
+typedef void(*MkParserRawFunc)(struct MkParserContext* parser,
+                               const gchar*            data,
+                               gsize                   length,
+                               void*                   user_data);
+
+/**
+ * A table of callback functions indexed by character, along with the sets
+ * of characters mk_parser_parse_buffer() cannot skip. Tables are immutable
+ * once built and shared by all the parsers.
+ * @brief Parser dispatch table.
+ */
+typedef struct {
+    MkParserFunc    f[MK_PARSER_ARRAY_SIZE]; /// Function map
+    MkParserCharSet append_stop;             /// Characters not just appended
+    MkParserCharSet skip_stop;               /// Characters not ignored
+} MkParserTable;
+
+/**
+ * Function building a table with the mk_parser_configure...() functions.
+ * @param table the table, in which no character has a function yet
+ */
+typedef void(*MkParserBuildFunc)(MkParserTable* table);
+
 /**
  * This structure maintains the current state of a text buffer
  * currently being parsed by calls to mk_parser_parse_character().
  * @brief Parser state.
  */
 typedef struct MkParserContext {
-    MkParserFunc f[MK_PARSER_MAX_DEPTH][MK_PARSER_ARRAY_SIZE]; /// Function map
-    MkParserFunc eof_func;      /// Function to call when EOF is received
-    gsize        depth;         /// Current depth of the f stack
-    void*        user_data;     /// User data to pass to f's functions
-    GPtrArray*   tokens;        /// Token array
-    GString*     current_token; /// Token being built
+    const MkParserTable* table[MK_PARSER_MAX_DEPTH]; /// Table stack
+    MkParserFunc    eof_func;   /// Function to call when EOF is received
+    gsize           depth;      /// Current depth of the table stack
+    void*           user_data;  /// User data to pass to f's functions
+    GString*        chars;      /// Characters of the tokens, NUL-separated
+    GArray*         starts;     /// Offset of each token in chars
+    gssize          current;    /// Offset of the token being built, or -1
+    GPtrArray*      tokens;     /// Token array returned by token_get
+    gchar*          buffer;     /// Block of input being parsed, or NULL
+    MkParserRawFunc raw_func;   /// Function taking raw bytes, or NULL
+    gsize           raw_length; /// Number of raw bytes left to read
 } MkParserContext;
 
+
+/**
+ * Get a table, building it the first time it is asked for. The table is
+ * never freed.
+ * @param table where the table is kept, initially NULL
+ * @param build function configuring the table
+ * @return      the table
+ */
+const MkParserTable* mk_parser_table_once(MkParserTable**   table,
+                                          MkParserBuildFunc build);
+
 /**
  * Create a new parser state object for use with mk_parser_parse_character().
+ * @param table     table to start parsing with
  * @param user_data pointer that will be handed to any callback function
  *                  configured with mk_parser_configure()
  * @return          the new parser
  */
-MkParserContext* mk_parser_new(void* user_data);
+MkParserContext* mk_parser_new(const MkParserTable* table, void* user_data);
 
 
 /**
- * Free a parser state object created with mk_parser_new().
+ * Free a parser state object created with mk_parser_new(), along with its
+ * tokens. The user data is not freed.
  * @param parser the parser
  */
 void mk_parser_free(MkParserContext* parser);
@@ -90,69 +169,77 @@ void mk_parser_set_eof_func(MkParserContext* parser, MkParserFunc f);
 
 
 /**
- * Push a parser's stack. A new copy of the current callback function
- * table will be made and will be the one used until mk_parser_pop() is
- * called, increasing the parser's stack depth by one.  The parser's
- * stack cannot have a depth of more than MK_PARSER_MAX_DEPTH.
+ * Push a table on a parser's stack. It will be the one used until
+ * mk_parser_pop() is called, increasing the parser's stack depth by one.
+ * The parser's stack cannot have a depth of more than MK_PARSER_MAX_DEPTH.
+ * @param parser the parser
+ * @param table  the table
+ */
+void mk_parser_push(MkParserContext* parser, const MkParserTable* table);
+
+
+/**
+ * Replace the table on top of a parser's stack, leaving its depth as is.
  * @param parser the parser
+ * @param table  the table
  */
-void mk_parser_push(MkParserContext* parser);
+void mk_parser_switch(MkParserContext* parser, const MkParserTable* table);
 
 
 /**
- * Pop a parser's stack, restoring the callback function table it had
- * before calling mk_parser_push(). This function must be called exactly
- * once for each mk_parser_push() call.
+ * Pop a parser's stack, restoring the table it used before calling
+ * mk_parser_push(). This function must be called exactly once for each
+ * mk_parser_push() call.
  * @param parser the parser
  */
 void mk_parser_pop(MkParserContext* parser);
 
 
 /**
- * Configure the parser to make it call a function every time character 'c'
+ * Configure a table to make it call a function every time character 'c'
  * is encountered.
- * @param parser parser to configure
- * @param c      character that will trigger the function call
- * @param f      function to call
+ * @param table table to configure
+ * @param c     character that will trigger the function call
+ * @param f     function to call
  */
-void mk_parser_configure(MkParserContext* parser,
-                         const gchar      c,
-                         MkParserFunc     f);
+void mk_parser_configure(MkParserTable* table,
+                         const gchar    c,
+                         MkParserFunc   f);
 
 
 /**
- * Configure the parser to make it call a function every time character a
+ * Configure a table to make it call a function every time character a
  * character between c1 and c2 is encountered.
- * @param parser parser to configure
- * @param c1     first character of the range
- * @param c2     second character of the range
- * @param f      function to call
+ * @param table table to configure
+ * @param c1    first character of the range
+ * @param c2    second character of the range
+ * @param f     function to call
  */
-void mk_parser_configure_range(MkParserContext* parser,
-                               const gchar      c1,
-                               const gchar      c2,
-                               MkParserFunc     f);
+void mk_parser_configure_range(MkParserTable* table,
+                               const gchar    c1,
+                               const gchar    c2,
+                               MkParserFunc   f);
 
 
 /**
- * Configure the parser to make it call a function every time character a
+ * Configure a table to make it call a function every time character a
  * character that is in chars is encountered.
- * @param parser parser to configure
+ * @param table table to configure
  * @param chars a string that contains all the characters to configure
  * @param f     function to call
  */
-void mk_parser_configure_all(MkParserContext* parser,
-                             const gchar*     chars,
-                             MkParserFunc     f);
+void mk_parser_configure_all(MkParserTable* table,
+                             const gchar*   chars,
+                             MkParserFunc   f);
 
 
 /**
- * Configure the parser to call function f whenever any character is
+ * Configure a table to call function f whenever any character is
  * received.
- * @param parser parser to configure
- * @param f      function to call
+ * @param table table to configure
+ * @param f     function to call
  */
-void mk_parser_configure_default(MkParserContext* parser, MkParserFunc f);
+void mk_parser_configure_default(MkParserTable* table, MkParserFunc f);
 
 
 /**
@@ -166,6 +253,32 @@ void mk_parser_configure_default(MkParserContext* parser, MkParserFunc f);
 void mk_parser_parse_character(MkParserContext* parser, const gchar c);
 
 
+/**
+ * Parse characters and update parser state accordingly. This is the same
+ * as calling mk_parser_parse_character() for each of them, only faster.
+ * @param parser object that contains parser state
+ * @param data   characters to parse
+ * @param length number of characters
+ */
+void mk_parser_parse_buffer(MkParserContext* parser,
+                            const gchar*     data,
+                            const gsize      length);
+
+
+/**
+ * Hand the next bytes of the input to a function as they are, instead of
+ * parsing them. Parsing resumes with the same table afterwards. Reading
+ * raw bytes ends at end of file, whether they were all read or not.
+ * @param parser the parser
+ * @param length number of bytes
+ * @param f      function to hand them to, called right away with no bytes
+ *               if length is 0
+ */
+void mk_parser_read_raw(MkParserContext* parser,
+                        gsize            length,
+                        MkParserRawFunc  f);
+
+
 /**
  * Append a character to a parser's current token.
  * @param parser the parser
@@ -198,7 +311,9 @@ void mk_parser_token_clear(MkParserContext* parser);
 
 
 /**
- * Get an array containing all the tokens except the current token.
+ * Get an array containing all the tokens except the current token. The
+ * array is NULL-terminated and remains valid until the token list is
+ * modified.
  * @param parser the parser
  * @return       all the tokens in the token list
  */
@@ -294,19 +409,23 @@ void mk_parser_escape_begin(MkParserContext* parser, gchar c, void* data);
 
 
 /**
- * Enable default behavior for a parser. Quoted strings ('") will be
+ * Enable default behavior in a table. Quoted strings ('") will be
  * added to the current token unparsed and single-line comments (#)
  * will be supported.
- * @param parser the parser
+ * @param table table to configure
  */
-void mk_parser_enable_defaults(MkParserContext* parser);
+void mk_parser_enable_defaults(MkParserTable* table);
 
 
 /**
- * Read an IO channel and parse every character until EOF.
+ * Read a block of up to MK_PARSER_BUFFER_SIZE bytes from an IO channel and
+ * parse it. The block is read from the channel's file descriptor into a
+ * buffer kept by the parser, bypassing the channel's own buffering and
+ * encoding.
  * @param source IO channel to read from
  * @param parser the parser
- * @return       whether the source must still be watched
+ * @return       whether the source must still be watched, which is FALSE
+ *               at end-of-file or if an error occurred
  */
 gboolean mk_parser_parse_channel(GIOChannel*      source,
                                  GIOCondition     unused,
@@ -314,7 +433,8 @@ gboolean mk_parser_parse_channel(GIOChannel*      source,
 
 
 /**
- * Read an input file and parse it.
+ * Read an input file and parse it. Regular files are mapped in memory
+ * rather than read.
  * @param parser   the parser
  * @param filename file to read
  */
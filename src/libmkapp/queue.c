@@ -0,0 +1,72 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include <glib.h>
+
+#include "queue.h"
+
+
+void mk_queue_init(MkQueue* queue, GDestroyNotify free)
+{
+    queue->stub.next = NULL;
+    queue->head      = &queue->stub;
+    queue->tail      = &queue->stub;
+    queue->free      = free;
+}
+
+
+void mk_queue_clear(MkQueue* queue)
+{
+    while (mk_queue_pop(queue) != NULL);
+
+    if (queue->head != &queue->stub && queue->free != NULL)
+        queue->free(queue->head);
+    mk_queue_init(queue, queue->free);
+}
+
+
+void mk_queue_push(MkQueue* queue, MkQueueLink* item)
+{
+    item->next = NULL;
+
+    // Publishing the link makes the item visible to the consumer, which
+    // never reads the tail.
+    g_atomic_pointer_set(&queue->tail->next, item);
+    queue->tail = item;
+}
+
+
+MkQueueLink* mk_queue_pop(MkQueue* queue)
+{
+    MkQueueLink* head = queue->head;
+    MkQueueLink* next = g_atomic_pointer_get(&head->next);
+
+    if (next == NULL)
+        return NULL;
+
+    // The item becomes the dummy. The producer does not use the previous
+    // dummy anymore, since it is not the last item.
+    queue->head = next;
+    if (head != &queue->stub && queue->free != NULL)
+        queue->free(head);
+
+    return next;
+}
+
+
+void mk_queue_foreach(MkQueue* queue, GFunc func, gpointer data)
+{
+    for (MkQueueLink* item = queue->head->next; item != NULL;
+         item = item->next)
+        func(item, data);
+}
@@ -0,0 +1,98 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+/**
+ * @file
+ * Lock-free single-producer, single-consumer queue.
+ *
+ * Items are linked through an MkQueueLink that must be their first member,
+ * so that pushing an item does not allocate anything. One thread pushes
+ * items and another one pops them, without locks: the only shared state
+ * is the link between the last item and the next one. The queue is
+ * unbounded, so pushing never blocks.
+ *
+ * The queue always holds a dummy item at its head. An item that is popped
+ * becomes the dummy: it stays valid until the next pop, which frees it.
+ */
+
+#ifndef __QUEUE_H__
+#define __QUEUE_H__
+
+#include <glib.h>
+
+
+/**
+ * Link to the next item of a queue.
+ * @brief Queue link.
+ */
+typedef struct MkQueueLink {
+    struct MkQueueLink* next; /// Next item, or NULL
+} MkQueueLink;
+
+
+/**
+ * Single-producer, single-consumer queue of items starting with an
+ * MkQueueLink.
+ * @brief SPSC queue.
+ */
+typedef struct {
+    MkQueueLink*   head;  /// Dummy item, owned by the consumer
+    MkQueueLink*   tail;  /// Last item, owned by the producer
+    MkQueueLink    stub;  /// Initial dummy item
+    GDestroyNotify free;  /// Function freeing items
+} MkQueue;
+
+
+/**
+ * Initialize an empty queue.
+ * @param queue the queue
+ * @param free  function freeing popped items, or NULL
+ */
+void mk_queue_init(MkQueue* queue, GDestroyNotify free);
+
+
+/**
+ * Free the items left in a queue. No thread may use the queue anymore.
+ * @param queue the queue
+ */
+void mk_queue_clear(MkQueue* queue);
+
+
+/**
+ * Add an item at the end of a queue. Only the producer thread may call
+ * this.
+ * @param queue the queue
+ * @param item  the item, starting with an MkQueueLink
+ */
+void mk_queue_push(MkQueue* queue, MkQueueLink* item);
+
+
+/**
+ * Take the first item of a queue. Only the consumer thread may call this.
+ * The item stays valid until the next call.
+ * @param queue the queue
+ * @return      the item, or NULL if the queue is empty
+ */
+MkQueueLink* mk_queue_pop(MkQueue* queue);
+
+
+/**
+ * Call a function for each item in a queue. Neither the producer nor the
+ * consumer may use the queue meanwhile.
+ * @param queue the queue
+ * @param func  function to call with each item
+ * @param data  data to pass to func
+ */
+void mk_queue_foreach(MkQueue* queue, GFunc func, gpointer data);
+
+#endif // __QUEUE_H__
@@ -0,0 +1,160 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "record.h"
+
+
+#define RECORD_MAGIC         "MKREC\0\0\1"
+#define RECORD_MAGIC_LENGTH  8
+#define RECORD_BUFFER_LENGTH (64 << 10)
+#define RECORD_MAX_NAME      G_MAXUINT16 // Longest name a header can give
+#define RECORD_MAX_LENGTH    G_MAXUINT32 // Most data a header can give
+
+
+/**
+ * Create a recorder for a file opened in the given mode.
+ * @param path file name
+ * @param mode fopen() mode
+ * @return     a new recorder, or NULL if the file could not be opened
+ */
+static MkRecorder* recorder_new(const gchar* path, const gchar* mode)
+{
+    FILE* file = fopen(path, mode);
+    if (file == NULL)
+        return NULL;
+
+    MkRecorder* recorder = g_malloc(sizeof(MkRecorder));
+    recorder->file    = file;
+    recorder->started = g_get_monotonic_time();
+    recorder->name    = g_string_new(NULL);
+    recorder->data    = g_string_new(NULL);
+
+    // Records are small and frequent: write them in large blocks
+    setvbuf(file, NULL, _IOFBF, RECORD_BUFFER_LENGTH);
+
+    return recorder;
+}
+
+
+MkRecorder* mk_recorder_new(const gchar* path)
+{
+    MkRecorder* recorder = recorder_new(path, "wb");
+
+    if (recorder != NULL)
+        fwrite(RECORD_MAGIC, 1, RECORD_MAGIC_LENGTH, recorder->file);
+
+    return recorder;
+}
+
+
+MkRecorder* mk_recorder_open(const gchar* path)
+{
+    MkRecorder* recorder = recorder_new(path, "rb");
+    gchar       magic[RECORD_MAGIC_LENGTH];
+
+    if (recorder != NULL
+        && (fread(magic, 1, RECORD_MAGIC_LENGTH, recorder->file)
+            != RECORD_MAGIC_LENGTH
+            || memcmp(magic, RECORD_MAGIC, RECORD_MAGIC_LENGTH))) {
+        mk_recorder_free(recorder);
+        return NULL;
+    }
+
+    return recorder;
+}
+
+
+void mk_recorder_free(MkRecorder* recorder)
+{
+    fclose(recorder->file);
+    g_string_free(recorder->name, TRUE);
+    g_string_free(recorder->data, TRUE);
+    g_free(recorder);
+}
+
+
+void mk_recorder_write(MkRecorder*  recorder,
+                       MkRecordType type,
+                       const gchar* name,
+                       const gchar* data,
+                       const gsize  length)
+{
+    MkRecordHeader header;
+    gsize name_length = strlen(name);
+    gsize written     = 0;
+
+    // A header giving fewer bytes than follow it would make the rest of
+    // the recording unreadable
+    if (name_length > RECORD_MAX_NAME) {
+        g_warning("Could not record data of %.32s...: name too long", name);
+        return;
+    }
+    if (type != MK_RECORD_CHUNK && length > RECORD_MAX_LENGTH) {
+        g_warning("Could not record a command of %s: too long", name);
+        return;
+    }
+
+    header.type        = type;
+    header.reserved    = 0;
+    header.name_length = name_length;
+    header.time        = g_get_monotonic_time() - recorder->started;
+
+    // Chunks are parts of a stream, which can be cut anywhere
+    do {
+        header.length = MIN(length - written, RECORD_MAX_LENGTH);
+
+        fwrite(&header, sizeof(header), 1, recorder->file);
+        fwrite(name, 1, name_length, recorder->file);
+        fwrite(data + written, 1, header.length, recorder->file);
+        written += header.length;
+    } while (written < length);
+}
+
+
+/**
+ * Read a number of bytes from a recording into a string.
+ * @param recorder the recorder
+ * @param string   where to store the bytes, nul-terminated
+ * @param length   number of bytes to read
+ * @return         whether all the bytes could be read
+ */
+static gboolean recorder_read_string(MkRecorder* recorder,
+                                     GString*    string,
+                                     gsize       length)
+{
+    g_string_set_size(string, length);
+    return fread(string->str, 1, length, recorder->file) == length;
+}
+
+
+gboolean mk_recorder_read(MkRecorder* recorder, MkRecord* record)
+{
+    MkRecordHeader header;
+
+    if (fread(&header, sizeof(header), 1, recorder->file) != 1
+        || !recorder_read_string(recorder, recorder->name, header.name_length)
+        || !recorder_read_string(recorder, recorder->data, header.length))
+        return FALSE;
+
+    record->type   = header.type;
+    record->time   = header.time;
+    record->name   = recorder->name->str;
+    record->data   = recorder->data->str;
+    record->length = header.length;
+
+    return TRUE;
+}
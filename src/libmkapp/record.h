@@ -0,0 +1,139 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+/**
+ * @file
+ * Traffic recordings.
+ *
+ * A recording is a binary log of the data routed between modules, written
+ * by mkapp's record command and read back by mkreplay. It starts with an
+ * 8-byte magic string followed by records, each made of a fixed-size
+ * header, the name of the module the record is about, then its data:
+ *  - chunk records hold data read from a module's standard output,
+ *  - command records hold commands obeyed from a module, with their
+ *    tokens separated by spaces.
+ *
+ * Timestamps are microseconds since the recording started. Integers are
+ * stored in host byte order: recordings are meant to be replayed on the
+ * machine they were made on.
+ */
+
+#ifndef __RECORD_H__
+#define __RECORD_H__
+
+#include <stdio.h>
+
+#include <glib.h>
+
+
+/**
+ * @brief Type of a recorded event.
+ */
+typedef enum {
+    MK_RECORD_CHUNK   = 1, /// Data read from a module
+    MK_RECORD_COMMAND = 2  /// Command obeyed from a module
+} MkRecordType;
+
+
+/**
+ * Header written before each record's name and data.
+ * @brief Record header.
+ */
+typedef struct {
+    guint8  type;        /// MkRecordType
+    guint8  reserved;    /// Always 0
+    guint16 name_length; /// Number of bytes in the module name
+    guint32 length;      /// Number of data bytes
+    gint64  time;        /// Microseconds since the recording started
+} MkRecordHeader;
+
+
+/**
+ * A record read back from a recording. Its name and data are only valid
+ * until the next call to mk_recorder_read().
+ * @brief Recorded event.
+ */
+typedef struct {
+    MkRecordType type;   /// Record type
+    gint64       time;   /// Microseconds since the recording started
+    const gchar* name;   /// Module name, nul-terminated
+    const gchar* data;   /// Data, nul-terminated
+    gsize        length; /// Number of data bytes
+} MkRecord;
+
+
+/**
+ * A recorder either appends records to a new recording or reads them back
+ * from an existing one.
+ * @brief Recording file.
+ */
+typedef struct {
+    FILE*    file;    /// Recording file
+    gint64   started; /// Monotonic time when the recording started
+    GString* name;    /// Name of the last record read
+    GString* data;    /// Data of the last record read
+} MkRecorder;
+
+
+/**
+ * Create a new recording. Existing files are overwritten.
+ * @param path file name
+ * @return     a new recorder that must be freed with mk_recorder_free(),
+ *             or NULL if the file could not be created
+ */
+MkRecorder* mk_recorder_new(const gchar* path);
+
+
+/**
+ * Open an existing recording to read it back.
+ * @param path file name
+ * @return     a new recorder that must be freed with mk_recorder_free(),
+ *             or NULL if the file could not be opened or is not a recording
+ */
+MkRecorder* mk_recorder_open(const gchar* path);
+
+
+/**
+ * Close a recording, writing any buffered record, and free the recorder.
+ * @param recorder the recorder
+ */
+void mk_recorder_free(MkRecorder* recorder);
+
+
+/**
+ * Append a record to a recording, timestamped with the current time.
+ * Chunks too long for one record are split into several. Commands too
+ * long for one record, and records of modules whose name is too long,
+ * are dropped with a warning.
+ * @param recorder the recorder
+ * @param type     record type
+ * @param name     name of the module the record is about
+ * @param data     record data
+ * @param length   number of data bytes
+ */
+void mk_recorder_write(MkRecorder*  recorder,
+                       MkRecordType type,
+                       const gchar* name,
+                       const gchar* data,
+                       const gsize  length);
+
+
+/**
+ * Read the next record from a recording.
+ * @param recorder the recorder
+ * @param record   where to store the record
+ * @return         FALSE at the end of the recording or if it is truncated
+ */
+gboolean mk_recorder_read(MkRecorder* recorder, MkRecord* record);
+
+#endif // __RECORD_H__
@@ -0,0 +1,170 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include <sys/types.h>
+#include <sys/mman.h>
+
+#include <glib.h>
+
+#include "spool.h"
+
+
+#define SPOOL_MIN_SIZE (1 << 20)
+
+
+/**
+ * Give the pages that were completely written or read between two offsets
+ * back to the kernel. The data stays in the file, but it no longer counts
+ * in our resident set.
+ * @param spool the spool
+ * @param start offset before writing or reading
+ * @param end   offset after writing or reading
+ */
+static void spool_release(MkSpool* spool, gsize start, gsize end)
+{
+    gsize page = sysconf(_SC_PAGESIZE);
+
+    start = start / page * page;
+    end   = end / page * page;
+
+    if (end > start)
+        madvise(spool->map + start, end - start, MADV_DONTNEED);
+}
+
+
+/**
+ * Resize the spool file and its mapping.
+ * @param spool the spool
+ * @param size  new size
+ * @return      whether the file could be resized
+ */
+static gboolean spool_resize(MkSpool* spool, gsize size)
+{
+    if (spool->map != NULL && munmap(spool->map, spool->size)) {
+        g_warning("Could not unmap spool file: %s", g_strerror(errno));
+        return FALSE;
+    }
+    spool->map = NULL;
+
+    if (ftruncate(spool->fd, size)) {
+        g_warning("Could not resize spool file: %s", g_strerror(errno));
+        return FALSE;
+    }
+
+    spool->map = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED,
+                      spool->fd, 0);
+    if (spool->map == MAP_FAILED) {
+        g_warning("Could not map spool file: %s", g_strerror(errno));
+        spool->map = NULL;
+        return FALSE;
+    }
+
+    spool->size = size;
+    return TRUE;
+}
+
+
+MkSpool* mk_spool_new(const gchar* dir, const gchar* name)
+{
+    gchar* base = g_strdup_printf("mkapp-%d-%s-XXXXXX", (gint)getpid(), name);
+    gchar* path = g_build_filename(dir, base, NULL);
+    g_free(base);
+
+    gint fd = g_mkstemp(path);
+    if (fd < 0) {
+        g_warning("Could not create spool file %s: %s",
+                  path, g_strerror(errno));
+        g_free(path);
+        return NULL;
+    }
+
+    // Nobody else needs to see the file: unlink it right away so that it
+    // disappears with us.
+    unlink(path);
+    g_free(path);
+
+    MkSpool* spool = g_malloc(sizeof(MkSpool));
+    spool->fd   = fd;
+    spool->map  = NULL;
+    spool->size = 0;
+    spool->head = 0;
+    spool->tail = 0;
+
+    if (!spool_resize(spool, SPOOL_MIN_SIZE)) {
+        mk_spool_free(spool);
+        return NULL;
+    }
+
+    return spool;
+}
+
+
+void mk_spool_free(MkSpool* spool)
+{
+    if (spool->map != NULL)
+        munmap(spool->map, spool->size);
+    close(spool->fd);
+    g_free(spool);
+}
+
+
+gboolean mk_spool_append(MkSpool* spool, const gchar* data, const gsize length)
+{
+    if (spool->tail + length > spool->size) {
+        gsize size = spool->size;
+        while (spool->tail + length > size)
+            size *= 2;
+        if (!spool_resize(spool, size))
+            return FALSE;
+    }
+
+    memcpy(spool->map + spool->tail, data, length);
+    spool_release(spool, spool->tail, spool->tail + length);
+    spool->tail += length;
+
+    return TRUE;
+}
+
+
+gsize mk_spool_length(MkSpool* spool)
+{
+    return spool->tail - spool->head;
+}
+
+
+const gchar* mk_spool_peek(MkSpool* spool, gsize* length)
+{
+    *length = spool->tail - spool->head;
+    return spool->map + spool->head;
+}
+
+
+void mk_spool_consume(MkSpool* spool, const gsize length)
+{
+    g_assert(spool->head + length <= spool->tail);
+
+    spool_release(spool, spool->head, spool->head + length);
+    spool->head += length;
+
+    // Start over at the beginning of the file once everything was read
+    if (spool->head == spool->tail) {
+        spool->head = 0;
+        spool->tail = 0;
+        if (spool->size > SPOOL_MIN_SIZE)
+            spool_resize(spool, SPOOL_MIN_SIZE);
+    }
+}
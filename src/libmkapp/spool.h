@@ -0,0 +1,99 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+/**
+ * @file
+ * Spool files.
+ *
+ * A spool is an append-only file, mapped in memory, that holds data
+ * waiting to be written to a module that is not running or that cannot
+ * keep up with its writers. Data is read back in the order it was
+ * appended.
+ */
+
+#ifndef __SPOOL_H__
+#define __SPOOL_H__
+
+#include <glib.h>
+
+
+/**
+ * The spool file is unlinked as soon as it is created, so nothing is
+ * left behind when the program exits. Its contents are accessed through
+ * a shared memory mapping that grows as data is appended.
+ *
+ * @brief Memory-mapped append-only spool file.
+ */
+typedef struct {
+    gint   fd;   /// Spool file descriptor
+    gchar* map;  /// Mapped file contents
+    gsize  size; /// Size of the file and of its mapping
+    gsize  head; /// Offset of the first byte not read yet
+    gsize  tail; /// Offset where the next byte will be appended
+} MkSpool;
+
+
+/**
+ * Create a new spool file.
+ * @param dir  directory to create the file in
+ * @param name name of the module the spool is for
+ * @return     a new spool that must be freed with mk_spool_free(), or
+ *             NULL if the file could not be created
+ */
+MkSpool* mk_spool_new(const gchar* dir, const gchar* name);
+
+
+/**
+ * Close a spool file and free its resources. Unread data is lost.
+ * @param spool the spool
+ */
+void mk_spool_free(MkSpool* spool);
+
+
+/**
+ * Append data to a spool file.
+ * @param spool  the spool
+ * @param data   data to append
+ * @param length number of data bytes
+ * @return       whether the data could be appended
+ */
+gboolean mk_spool_append(MkSpool* spool, const gchar* data, const gsize length);
+
+
+/**
+ * Get the number of bytes that have been appended but not read yet.
+ * @param spool the spool
+ * @return      number of unread bytes
+ */
+gsize mk_spool_length(MkSpool* spool);
+
+
+/**
+ * Get a pointer to the unread data. The pointer is only valid until the
+ * next call to mk_spool_append() or mk_spool_consume().
+ * @param spool  the spool
+ * @param length where to store the number of bytes available
+ * @return       the first unread byte
+ */
+const gchar* mk_spool_peek(MkSpool* spool, gsize* length);
+
+
+/**
+ * Mark data returned by mk_spool_peek() as read. When all the data has
+ * been read, the file is truncated to release disk space.
+ * @param spool  the spool
+ * @param length number of bytes read
+ */
+void mk_spool_consume(MkSpool* spool, const gsize length);
+
+#endif // __SPOOL_H__
@@ -59,8 +59,11 @@ void mk_key_value_write_file(GNode* root, const gchar* filename)
     GError* error = NULL;
     GIOChannel* chan = g_io_channel_new_file(filename, "w", &error);
 
-    if (error != NULL)
+    if (error != NULL) {
         g_critical("Error opening %s: %s", filename, error->message);
+        g_error_free(error);
+        return;
+    }
 
     mk_key_value_write_lines(NULL, root, chan);
 
@@ -88,8 +91,11 @@ gboolean mk_key_value_read_line(GNode*       root,
     GError* error = NULL;
     GRegex* regex = g_regex_new
         ("\\s*(\\w+)\\s*=\\s*(?:(?:\"(.*?)\")|(.*?))\\n?$", 0, 0, &error);
-    if (error != NULL)
+    if (error != NULL) {
         g_critical("could not compile regular expression: %s", error->message);
+        g_error_free(error);
+        return FALSE;
+    }
 
     GMatchInfo* match_info;
     g_regex_match(regex, line, 0, &match_info);
@@ -154,8 +160,11 @@ void mk_key_value_read_file(GNode* root,
 
     chan = g_io_channel_new_file(filename, "r", &error);
 
-    if (error != NULL)
+    if (error != NULL) {
         g_critical("Error opening %s: %s", filename, error->message);
+        g_error_free(error);
+        return;
+    }
 
     while ((status = g_io_channel_read_line(chan, &line, &length,
                                             NULL, &error))
@@ -165,8 +174,9 @@ void mk_key_value_read_file(GNode* root,
             g_strchomp(line);
 
         mk_key_value_read_line(root, line, NULL, NULL);
+        g_free(line);
     }
 
+    g_clear_error(&error);
     g_io_channel_unref(chan);
-    g_free(line);
 }
@@ -35,6 +35,22 @@ void mk_store_node_info_free(const GNode* node, MkNodeInfo* info)
     // Free value
     if (info->value != NULL)
         g_free(info->value);
+
+    g_free(info);
+}
+
+
+/**
+ * Free the information of a node while traversing a tree.
+ * @param node the node
+ * @param data unused
+ * @return     FALSE to go on traversing the tree
+ */
+static gboolean store_node_traverse_free(GNode* node, gpointer data)
+{
+    mk_store_node_info_free(node, node->data);
+    node->data = NULL;
+    return FALSE;
 }
 
 
@@ -44,8 +60,8 @@ void mk_store_node_free(GNode* node)
                     G_IN_ORDER,
                     G_TRAVERSE_ALL,
                     -1,
-                    (GNodeTraverseFunc)mk_store_node_info_free,
-                    node->data);
+                    store_node_traverse_free,
+                    NULL);
     g_node_destroy(node);
 }
 
@@ -58,8 +74,10 @@ GNode* mk_store_node_get_by_name(GNode*         root,
     GNode* node = NULL;
 
     // If we have reached the end of the name, stop.
-    if (tokens[0] == NULL)
+    if (tokens[0] == NULL) {
+        g_strfreev(tokens);
         return NULL;
+    }
 
     // Find the first part of name (before the next dot) under root.
     GNode* n = g_node_first_child(root);
@@ -44,7 +44,7 @@ GNode* mk_store_node_new(const gchar* name);
 
 
 /**
- * Free node information.
+ * Free node information, including the structure itself.
  * @param node the node
  * @param info the node info that must be freed
  */
@@ -0,0 +1,163 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "tap.h"
+
+
+#define TAP_FLUSH_PERIOD  1
+#define TAP_BAD_SAMPLING  "invalid sampling"
+#define TAP_OPEN_FAILED   "could not open tap file"
+
+
+gboolean mk_tap_parse_sampling(const gchar* sampling,
+                               guint*       every,
+                               gsize*       rate)
+{
+    gchar*  end;
+    guint64 n = g_ascii_strtoull(sampling, &end, 10);
+
+    if (end == sampling || end[0] != '/' || n == 0)
+        return FALSE;
+
+    *every = 0;
+    *rate  = 0;
+
+    // "BYTES/s"
+    if (!g_strcmp0(end, "/s")) {
+        *rate = n;
+        return TRUE;
+    }
+
+    // "1/N"
+    const gchar* denominator = end + 1;
+    guint64      d           = g_ascii_strtoull(denominator, &end, 10);
+
+    if (n != 1 || end == denominator || *end != '\0' || d == 0
+        || d > G_MAXUINT)
+        return FALSE;
+
+    *every = d;
+    return TRUE;
+}
+
+
+/**
+ * Flush the samples copied by a tap.
+ * @param tap the tap
+ * @return    TRUE to flush again later
+ */
+static gboolean tap_flush(MkTap* tap)
+{
+    fflush(tap->file);
+    return TRUE;
+}
+
+
+MkTap* mk_tap_new(gpointer      in,
+                  const gchar*  sampling,
+                  const gchar*  path,
+                  const gchar** error)
+{
+    guint every = 1;
+    gsize rate  = 0;
+
+    if (sampling != NULL && !mk_tap_parse_sampling(sampling, &every, &rate)) {
+        *error = TAP_BAD_SAMPLING;
+        return NULL;
+    }
+
+    FILE* file = path != NULL ? fopen(path, "a") : stdout;
+    if (file == NULL) {
+        *error = TAP_OPEN_FAILED;
+        return NULL;
+    }
+
+    MkTap* tap = g_malloc(sizeof(MkTap));
+    tap->in           = in;
+    tap->file         = file;
+    tap->every        = every;
+    tap->rate         = rate;
+    tap->tokens       = rate;
+    tap->refilled     = g_get_monotonic_time();
+    tap->lines        = 0;
+    tap->line_start   = TRUE;
+    tap->sampling     = FALSE;
+    tap->flush_source = g_timeout_add_seconds(TAP_FLUSH_PERIOD,
+                                              (GSourceFunc)tap_flush, tap);
+
+    return tap;
+}
+
+
+void mk_tap_free(MkTap* tap)
+{
+    g_source_remove(tap->flush_source);
+
+    if (tap->file != stdout)
+        fclose(tap->file);
+    else
+        fflush(tap->file);
+
+    g_free(tap);
+}
+
+
+/**
+ * Decide whether the line starting now is sampled.
+ * @param tap the tap
+ * @return    whether to copy the line
+ */
+static gboolean tap_sample_line(MkTap* tap)
+{
+    if (tap->every > 0)
+        return tap->lines++ % tap->every == 0;
+
+    // Token bucket holding up to a second's worth of bytes. A line is
+    // sampled whole as long as the budget is not exhausted.
+    gint64 now = g_get_monotonic_time();
+    tap->tokens  += tap->rate * (gdouble)(now - tap->refilled)
+                    / G_USEC_PER_SEC;
+    tap->refilled = now;
+    if (tap->tokens > tap->rate)
+        tap->tokens = tap->rate;
+
+    return tap->tokens > 0;
+}
+
+
+void mk_tap_write(MkTap* tap, const gchar* data, const gsize length)
+{
+    const gchar* end = data + length;
+
+    while (data < end) {
+        const gchar* eol  = memchr(data, '\n', end - data);
+        const gchar* next = eol != NULL ? eol + 1 : end;
+
+        if (tap->line_start)
+            tap->sampling = tap_sample_line(tap);
+
+        if (tap->sampling) {
+            fwrite(data, 1, next - data, tap->file);
+            if (tap->rate > 0)
+                tap->tokens -= next - data;
+        }
+
+        tap->line_start = eol != NULL;
+        data = next;
+    }
+}
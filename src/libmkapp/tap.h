@@ -0,0 +1,99 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+/**
+ * @file
+ * Sampled copies of the traffic on bindings.
+ *
+ * A tap copies a sample of the data going through a binding to a file or
+ * to the standard output, for live inspection of high-rate streams. Whole
+ * lines are sampled: either every Nth line, or as many lines as a byte
+ * budget per second allows. Samples are buffered and flushed once a
+ * second, rather than after each chunk like listened output, so that
+ * watching a stream disturbs it as little as possible.
+ */
+
+#ifndef __TAP_H__
+#define __TAP_H__
+
+#include <stdio.h>
+
+#include <glib.h>
+
+
+/**
+ * A tap is attached to a binding by the module providing the output.
+ * Bindings without a tap cost nothing.
+ * @brief Sampled copy of a binding's traffic.
+ */
+typedef struct {
+    gpointer in;           /// Module the tapped binding goes to
+    FILE*    file;         /// Where samples are copied
+    guint    every;        /// Sample every Nth line, or 0
+    gsize    rate;         /// Bytes sampled per second, or 0
+    gdouble  tokens;       /// Bytes that can be sampled now
+    gint64   refilled;     /// When tokens were last added
+    guint64  lines;        /// Number of lines seen
+    gboolean line_start;   /// Does the next data start a line?
+    gboolean sampling;     /// Is the current line sampled?
+    guint    flush_source; /// Timer flushing the file
+} MkTap;
+
+
+/**
+ * Parse a sampling specification:
+ *  - "1/N":     every Nth line,
+ *  - "BYTES/s": lines up to a number of bytes per second.
+ * @param sampling the specification
+ * @param every    where to store N, or 0
+ * @param rate     where to store BYTES, or 0
+ * @return         whether the specification is valid
+ */
+gboolean mk_tap_parse_sampling(const gchar* sampling,
+                               guint*       every,
+                               gsize*       rate);
+
+
+/**
+ * Create a tap.
+ * @param in       module the tapped binding goes to
+ * @param sampling sampling specification (see mk_tap_parse_sampling()), or
+ *                 NULL to copy every line
+ * @param path     file to append samples to, or NULL for the standard
+ *                 output
+ * @param error    where to store an error string if the tap cannot be
+ *                 created
+ * @return         a new tap, or NULL
+ */
+MkTap* mk_tap_new(gpointer      in,
+                  const gchar*  sampling,
+                  const gchar*  path,
+                  const gchar** error);
+
+
+/**
+ * Flush and free a tap.
+ * @param tap the tap
+ */
+void mk_tap_free(MkTap* tap);
+
+
+/**
+ * Copy the sampled lines of data going through a tapped binding.
+ * @param tap    the tap
+ * @param data   the data
+ * @param length number of data bytes
+ */
+void mk_tap_write(MkTap* tap, const gchar* data, const gsize length);
+
+#endif // __TAP_H__
@@ -87,8 +87,11 @@ MkTransition* mk_transition_lookup(GHashTable* table,
         MkTransition* t = g_ptr_array_index(array, i);
         GError* error = NULL;
         GRegex* regex = g_regex_new(t->signal, 0, 0, &error);
-        if (error != NULL)
+        if (error != NULL) {
             g_critical("regular expression error: %s", error->message);
+            g_clear_error(&error);
+            continue;
+        }
         
         GMatchInfo* match_info;
         gboolean matches = g_regex_match(regex, signal, 0, &match_info);
@@ -99,9 +102,11 @@ MkTransition* mk_transition_lookup(GHashTable* table,
                 *output = g_match_info_expand_references(match_info,
                                                          t->output,
                                                          &error);
-                if (error != NULL)
+                if (error != NULL) {
                     g_critical("error expanding output string: %s",
                                error->message);
+                    g_clear_error(&error);
+                }
             }
         }
 
@@ -128,4 +133,5 @@ void mk_transition_list_delete(GPtrArray* array)
     gint i;
     for(i = 0; i < array->len; ++i)
         mk_transition_delete(g_ptr_array_index(array, i));
+    g_ptr_array_free(array, TRUE);
 }
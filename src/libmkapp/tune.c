@@ -0,0 +1,483 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#define _GNU_SOURCE
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sched.h>
+#include <termios.h>
+
+#include <sys/types.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+
+#include <glib.h>
+
+#include "tune.h"
+
+
+#define TUNE_BAD_OPTION "unknown tuning option"
+#define TUNE_BAD_VALUE  "invalid tuning value"
+#define TUNE_BAD_CPU    "invalid CPU list"
+#define TUNE_BAD_SIZE   "invalid size"
+#define TUNE_NO_STDBUF  "libstdbuf not found"
+
+#define CGROUP_ROOT "/sys/fs/cgroup"
+
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+#define STDBUF_ENV "MKAPP_LIBSTDBUF"
+
+
+/**
+ * Where coreutils installs libstdbuf, depending on the distribution.
+ */
+static const gchar* m_stdbuf_paths[] = {
+    "/usr/libexec/coreutils/libstdbuf.so",
+    "/usr/lib/coreutils/libstdbuf.so",
+    "/usr/lib64/coreutils/libstdbuf.so",
+    "/usr/local/libexec/coreutils/libstdbuf.so",
+    NULL
+};
+
+
+/**
+ * Resource limits that can be set, by option name.
+ */
+static const struct {
+    const gchar* name;
+    gint         resource;
+} m_limits[] = {
+    { "as",      RLIMIT_AS      },
+    { "core",    RLIMIT_CORE    },
+    { "cpu",     RLIMIT_CPU     },
+    { "data",    RLIMIT_DATA    },
+    { "fsize",   RLIMIT_FSIZE   },
+    { "memlock", RLIMIT_MEMLOCK },
+    { "nofile",  RLIMIT_NOFILE  },
+    { "nproc",   RLIMIT_NPROC   },
+    { "rss",     RLIMIT_RSS     },
+    { "stack",   RLIMIT_STACK   },
+    { NULL }
+};
+
+
+MkTuning* mk_tuning_new(void)
+{
+    MkTuning* tuning = g_malloc(sizeof(MkTuning));
+
+    tuning->cpus          = NULL;
+    tuning->has_nice      = FALSE;
+    tuning->nice          = 0;
+    tuning->sched         = -1;
+    tuning->ioprio_class  = -1;
+    tuning->ioprio_level  = 0;
+    tuning->limits        = g_array_new(FALSE, FALSE, sizeof(MkLimit));
+    tuning->cgroup        = NULL;
+    tuning->cgroup_procs  = NULL;
+    tuning->cgroup_memory = NULL;
+    tuning->memory        = NULL;
+    tuning->stdout_mode   = MK_STDOUT_PIPE;
+    tuning->pty_slave     = -1;
+
+    return tuning;
+}
+
+
+void mk_tuning_free(MkTuning* tuning)
+{
+    if (tuning->cpus != NULL)
+        g_array_free(tuning->cpus, TRUE);
+    g_array_free(tuning->limits, TRUE);
+    g_free(tuning->cgroup);
+    g_free(tuning->cgroup_procs);
+    g_free(tuning->cgroup_memory);
+    g_free(tuning->memory);
+    g_free(tuning);
+}
+
+
+gboolean mk_tuning_parse_size(const gchar* s, guint64* value)
+{
+    if (!g_strcmp0(s, "unlimited")) {
+        *value = RLIM_INFINITY;
+        return TRUE;
+    }
+
+    gchar* end;
+    guint  shift = 0;
+
+    // Unlike strtoull(), no sign or leading space is accepted
+    if (!g_ascii_isdigit(*s))
+        return FALSE;
+
+    errno  = 0;
+    *value = g_ascii_strtoull(s, &end, 10);
+    if (errno == ERANGE)
+        return FALSE;
+
+    // Each unit multiplies the value by 1024 once more than the next one
+    switch (*end) {
+    case 'G': case 'g':
+        shift += 10;
+        // Fall through
+    case 'M': case 'm':
+        shift += 10;
+        // Fall through
+    case 'K': case 'k':
+        shift += 10;
+        ++end;
+    }
+
+    if (*value > G_MAXUINT64 >> shift)
+        return FALSE;
+    *value <<= shift;
+
+    return *end == '\0';
+}
+
+
+/**
+ * Find libstdbuf. The MKAPP_LIBSTDBUF environment variable takes
+ * precedence over the usual locations.
+ * @return the path of the library, or NULL if it is not installed
+ */
+static const gchar* tune_find_stdbuf(void)
+{
+    const gchar* path = g_getenv(STDBUF_ENV);
+    if (path != NULL)
+        return g_file_test(path, G_FILE_TEST_EXISTS) ? path : NULL;
+
+    for (gsize i = 0; m_stdbuf_paths[i] != NULL; ++i)
+        if (g_file_test(m_stdbuf_paths[i], G_FILE_TEST_EXISTS))
+            return m_stdbuf_paths[i];
+
+    return NULL;
+}
+
+
+/**
+ * Parse a CPU list such as "0-3,6".
+ * @param s    string to parse
+ * @param cpus array to add the CPU numbers to
+ * @return     whether s is a valid CPU list
+ */
+static gboolean tune_parse_cpus(const gchar* s, GArray* cpus)
+{
+    gchar** ranges = g_strsplit(s, ",", -1);
+    gboolean valid = ranges[0] != NULL;
+
+    for (gsize i = 0; valid && ranges[i] != NULL; ++i) {
+        gchar* end;
+        guint first = g_ascii_strtoull(ranges[i], &end, 10);
+        guint last  = first;
+
+        if (end == ranges[i])
+            valid = FALSE;
+        else if (*end == '-')
+            last = g_ascii_strtoull(end + 1, &end, 10);
+
+        if (*end != '\0' || last < first || last >= CPU_SETSIZE)
+            valid = FALSE;
+
+        for (guint cpu = first; valid && cpu <= last; ++cpu)
+            g_array_append_val(cpus, cpu);
+    }
+
+    g_strfreev(ranges);
+    return valid;
+}
+
+
+const gchar* mk_tuning_set(MkTuning* tuning, const gchar* option)
+{
+    const gchar* value = strchr(option, '=');
+    if (value == NULL)
+        return TUNE_BAD_OPTION;
+
+    gchar* key = g_strndup(option, value - option);
+    const gchar* error = NULL;
+    ++value;
+
+    if (!g_strcmp0(key, "cpus")) {
+        GArray* cpus = g_array_new(FALSE, FALSE, sizeof(guint));
+        if (tune_parse_cpus(value, cpus)) {
+            if (tuning->cpus != NULL)
+                g_array_free(tuning->cpus, TRUE);
+            tuning->cpus = cpus;
+        } else {
+            g_array_free(cpus, TRUE);
+            error = TUNE_BAD_CPU;
+        }
+
+    } else if (!g_strcmp0(key, "nice")) {
+        gchar* end;
+        gint64 nice = g_ascii_strtoll(value, &end, 10);
+        if (*value == '\0' || *end != '\0' || nice < -20 || nice > 19) {
+            error = TUNE_BAD_VALUE;
+        } else {
+            tuning->nice     = nice;
+            tuning->has_nice = TRUE;
+        }
+
+    } else if (!g_strcmp0(key, "sched")) {
+        if (!g_strcmp0(value, "other"))
+            tuning->sched = SCHED_OTHER;
+        else if (!g_strcmp0(value, "batch"))
+            tuning->sched = SCHED_BATCH;
+        else if (!g_strcmp0(value, "idle"))
+            tuning->sched = SCHED_IDLE;
+        else
+            error = TUNE_BAD_VALUE;
+
+    } else if (!g_strcmp0(key, "ionice")) {
+        gchar** parts = g_strsplit(value, ":", 2);
+        gint    class = 0;
+        gint    level = 4;
+        if (parts[1] != NULL) {
+            gchar* end;
+            level = g_ascii_strtoll(parts[1], &end, 10);
+            if (*parts[1] == '\0' || *end != '\0')
+                level = -1;
+        }
+        if (!g_strcmp0(parts[0], "rt"))
+            class = 1;
+        else if (!g_strcmp0(parts[0], "be"))
+            class = 2;
+        else if (!g_strcmp0(parts[0], "idle"))
+            class = 3;
+        if (class == 0 || level < 0 || level > 7) {
+            error = TUNE_BAD_VALUE;
+        } else {
+            tuning->ioprio_class = class;
+            tuning->ioprio_level = level;
+        }
+        g_strfreev(parts);
+
+    } else if (!g_strcmp0(key, "cgroup")) {
+        g_free(tuning->cgroup);
+        g_free(tuning->cgroup_procs);
+        g_free(tuning->cgroup_memory);
+        if (g_path_is_absolute(value))
+            tuning->cgroup = g_strdup(value);
+        else
+            tuning->cgroup = g_build_filename(CGROUP_ROOT, value, NULL);
+        tuning->cgroup_procs  = g_build_filename(tuning->cgroup,
+                                                 "cgroup.procs", NULL);
+        tuning->cgroup_memory = g_build_filename(tuning->cgroup,
+                                                 "memory.max", NULL);
+
+    } else if (!g_strcmp0(key, "memory")) {
+        guint64 size;
+        if (mk_tuning_parse_size(value, &size)) {
+            g_free(tuning->memory);
+            tuning->memory = (size == RLIM_INFINITY)
+                ? g_strdup("max")
+                : g_strdup_printf("%" G_GUINT64_FORMAT, size);
+        } else {
+            error = TUNE_BAD_SIZE;
+        }
+
+    } else if (!g_strcmp0(key, "stdout")) {
+        if (!g_strcmp0(value, "pipe"))
+            tuning->stdout_mode = MK_STDOUT_PIPE;
+        else if (!g_strcmp0(value, "pty"))
+            tuning->stdout_mode = MK_STDOUT_PTY;
+        else if (g_strcmp0(value, "line") && g_strcmp0(value, "unbuffered"))
+            error = TUNE_BAD_VALUE;
+        else if (tune_find_stdbuf() == NULL)
+            error = TUNE_NO_STDBUF;
+        else
+            tuning->stdout_mode = !g_strcmp0(value, "line")
+                ? MK_STDOUT_LINE : MK_STDOUT_UNBUFFERED;
+
+    } else {
+        error = TUNE_BAD_OPTION;
+        for (gsize i = 0; m_limits[i].name != NULL; ++i) {
+            if (g_strcmp0(key, m_limits[i].name))
+                continue;
+
+            MkLimit limit;
+            limit.resource = m_limits[i].resource;
+            error = mk_tuning_parse_size(value, &limit.value) ? NULL
+                                                         : TUNE_BAD_SIZE;
+            if (error == NULL)
+                g_array_append_val(tuning->limits, limit);
+            break;
+        }
+    }
+
+    g_free(key);
+    return error;
+}
+
+
+/**
+ * Report a setting that could not be applied, using only system calls.
+ * @param what name of the setting
+ */
+static void tune_report(const gchar* what)
+{
+    static const gchar prefix[] = "could not set ";
+    const gchar* reason = strerror(errno);
+
+    if (write(STDERR_FILENO, prefix, sizeof(prefix) - 1) < 0
+        || write(STDERR_FILENO, what, strlen(what)) < 0
+        || write(STDERR_FILENO, ": ", 2) < 0
+        || write(STDERR_FILENO, reason, strlen(reason)) < 0
+        || write(STDERR_FILENO, "\n", 1) < 0)
+        return;
+}
+
+
+/**
+ * Write a string to a file, using only system calls.
+ * @param path  file name
+ * @param value what to write
+ * @return      whether the whole string was written
+ */
+static gboolean tune_write_file(const gchar* path, const gchar* value)
+{
+    gint fd = open(path, O_WRONLY);
+    if (fd < 0)
+        return FALSE;
+
+    gsize length = strlen(value);
+    gboolean ok = write(fd, value, length) == (gssize)length;
+    close(fd);
+
+    return ok;
+}
+
+
+gchar** mk_tuning_environ(MkTuning* tuning)
+{
+    if (tuning == NULL || (tuning->stdout_mode != MK_STDOUT_LINE
+                           && tuning->stdout_mode != MK_STDOUT_UNBUFFERED))
+        return NULL;
+
+    const gchar* stdbuf = tune_find_stdbuf();
+    if (stdbuf == NULL)
+        return NULL;
+
+    // Keep the libraries already preloaded, if any
+    gchar**      env     = g_get_environ();
+    const gchar* preload = g_environ_getenv(env, "LD_PRELOAD");
+    gchar*       value   = preload != NULL && *preload != '\0'
+        ? g_strconcat(stdbuf, ":", preload, NULL)
+        : g_strdup(stdbuf);
+
+    env = g_environ_setenv(env, "LD_PRELOAD", value, TRUE);
+    env = g_environ_setenv(env, "_STDBUF_O",
+                           tuning->stdout_mode == MK_STDOUT_LINE ? "L" : "0",
+                           TRUE);
+    g_free(value);
+
+    return env;
+}
+
+
+gint mk_tuning_open_pty(MkTuning* tuning)
+{
+    if (tuning == NULL || tuning->stdout_mode != MK_STDOUT_PTY)
+        return -1;
+
+    gint master = posix_openpt(O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (master < 0)
+        return -1;
+
+    gint slave = -1;
+    if (!grantpt(master) && !unlockpt(master))
+        slave = open(ptsname(master), O_RDWR | O_NOCTTY | O_CLOEXEC);
+    if (slave < 0) {
+        close(master);
+        return -1;
+    }
+
+    // Pass the output through as is: no \r added before \n
+    struct termios attr;
+    if (!tcgetattr(slave, &attr)) {
+        cfmakeraw(&attr);
+        tcsetattr(slave, TCSANOW, &attr);
+    }
+
+    tuning->pty_slave = slave;
+    return master;
+}
+
+
+void mk_tuning_close_pty(MkTuning* tuning)
+{
+    if (tuning != NULL && tuning->pty_slave >= 0) {
+        close(tuning->pty_slave);
+        tuning->pty_slave = -1;
+    }
+}
+
+
+void mk_tuning_apply(MkTuning* tuning)
+{
+    // The pty is not closed on exec once duplicated
+    if (tuning->pty_slave >= 0 && dup2(tuning->pty_slave, STDOUT_FILENO) < 0)
+        tune_report("stdout");
+
+    if (tuning->cgroup != NULL) {
+        // Writing "0" to cgroup.procs moves the writing process
+        if (tuning->memory != NULL
+            && !tune_write_file(tuning->cgroup_memory, tuning->memory))
+            tune_report("memory");
+        if (!tune_write_file(tuning->cgroup_procs, "0"))
+            tune_report("cgroup");
+    }
+
+    if (tuning->cpus != NULL) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        for (guint i = 0; i < tuning->cpus->len; ++i)
+            CPU_SET(g_array_index(tuning->cpus, guint, i), &set);
+        if (sched_setaffinity(0, sizeof(set), &set))
+            tune_report("cpus");
+    }
+
+    if (tuning->sched >= 0) {
+        struct sched_param param;
+        param.sched_priority = 0;
+        if (sched_setscheduler(0, tuning->sched, &param))
+            tune_report("sched");
+    }
+
+    if (tuning->has_nice && setpriority(PRIO_PROCESS, 0, tuning->nice))
+        tune_report("nice");
+
+    if (tuning->ioprio_class >= 0) {
+        gint ioprio = (tuning->ioprio_class << IOPRIO_CLASS_SHIFT)
+                      | tuning->ioprio_level;
+        if (syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, ioprio))
+            tune_report("ionice");
+    }
+
+    for (guint i = 0; i < tuning->limits->len; ++i) {
+        MkLimit* limit = &g_array_index(tuning->limits, MkLimit, i);
+        struct rlimit rl;
+        rl.rlim_cur = limit->value;
+        rl.rlim_max = limit->value;
+        if (setrlimit(limit->resource, &rl))
+            tune_report("limit");
+    }
+}
@@ -0,0 +1,165 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+/**
+ * @file
+ * Process tuning.
+ *
+ * A tuning is a set of scheduling and resource settings (CPU affinity,
+ * priority, I/O priority, resource limits and control group) applied to a
+ * module's process when it is spawned, just before its command is executed.
+ *
+ * Settings are given as "option=value" strings:
+ *  - cpus=LIST:        CPUs the process may run on (e.g. "0-3,6")
+ *  - nice=N:           nice value, from -20 to 19
+ *  - sched=POLICY:     scheduling policy: other, batch or idle
+ *  - ionice=CLASS[:N]: I/O scheduling class (rt, be or idle) and level
+ *  - cgroup=PATH:      control group v2 directory to move the process to,
+ *                      absolute or relative to /sys/fs/cgroup
+ *  - memory=SIZE:      memory.max of that control group
+ *  - as, core, cpu, data, fsize, memlock, nofile, nproc, rss, stack=N:
+ *                      resource limits (see setrlimit(2)), or "unlimited"
+ *  - stdout=MODE:      buffering of the process's standard output: pipe
+ *                      (the default), line or unbuffered, or pty
+ *
+ * Sizes accept a K, M or G suffix.
+ *
+ * Most programs fully buffer their standard output when it is a pipe. The
+ * line and unbuffered modes preload coreutils' libstdbuf, as stdbuf(1)
+ * does, which changes the buffering of programs using stdio. The pty mode
+ * connects standard output to a pseudo-terminal instead, which programs
+ * flush on every line whatever library they use.
+ */
+
+#ifndef __TUNE_H__
+#define __TUNE_H__
+
+#include <glib.h>
+
+
+/**
+ * Resource limit to set with setrlimit().
+ * @brief Resource limit.
+ */
+typedef struct {
+    gint    resource; /// RLIMIT_... constant
+    guint64 value;    /// Soft and hard limit
+} MkLimit;
+
+
+/**
+ * How a process's standard output is connected and buffered.
+ * @brief Standard output mode.
+ */
+typedef enum {
+    MK_STDOUT_PIPE,       /// Pipe, buffered as the program sees fit
+    MK_STDOUT_LINE,       /// Pipe, line buffered by libstdbuf
+    MK_STDOUT_UNBUFFERED, /// Pipe, unbuffered by libstdbuf
+    MK_STDOUT_PTY         /// Pseudo-terminal
+} MkStdoutMode;
+
+
+/**
+ * Settings that are applied to a process before it executes its command.
+ * Unset values are left as inherited from mkapp.
+ *
+ * @brief Process tuning settings.
+ */
+typedef struct {
+    GArray*  cpus;          /// CPUs to run on (guint), or NULL
+    gboolean has_nice;      /// Is nice set?
+    gint     nice;          /// Nice value
+    gint     sched;         /// Scheduling policy, or -1
+    gint     ioprio_class;  /// I/O scheduling class, or -1
+    gint     ioprio_level;  /// I/O priority within the class
+    GArray*  limits;        /// Resource limits (MkLimit)
+    gchar*   cgroup;        /// Control group directory, or NULL
+    gchar*   cgroup_procs;  /// cgroup.procs file in that directory
+    gchar*   cgroup_memory; /// memory.max file in that directory
+    gchar*   memory;        /// Value to write to memory.max, or NULL
+    gint     stdout_mode;   /// Standard output mode (MkStdoutMode)
+    gint     pty_slave;     /// Terminal side of the pty while spawning, or -1
+} MkTuning;
+
+
+/**
+ * Create a new tuning with nothing set.
+ * @return a new tuning that must be freed with mk_tuning_free()
+ */
+MkTuning* mk_tuning_new(void);
+
+
+/**
+ * Free a tuning.
+ * @param tuning the tuning
+ */
+void mk_tuning_free(MkTuning* tuning);
+
+
+/**
+ * Parse a size with an optional K, M or G suffix, or "unlimited".
+ * @param s     string to parse
+ * @param value where to store the size
+ * @return      whether s is a valid size that fits in 64 bits
+ */
+gboolean mk_tuning_parse_size(const gchar* s, guint64* value);
+
+
+/**
+ * Set one of a tuning's options.
+ * @param tuning the tuning
+ * @param option an "option=value" string
+ * @return       an error string, or NULL if the option was set
+ */
+const gchar* mk_tuning_set(MkTuning* tuning, const gchar* option);
+
+
+/**
+ * Get the environment to spawn a process with, so that libstdbuf is
+ * preloaded if the tuning requires it.
+ * @param tuning the tuning, or NULL
+ * @return       a new environment to free with g_strfreev(), or NULL to
+ *               inherit mkapp's
+ */
+gchar** mk_tuning_environ(MkTuning* tuning);
+
+
+/**
+ * Open a pseudo-terminal for the standard output of the next process
+ * spawned with the tuning, if it requires one. Its terminal side is
+ * connected by mk_tuning_apply(), and must be closed with
+ * mk_tuning_close_pty() once the process is spawned.
+ * @param tuning the tuning, or NULL
+ * @return       the controlling side of the pseudo-terminal, to read the
+ *               process's output from, or -1 if there is none
+ */
+gint mk_tuning_open_pty(MkTuning* tuning);
+
+
+/**
+ * Close the terminal side of a pseudo-terminal opened with
+ * mk_tuning_open_pty(), once the process is spawned.
+ * @param tuning the tuning, or NULL
+ */
+void mk_tuning_close_pty(MkTuning* tuning);
+
+
+/**
+ * Apply a tuning to the current process. This is meant to be called in a
+ * child process between fork() and exec(), so it only makes system calls.
+ * Settings that cannot be applied are reported on standard error.
+ * @param tuning the tuning
+ */
+void mk_tuning_apply(MkTuning* tuning);
+
+#endif // __TUNE_H__
@@ -0,0 +1,157 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <glib.h>
+
+#include "usage.h"
+
+
+#define PROC_BUFFER_LENGTH 4096
+
+
+/**
+ * Read a small file from /proc into a buffer.
+ * @param pid    process ID
+ * @param name   file name under /proc/PID
+ * @param buffer where to store the nul-terminated file contents
+ * @return       whether the file could be read
+ */
+static gboolean usage_read_proc(GPid pid, const gchar* name, gchar* buffer)
+{
+    gchar path[64];
+    g_snprintf(path, sizeof(path), "/proc/%d/%s", (gint)pid, name);
+
+    gint fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return FALSE;
+
+    gssize length = read(fd, buffer, PROC_BUFFER_LENGTH - 1);
+    close(fd);
+    if (length <= 0)
+        return FALSE;
+
+    buffer[length] = '\0';
+    return TRUE;
+}
+
+
+/**
+ * Find a "Key: value" line in /proc/PID/status and parse its value.
+ * @param status contents of the status file
+ * @param key    key, including the colon
+ * @return       the value, or -1 if the key was not found
+ */
+static glong usage_status_value(const gchar* status, const gchar* key)
+{
+    const gchar* line = strstr(status, key);
+    if (line == NULL)
+        return -1;
+
+    return g_ascii_strtoll(line + strlen(key), NULL, 10);
+}
+
+
+void mk_usage_start(MkUsage* usage)
+{
+    usage->started      = g_get_monotonic_time();
+    usage->exited       = 0;
+    usage->user_time    = 0;
+    usage->system_time  = 0;
+    usage->rss          = 0;
+    usage->max_rss      = 0;
+    usage->nvcsw        = 0;
+    usage->nivcsw       = 0;
+    usage->cpu_percent  = 0;
+    usage->rate_in      = 0;
+    usage->rate_out     = 0;
+    usage->sampled      = usage->started;
+    usage->sampled_time = 0;
+    usage->sampled_in   = usage->bytes_in;
+    usage->sampled_out  = usage->bytes_out;
+}
+
+
+void mk_usage_sample(MkUsage* usage, GPid pid)
+{
+    gchar buffer[PROC_BUFFER_LENGTH];
+    gint64 now = g_get_monotonic_time();
+
+    // CPU times are the 14th and 15th fields of /proc/PID/stat. The
+    // command name (2nd field) can contain spaces: start after it.
+    if (usage_read_proc(pid, "stat", buffer)) {
+        const gchar* fields = strrchr(buffer, ')');
+        gulong utime, stime;
+
+        if (fields != NULL
+            && sscanf(fields + 1, " %*c %*d %*d %*d %*d %*d %*u %*u %*u "
+                      "%*u %*u %lu %lu", &utime, &stime) == 2) {
+            gdouble ticks = sysconf(_SC_CLK_TCK);
+            usage->user_time   = utime / ticks;
+            usage->system_time = stime / ticks;
+        }
+    }
+
+    if (usage_read_proc(pid, "status", buffer)) {
+        usage->rss     = usage_status_value(buffer, "VmRSS:");
+        usage->max_rss = usage_status_value(buffer, "VmHWM:");
+        usage->nvcsw   = usage_status_value(buffer,
+                                            "\nvoluntary_ctxt_switches:");
+        usage->nivcsw  = usage_status_value(buffer,
+                                            "nonvoluntary_ctxt_switches:");
+    }
+
+    // Rates over the interval since the previous sample
+    gdouble interval = (now - usage->sampled) / (gdouble)G_USEC_PER_SEC;
+    gdouble cpu_time = usage->user_time + usage->system_time;
+
+    if (interval > 0) {
+        usage->cpu_percent = 100 * (cpu_time - usage->sampled_time) / interval;
+        usage->rate_in     = (usage->bytes_in - usage->sampled_in) / interval;
+        usage->rate_out    = (usage->bytes_out - usage->sampled_out) / interval;
+    }
+
+    usage->sampled      = now;
+    usage->sampled_time = cpu_time;
+    usage->sampled_in   = usage->bytes_in;
+    usage->sampled_out  = usage->bytes_out;
+}
+
+
+void mk_usage_exit(MkUsage* usage, const struct rusage* ru)
+{
+    usage->exited      = g_get_monotonic_time();
+    usage->user_time   = ru->ru_utime.tv_sec + ru->ru_utime.tv_usec / 1e6;
+    usage->system_time = ru->ru_stime.tv_sec + ru->ru_stime.tv_usec / 1e6;
+    usage->rss         = 0;
+    usage->max_rss     = ru->ru_maxrss;
+    usage->nvcsw       = ru->ru_nvcsw;
+    usage->nivcsw      = ru->ru_nivcsw;
+    usage->cpu_percent = 0;
+    usage->rate_in     = 0;
+    usage->rate_out    = 0;
+}
+
+
+gdouble mk_usage_uptime(const MkUsage* usage)
+{
+    if (usage->started == 0)
+        return 0;
+
+    gint64 end = usage->exited != 0 ? usage->exited : g_get_monotonic_time();
+    return (end - usage->started) / (gdouble)G_USEC_PER_SEC;
+}
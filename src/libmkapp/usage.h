@@ -0,0 +1,92 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+/**
+ * @file
+ * Process resource accounting.
+ *
+ * The resources used by a running process are sampled from /proc. When
+ * the process exits, the final figures are taken from the rusage structure
+ * returned by wait4(). Routing rates are computed between samples from
+ * byte counters maintained by the caller.
+ */
+
+#ifndef __USAGE_H__
+#define __USAGE_H__
+
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include <glib.h>
+
+
+/**
+ * Resources used by a process and data routed to and from it.
+ * CPU times are in seconds, memory sizes in kilobytes, rates in bytes per
+ * second and timestamps in microseconds of monotonic time.
+ *
+ * @brief Process resource usage.
+ */
+typedef struct {
+    gint64  started;        /// When the process started, or 0
+    gint64  exited;         /// When the process exited, or 0
+    gdouble user_time;      /// CPU time spent in user mode
+    gdouble system_time;    /// CPU time spent in kernel mode
+    glong   rss;            /// Resident set size
+    glong   max_rss;        /// Maximum resident set size
+    glong   nvcsw;          /// Voluntary context switches
+    glong   nivcsw;         /// Involuntary context switches
+    gdouble cpu_percent;    /// CPU usage during the last interval
+    guint64 bytes_in;       /// Bytes written to the process
+    guint64 bytes_out;      /// Bytes read from the process
+    gdouble rate_in;        /// Input rate during the last interval
+    gdouble rate_out;       /// Output rate during the last interval
+    gint64  sampled;        /// When the last sample was taken
+    gdouble sampled_time;   /// CPU time at the last sample
+    guint64 sampled_in;     /// bytes_in at the last sample
+    guint64 sampled_out;    /// bytes_out at the last sample
+} MkUsage;
+
+
+/**
+ * Reset usage figures when a process starts. Byte counters are kept.
+ * @param usage the usage figures
+ */
+void mk_usage_start(MkUsage* usage);
+
+
+/**
+ * Update usage figures from /proc for a running process.
+ * @param usage the usage figures
+ * @param pid   process ID
+ */
+void mk_usage_sample(MkUsage* usage, GPid pid);
+
+
+/**
+ * Record the final usage figures of a process that has exited.
+ * @param usage the usage figures
+ * @param ru    resource usage returned by wait4()
+ */
+void mk_usage_exit(MkUsage* usage, const struct rusage* ru);
+
+
+/**
+ * Get the number of seconds a process has been running, or ran for if it
+ * has exited.
+ * @param usage the usage figures
+ * @return      uptime in seconds
+ */
+gdouble mk_usage_uptime(const MkUsage* usage);
+
+#endif // __USAGE_H__
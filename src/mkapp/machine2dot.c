@@ -170,6 +170,7 @@ int main(int argc, char* argv[])
     g_option_context_add_main_entries(context, entries, NULL);
     if (!g_option_context_parse(context, &argc, &argv, &error))
         g_critical("%s", error->message);
+    g_option_context_free(context);
 
     if (version) {
         g_printf("%s %s\n", PACKAGE_NAME, PACKAGE_VERSION);
@@ -183,7 +184,7 @@ int main(int argc, char* argv[])
 
     // Parse the state machine definition
     transitions = g_hash_table_new_full
-        (g_str_hash, g_str_equal, NULL,
+        (g_str_hash, g_str_equal, (GDestroyNotify)g_free,
          (GDestroyNotify)mk_transition_list_delete);
     MkParserContext* parser = mk_machine_parser_new(transitions);
     mk_parser_parse_file(parser, files[0]);
@@ -207,5 +208,8 @@ int main(int argc, char* argv[])
     g_hash_table_foreach(transitions, (GHFunc)transitions2dot, NULL);
     g_printf("}\n");
 
-    g_free(files);
+    mk_machine_parser_free(parser);
+    g_hash_table_destroy(transitions);
+    g_free(default_state);
+    g_strfreev(files);
 }
@@ -17,6 +17,7 @@
 
 #include <unistd.h>
 #include <stdlib.h>
+#include <string.h>
 
 #include <glib.h>
 #include <glib/gprintf.h>
@@ -39,10 +40,14 @@ MkParserContext* m_parser    = NULL; // Text file parser
  * Command-line options.
  */
 
-gchar**  m_files    = NULL;  // Input files
-gboolean m_version  = FALSE; // Obtain version information ?
-gboolean m_verbose  = FALSE; // Be verbose ?
-gchar*   m_commands = NULL;  // Commands from the command line
+gchar**  m_files        = NULL;  // Input files
+gboolean m_version      = FALSE; // Obtain version information ?
+gboolean m_verbose      = FALSE; // Be verbose ?
+gchar*   m_commands     = NULL;  // Commands from the command line
+gchar*   m_spool_dir    = NULL;  // Directory for spool files
+gint64   m_spool_budget = -1;    // Bytes of pending data kept in memory
+gint     m_loops        = 0;     // Number of worker loops
+gboolean m_no_cache     = FALSE; // Do not use compiled files ?
 
 static GOptionEntry m_options[] = {
     { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY,
@@ -53,6 +58,16 @@ static GOptionEntry m_options[] = {
       (gpointer)&m_verbose, "Be verbose", NULL },
     { "command", 'c', 0, G_OPTION_ARG_STRING,
       (gpointer)&m_commands, "Process commands from a string", NULL },
+    { "spool-dir", 0, 0, G_OPTION_ARG_FILENAME,
+      (gpointer)&m_spool_dir, "Create spool files in DIR", "DIR" },
+    { "spool-budget", 0, 0, G_OPTION_ARG_INT64,
+      (gpointer)&m_spool_budget,
+      "Keep at most BYTES of pending data in memory", "BYTES" },
+    { "loops", 'l', 0, G_OPTION_ARG_INT,
+      (gpointer)&m_loops, "Route data between modules from N threads", "N" },
+    { "no-cache", 0, 0, G_OPTION_ARG_NONE,
+      (gpointer)&m_no_cache,
+      "Always parse files, without using or saving compiled ones", NULL },
     { NULL }
 };
 
@@ -67,10 +82,7 @@ static void do_nothing() {}
  */
 int main(int argc, char* argv[])
 {
-    // Initialize the thread system. We don't use threads: this is a
-    // workaround to make glib's g_child_watch_add more reliable when
-    // SIGCHLD is caught between the moment when the main loop checks
-    // all its sources and the moment when it poll()s its FDs.
+    // Initialize the thread system, used by worker loops (see --loops)
     g_thread_init(NULL);
 
     // Make critical errors fatal to abort when they happen
@@ -100,21 +112,28 @@ int main(int argc, char* argv[])
     // Initialize the main loop, the module context and the parser
     m_main_loop = g_main_loop_new(NULL, TRUE);
     m_modules   = mk_module_context_new(m_main_loop);
+    if (m_spool_dir != NULL || m_spool_budget >= 0)
+        mk_module_set_spool(m_modules, m_spool_dir,
+                            m_spool_budget >= 0 ? m_spool_budget
+                                                : m_modules->spool_budget);
+    if (m_loops > 0)
+        mk_module_set_loops(m_modules, m_loops);
     m_parser    = mk_app_parser_new(m_modules);
     mk_module_set_interpreter(m_modules,
-                              (MkModuleInterpreter)mk_parser_parse_character,
+                              (MkModuleInterpreter)mk_app_parser_interpret,
                               m_parser);
+    mk_module_set_obey_end(m_modules,
+                           (MkModuleObeyEnd)mk_app_parser_obey_end);
 
     // Choose where to read commands from.
     if (m_commands != NULL) {
         // Parse commands from the command line?
-        for (gsize i = 0; m_commands[i] != 0; ++i)
-            mk_parser_parse_character(m_parser, m_commands[i]);
+        mk_parser_parse_buffer(m_parser, m_commands, strlen(m_commands));
 
     } else if (m_files != NULL) {
         // Parse input files?
         for (gsize i = 0; m_files[i] != NULL; ++i)
-            mk_parser_parse_file(m_parser, m_files[i]);
+            mk_app_parser_parse_file(m_parser, m_files[i], !m_no_cache);
 
     } else {
         // Read standard input.
@@ -122,6 +141,7 @@ int main(int argc, char* argv[])
         g_io_channel_set_flags(chan, G_IO_FLAG_NONBLOCK, NULL);
         g_io_add_watch(chan, G_IO_IN | G_IO_ERR | G_IO_HUP,
                        (GIOFunc)mk_parser_parse_channel, m_parser);
+        g_io_channel_unref(chan);
     }
 
     // Start the main lo
@@ -129,4 +149,11 @@ int main(int argc, char* argv[])
         g_debug("Starting main loop...");
         g_main_loop_run(m_main_loop);
     }
+
+    mk_app_parser_free(m_parser);
+    mk_module_context_free(m_modules);
+    g_main_loop_unref(m_main_loop);
+    g_strfreev(m_files);
+    g_free(m_commands);
+    g_free(m_spool_dir);
 }
@@ -235,7 +235,7 @@ int main(int argc, char* argv[])
     mk_parser_parse_file(m_parser, m_files[0]);
     m_current_state = g_strdup(mk_machine_parser_get_default_state(m_parser));
 
-    g_free(m_files);
+    g_strfreev(m_files);
 
     // Create an IO channel for stdin and start a main loop to handle it.
     GIOChannel* chan = g_io_channel_unix_new(STDIN_FILENO);
@@ -243,4 +243,10 @@ int main(int argc, char* argv[])
     g_io_add_watch(chan, G_IO_IN | G_IO_ERR | G_IO_HUP, read_input, NULL); 
     m_main_loop = g_main_loop_new(NULL, TRUE);
     g_main_loop_run(m_main_loop);
+
+    g_main_loop_unref(m_main_loop);
+    g_io_channel_unref(chan);
+    mk_machine_parser_free(m_parser);
+    g_hash_table_destroy(m_transitions);
+    g_free(m_current_state);
 }
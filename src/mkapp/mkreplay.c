@@ -0,0 +1,324 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ * 
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+/**
+ * Replay a recording made with mkapp's record command.
+ *
+ * The modules of an mkapp file are started as usual, except the ones whose
+ * output was recorded: their recorded output is routed to their listeners
+ * instead, either as fast as possible or at its original timing. Statistics
+ * about the replay are printed on standard error when all the modules have
+ * exited.
+ */
+
+#include <unistd.h>
+#include <stdlib.h>
+
+#include <glib.h>
+#include <glib/gprintf.h>
+
+#include "parser.h"
+#include "mkapp_parser.h"
+#include "module.h"
+#include "record.h"
+
+#define PACKAGE_NAME         "mkreplay"
+#define PACKAGE_VERSION      "0.1"
+#define PACKAGE_PARAM_STRING "FILE RECORDING - replay recorded traffic"
+
+#define REPLAY_BATCH 64 // Records routed per main loop iteration
+
+
+/**
+ * Replay progress and statistics.
+ */
+typedef struct {
+    MkRecorder* recorder;   // Recording being replayed
+    MkRecord    record;     // Next record to route
+    gboolean    has_record; // Has the next record been read already?
+    gint64      started;    // When the replay started
+    gint64      finished;   // When the last record was routed, or 0
+    guint64     chunks;     // Number of chunks routed
+    guint64     bytes;      // Number of bytes routed
+    guint64     commands;   // Number of obeyed commands in the recording
+    guint64     skipped;    // Number of chunks of modules not replayed
+    gint64      lag_total;  // Sum of the delays in routing chunks
+    gint64      lag_max;    // Longest delay in routing a chunk
+} Replay;
+
+
+GMainLoop*       m_main_loop = NULL; // Glib main loop
+MkModuleContext* m_modules   = NULL; // Modules that make up the app
+MkParserContext* m_parser    = NULL; // Text file parser
+Replay           m_replay;           // Replay state
+
+
+/*
+ * Command-line options.
+ */
+
+gchar**  m_files   = NULL;  // App file and recording
+gchar**  m_sources = NULL;  // Modules to replay
+gboolean m_version = FALSE; // Obtain version information ?
+gboolean m_verbose = FALSE; // Be verbose ?
+gboolean m_timing  = FALSE; // Replay at the original timing ?
+
+static GOptionEntry m_options[] = {
+    { G_OPTION_REMAINING, 0, 0, G_OPTION_ARG_FILENAME_ARRAY,
+      (gpointer)&m_files, "Module definitions file and recording", NULL },
+    { "version", 'V', 0, G_OPTION_ARG_NONE,
+      (gpointer)&m_version, "Print version information", NULL },
+    { "verbose", 'v', 0, G_OPTION_ARG_NONE,
+      (gpointer)&m_verbose, "Be verbose", NULL },
+    { "timing", 't', 0, G_OPTION_ARG_NONE,
+      (gpointer)&m_timing, "Replay at the original timing", NULL },
+    { "source", 's', 0, G_OPTION_ARG_STRING_ARRAY,
+      (gpointer)&m_sources,
+      "Replay the output of MODULE (default: recorded modules that "
+      "listen to no other module)",
+      "MODULE" },
+    { NULL }
+};
+
+
+/**
+ * Do nothing.
+ */
+static void do_nothing() {}
+
+
+/**
+ * Choose the modules whose output is replayed, so that they are not
+ * started when the mkapp file is parsed: those given with --source, or by
+ * default the recorded modules that do not listen to other modules.
+ * @param path recording file name
+ */
+static void find_sources(const gchar* path)
+{
+    if (m_sources != NULL) {
+        for (gsize i = 0; m_sources[i] != NULL; ++i)
+            mk_module_set_replayed(m_modules, m_sources[i], TRUE);
+        return;
+    }
+
+    MkRecorder* recorder = mk_recorder_open(path);
+    MkRecord    record;
+
+    if (recorder == NULL)
+        g_critical("Could not read recording %s", path);
+
+    while (mk_recorder_read(recorder, &record))
+        if (record.type == MK_RECORD_CHUNK)
+            mk_module_set_replayed(m_modules, record.name, FALSE);
+
+    mk_recorder_free(recorder);
+}
+
+
+/**
+ * Close the standard input of all the modules once the whole recording
+ * has been routed, and quit when they have all exited.
+ */
+static void replay_finish(void)
+{
+    m_replay.finished = g_get_monotonic_time();
+
+    GList* modules = g_hash_table_get_values(m_modules->modules);
+    for (GList* m = modules; m != NULL; m = m->next)
+        if (mk_module_is_running(m->data))
+            mk_module_eof(m->data);
+    g_list_free(modules);
+
+    mk_module_eof_received(m_modules);
+}
+
+
+/**
+ * Route a chunk to the listeners of the module it was read from, unless
+ * that module is running and producing its own output.
+ * @param record the chunk
+ * @param lag    how late the chunk is routed, in microseconds
+ */
+static void replay_chunk(MkRecord* record, gint64 lag)
+{
+    MkModule* module = mk_module_lookup(m_modules, record->name);
+
+    if (module == NULL || mk_module_is_running(module)) {
+        ++m_replay.skipped;
+        return;
+    }
+
+    mk_module_write_to_listeners(module, record->data, record->length);
+
+    ++m_replay.chunks;
+    m_replay.bytes     += record->length;
+    m_replay.lag_total += lag;
+    m_replay.lag_max    = MAX(m_replay.lag_max, lag);
+}
+
+
+static void replay_schedule(gint64 delay);
+
+/**
+ * Route the next records. When replaying at the original timing, stop at
+ * the first record that is not due yet.
+ * @param data unused
+ * @return     FALSE: the next call is scheduled by replay_schedule()
+ */
+static gboolean replay_next(gpointer data)
+{
+    for (gint i = 0; i < REPLAY_BATCH; ++i) {
+        if (!m_replay.has_record
+            && !mk_recorder_read(m_replay.recorder, &m_replay.record)) {
+            replay_finish();
+            return FALSE;
+        }
+        m_replay.has_record = TRUE;
+
+        gint64 lag = 0;
+        if (m_timing) {
+            lag = g_get_monotonic_time() - m_replay.started
+                  - m_replay.record.time;
+            if (lag < 0) {
+                replay_schedule(-lag);
+                return FALSE;
+            }
+        }
+
+        if (m_replay.record.type == MK_RECORD_CHUNK)
+            replay_chunk(&m_replay.record, lag);
+        else
+            ++m_replay.commands;
+
+        m_replay.has_record = FALSE;
+    }
+
+    replay_schedule(0);
+    return FALSE;
+}
+
+
+/**
+ * Schedule the routing of the next records, leaving the main loop a
+ * chance to write the data already routed.
+ * @param delay microseconds to wait before routing
+ */
+static void replay_schedule(gint64 delay)
+{
+    if (delay > 0)
+        g_timeout_add((delay + 999) / 1000, replay_next, NULL);
+    else
+        g_idle_add(replay_next, NULL);
+}
+
+
+/**
+ * Print replay statistics on standard error.
+ */
+static void replay_report(void)
+{
+    gint64 end = g_get_monotonic_time();
+    if (m_replay.finished == 0)
+        m_replay.finished = end;
+
+    gdouble elapsed = (m_replay.finished - m_replay.started)
+                      / (gdouble)G_USEC_PER_SEC;
+    gdouble drain   = (end - m_replay.finished) / (gdouble)G_USEC_PER_SEC;
+
+    g_fprintf(stderr, "%s: %" G_GUINT64_FORMAT " chunks, %" G_GUINT64_FORMAT
+              " bytes, %" G_GUINT64_FORMAT " commands in %.3f s\n",
+              PACKAGE_NAME, m_replay.chunks, m_replay.bytes,
+              m_replay.commands, elapsed);
+    if (m_replay.skipped > 0)
+        g_fprintf(stderr, "%s: %" G_GUINT64_FORMAT " chunks skipped\n",
+                  PACKAGE_NAME, m_replay.skipped);
+    if (elapsed > 0)
+        g_fprintf(stderr, "%s: throughput %.2f MB/s, %.0f chunks/s\n",
+                  PACKAGE_NAME, m_replay.bytes / elapsed / 1e6,
+                  m_replay.chunks / elapsed);
+    if (m_timing && m_replay.chunks > 0)
+        g_fprintf(stderr, "%s: routing lag avg %.3f ms, max %.3f ms\n",
+                  PACKAGE_NAME,
+                  m_replay.lag_total / (gdouble)m_replay.chunks / 1000,
+                  m_replay.lag_max / 1000.0);
+    g_fprintf(stderr, "%s: drained in %.3f s\n", PACKAGE_NAME, drain);
+}
+
+
+/**
+ * Main.
+ */
+int main(int argc, char* argv[])
+{
+    // See mkapp.c
+    g_thread_init(NULL);
+
+    // Make critical errors fatal to abort when they happen
+    g_log_set_always_fatal(G_LOG_LEVEL_CRITICAL);
+
+    // Read command-line arguments
+    GError* error = NULL;
+    GOptionContext* context;
+    context = g_option_context_new(PACKAGE_PARAM_STRING);
+    g_option_context_add_main_entries(context, m_options, NULL);
+    g_option_context_parse(context, &argc, &argv, &error);
+    g_option_context_free(context);
+    if (error != NULL)
+        g_critical("%s", error->message);
+
+    // If verbosity was not requested, block debug messages.
+    if (!m_verbose)
+        g_log_set_handler(NULL, G_LOG_LEVEL_DEBUG,
+                          (GLogFunc)do_nothing, NULL);
+
+    // Print version info and exit?
+    if (m_version) {
+        g_printf("%s %s\n", PACKAGE_NAME, PACKAGE_VERSION);
+        exit(EXIT_SUCCESS);
+    }
+
+    if (m_files == NULL || m_files[0] == NULL || m_files[1] == NULL)
+        g_critical("Usage: %s %s", PACKAGE_NAME, PACKAGE_PARAM_STRING);
+
+    // Initialize the main loop, the module context and the parser. The
+    // end of the mkapp file is not the end of the session: the replay is.
+    m_main_loop = g_main_loop_new(NULL, TRUE);
+    m_modules   = mk_module_context_new(m_main_loop);
+    m_parser    = mk_app_parser_new(m_modules);
+    mk_parser_set_eof_func(m_parser, (MkParserFunc)do_nothing);
+    mk_module_set_interpreter(m_modules,
+                              (MkModuleInterpreter)mk_app_parser_interpret,
+                              m_parser);
+    mk_module_set_obey_end(m_modules,
+                           (MkModuleObeyEnd)mk_app_parser_obey_end);
+
+    // Start the modules, except those that are replayed
+    find_sources(m_files[1]);
+    mk_parser_parse_file(m_parser, m_files[0]);
+
+    // Replay
+    m_replay.recorder = mk_recorder_open(m_files[1]);
+    m_replay.started  = g_get_monotonic_time();
+    replay_schedule(0);
+
+    g_debug("Starting main loop...");
+    g_main_loop_run(m_main_loop);
+
+    replay_report();
+    mk_recorder_free(m_replay.recorder);
+
+    mk_app_parser_free(m_parser);
+    mk_module_context_free(m_modules);
+    g_main_loop_unref(m_main_loop);
+    g_strfreev(m_files);
+}
@@ -0,0 +1,256 @@
+/*
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License as
+ * published by the Free Software Foundation; either version 2 of
+ * the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * General Public License for more details at
+ * http://www.gnu.org/copyleft/gpl.html
+ */
+
+/**
+ * Check that parsing a buffer at once gives the same tokens as parsing it
+ * one character at a time.
+ *
+ * mk_parser_parse_buffer() skips runs of appended or ignored characters
+ * with the widest scan the processor has (32, then 16 characters at a
+ * time, then one), while mk_parser_parse_character() looks every character
+ * up in its table. Both are run on the standard input and on generated
+ * buffers of every length up to SCAN_MAX_LENGTH, with a stop character at
+ * each offset, so that every block boundary and buffer tail of the scans
+ * is covered, with and without non-ASCII characters in the stop set. The
+ * tokens of the standard input are printed, and the first buffer parsed
+ * differently, if any, is reported on standard error.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <glib.h>
+#include <glib/gprintf.h>
+
+#include "parser.h"
+
+#define PACKAGE_NAME         "mkscan"
+#define PACKAGE_VERSION      "0.1"
+#define PACKAGE_PARAM_STRING "- check the parser's character scans"
+
+#define SCAN_MAX_LENGTH 96   // Longest generated buffer
+#define SCAN_RANDOM     4096 // Number of random buffers
+#define SCAN_SEED       1    // Seed of the random buffers
+
+
+MkParserTable* m_append_table = NULL; // Non-ASCII characters appended
+MkParserTable* m_cut_table    = NULL; // Non-ASCII characters cutting tokens
+
+// Characters with a function of their own in both tables, followed by
+// non-ASCII ones, which the scans must tell apart from ASCII ones
+static const gchar m_stops[] = " \t\n;\"'#\\\x80\xa0\xc3\xff";
+
+
+/**
+ * Print the tokens parsed so far, one per line, and clear them. Each
+ * command ends with an empty line.
+ * @param parser the parser
+ * @param c      character that ended the command
+ * @param out    where the tokens are printed
+ */
+static void scan_end(MkParserContext* parser, gchar c, GString* out)
+{
+    mk_parser_token_cut(parser);
+
+    const gchar** tokens = mk_parser_token_get(parser);
+    for (gsize i = 0; tokens[i] != NULL; ++i)
+        g_string_append_printf(out, "%s\n", tokens[i]);
+    g_string_append_c(out, '\n');
+
+    mk_parser_token_clear(parser);
+}
+
+
+/**
+ * Configure the common part of the tables: words separated by blanks,
+ * commands by semicolons and newlines, with quotes, escapes and comments.
+ * @param table the table
+ */
+static void scan_build_common(MkParserTable* table)
+{
+    mk_parser_configure_default(table, (MkParserFunc)mk_parser_token_append);
+    mk_parser_configure_all(table, " \t", (MkParserFunc)mk_parser_token_cut);
+    mk_parser_configure_all(table, ";\n", (MkParserFunc)scan_end);
+    mk_parser_enable_defaults(table);
+}
+
+
+/**
+ * Configure the table appending non-ASCII characters, which the scans
+ * then run over.
+ * @param table the table
+ */
+static void scan_build_append(MkParserTable* table)
+{
+    scan_build_common(table);
+}
+
+
+/**
+ * Configure the table cutting tokens at non-ASCII characters, which the
+ * scans then stop at.
+ * @param table the table
+ */
+static void scan_build_cut(MkParserTable* table)
+{
+    scan_build_common(table);
+    mk_parser_configure(table, MK_PARSER_FIRST_CHAR,
+                        (MkParserFunc)mk_parser_token_cut);
+}
+
+
+/**
+ * Parse a buffer and get its tokens.
+ * @param table  table to parse the buffer with
+ * @param data   the buffer
+ * @param length number of characters in the buffer
+ * @param whole  TRUE to parse the buffer at once, FALSE to parse it one
+ *               character at a time
+ * @return       the tokens, to free with g_string_free()
+ */
+static GString* scan_parse(const MkParserTable* table,
+                           const gchar*         data,
+                           gsize                length,
+                           gboolean             whole)
+{
+    GString*         out    = g_string_new("");
+    MkParserContext* parser = mk_parser_new(table, out);
+
+    if (whole) {
+        mk_parser_parse_buffer(parser, data, length);
+    } else {
+        for (gsize i = 0; i < length; ++i)
+            mk_parser_parse_character(parser, data[i]);
+    }
+
+    // Tokens of an unfinished command are printed as well, with the depth
+    // the parser was left at, to compare the state of quotes and comments
+    scan_end(parser, '\n', out);
+    g_string_append_printf(out, "%u\n", (guint)parser->depth);
+
+    mk_parser_free(parser);
+    return out;
+}
+
+
+/**
+ * Parse a buffer with both tables, at once and one character at a time,
+ * and report it if the tokens differ.
+ * @param data   the buffer
+ * @param length number of characters in the buffer
+ * @return       TRUE if the tokens are the same
+ */
+static gboolean scan_check(const gchar* data, gsize length)
+{
+    const MkParserTable* tables[] = {
+        mk_parser_table_once(&m_append_table, scan_build_append),
+        mk_parser_table_once(&m_cut_table, scan_build_cut)
+    };
+
+    for (gsize t = 0; t < G_N_ELEMENTS(tables); ++t) {
+        GString* whole = scan_parse(tables[t], data, length, TRUE);
+        GString* chars = scan_parse(tables[t], data, length, FALSE);
+        gboolean same  = g_string_equal(whole, chars);
+
+        if (!same) {
+            g_fprintf(stderr, "%s: buffer of %u characters parsed"
+                      " differently:\n", PACKAGE_NAME, (guint)length);
+            for (gsize i = 0; i < length; ++i)
+                g_fprintf(stderr, " %02x", (guchar)data[i]);
+            g_fprintf(stderr, "\n");
+        }
+
+        g_string_free(whole, TRUE);
+        g_string_free(chars, TRUE);
+        if (!same)
+            return FALSE;
+    }
+
+    return TRUE;
+}
+
+
+/**
+ * Parse generated buffers: runs of appended characters with one stop
+ * character at each offset, then random mixes of all the characters.
+ * @return TRUE if all the buffers were parsed the same way
+ */
+static gboolean scan_generated()
+{
+    gchar    data[SCAN_MAX_LENGTH];
+    GRand*   rand = g_rand_new_with_seed(SCAN_SEED);
+    gsize    n    = sizeof(m_stops) - 1;
+    gboolean ok   = TRUE;
+
+    for (gsize length = 0; ok && length <= SCAN_MAX_LENGTH; ++length) {
+        memset(data, 'a', length);
+        ok = scan_check(data, length);
+
+        for (gsize i = 0; ok && i < length; ++i) {
+            for (gsize s = 0; ok && s < n; ++s) {
+                data[i] = m_stops[s];
+                ok = scan_check(data, length);
+            }
+            data[i] = 'a';
+        }
+    }
+
+    for (gsize r = 0; ok && r < SCAN_RANDOM; ++r) {
+        gsize length = g_rand_int_range(rand, 0, SCAN_MAX_LENGTH + 1);
+
+        // Stop characters are rare, so that long runs are scanned too
+        for (gsize i = 0; i < length; ++i) {
+            if (g_rand_int_range(rand, 0, 8) == 0)
+                data[i] = m_stops[g_rand_int_range(rand, 0, n)];
+            else
+                data[i] = 'a' + g_rand_int_range(rand, 0, 26);
+        }
+        ok = scan_check(data, length);
+    }
+
+    g_rand_free(rand);
+    return ok;
+}
+
+
+int main(int argc, char** argv)
+{
+    GError*         error   = NULL;
+    GOptionContext* context = g_option_context_new(PACKAGE_PARAM_STRING);
+
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        g_fprintf(stderr, "%s: %s\n", PACKAGE_NAME, error->message);
+        return EXIT_FAILURE;
+    }
+    g_option_context_free(context);
+
+    GString* input = g_string_new("");
+    gchar    buffer[4096];
+    gsize    length;
+
+    while ((length = fread(buffer, 1, sizeof(buffer), stdin)) > 0)
+        g_string_append_len(input, buffer, length);
+
+    gboolean ok = scan_check(input->str, input->len) && scan_generated();
+
+    if (ok) {
+        const MkParserTable* table =
+            mk_parser_table_once(&m_append_table, scan_build_append);
+        GString* out = scan_parse(table, input->str, input->len, TRUE);
+        fwrite(out->str, 1, out->len, stdout);
+        g_string_free(out, TRUE);
+    }
+
+    g_string_free(input, TRUE);
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
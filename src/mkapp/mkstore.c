@@ -94,6 +94,7 @@ gboolean translate_match(const GMatchInfo* match_info,
         }
     }
 
+    g_free(key);
     return FALSE;
 }
 
@@ -274,6 +275,7 @@ int main(int argc, char* argv[])
     g_option_context_add_main_entries(context, entries, NULL);
     if (!g_option_context_parse(context, &argc, &argv, &error))
         g_critical("%s", error->message);
+    g_option_context_free(context);
 
     if (m_version) {
         g_printf("%s %s\n", PACKAGE_NAME, PACKAGE_VERSION);
@@ -301,4 +303,9 @@ int main(int argc, char* argv[])
     m_main_loop = g_main_loop_new(NULL, TRUE);
 
     g_main_loop_run(m_main_loop);
+
+    g_main_loop_unref(m_main_loop);
+    g_io_channel_unref(chan);
+    mk_store_node_free(m_tree);
+    g_strfreev(m_files);
 }
@@ -0,0 +1,157 @@
+#!/bin/bash
+# This program is free software; you can redistribute it and/or
+# modify it under the terms of the GNU General Public License as
+# published by the Free Software Foundation; either version 2 of
+# the License, or (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful, but
+# WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+# General Public License for more details at
+# http://www.gnu.org/copyleft/gpl.html
+#
+#
+# Soak test. mkapp is driven with a long stream of commands while a
+# source module routes chunks through a relay to a sink. Every round of
+# commands defines, binds, tunes, unbinds and undefines a module and
+# writes a line to the sink, so that parsing, command execution and module
+# lifetimes are all exercised.
+#
+# The resident set size of mkapp is sampled 5 times a second. Once warmed up,
+# it must stay flat: the test fails if the highest RSS seen during the
+# second half of the run exceeds the highest one seen during the first
+# half by more than the tolerance.
+#
+# Usage: soak.sh [-n ROUNDS] [-c CHUNKS] [-t KIB] [-w SECONDS]
+#  -n ROUNDS   rounds of commands (default 200000, 6 commands per round)
+#  -c CHUNKS   lines routed from the source (default 1000000)
+#  -t KIB      RSS growth tolerance in KiB (default 2048)
+#  -w SECONDS  warm-up time not taken into account (default 1)
+#
+# The mkapp executable and library can be chosen with the MKAPP and
+# LIB_DIR environment variables. SOAK_WRAPPER is prepended to the mkapp
+# command line to run it under a memory checker, for instance:
+#   SOAK_WRAPPER="valgrind --leak-check=full --error-exitcode=1" \
+#       soak.sh -n 10000 -c 10000
+# An mkapp built with -fsanitize=address fails on exit if memory leaked.
+#
+
+set -e
+
+TEST_DIR=$(cd "$(dirname "$0")" && pwd)
+MKAPP=${MKAPP:-$TEST_DIR/../src/mkapp/mkapp}
+LIB_DIR=${LIB_DIR:-$TEST_DIR/../src/libmkapp}
+
+ROUNDS=200000
+CHUNKS=1000000
+TOLERANCE=2048
+WARMUP=1
+
+while getopts "n:c:t:w:" OPT; do
+    case $OPT in
+        n) ROUNDS=$OPTARG ;;
+        c) CHUNKS=$OPTARG ;;
+        t) TOLERANCE=$OPTARG ;;
+        w) WARMUP=$OPTARG ;;
+        *) exit 1 ;;
+    esac
+done
+
+TMP=$(mktemp -d /tmp/mksoak.XXXXXX)
+
+cleanup() {
+    rm -rf "$TMP"
+}
+
+trap cleanup EXIT INT TERM
+
+export LD_LIBRARY_PATH="$LIB_DIR"
+
+
+# Print the commands driving mkapp. The relay and the sink are closed once
+# the source is done, which ends the session.
+commands() {
+    cat <<EOF
+define source sh -c "yes 'soak chunk 0123456789abcdef' | head -n $CHUNKS; \
+touch $TMP/source.done";
+define relay cat;
+define sink builtin:grep -v .;
+bind source relay;
+bind relay sink;
+run sink;
+run relay;
+run source;
+EOF
+
+    awk -v rounds="$ROUNDS" 'BEGIN {
+        for (i = 0; i < rounds; ++i) {
+            print "define round builtin:grep round;";
+            print "bind sink round;";
+            print "tune round nice=1;";
+            print "unbind sink round;";
+            print "undefine round;";
+            print "write sink round " i ";";
+        }
+    }'
+
+    while [ ! -e "$TMP/source.done" ]; do
+        sleep 0.1
+    done
+    echo "eof relay;"
+    echo "eof sink;"
+}
+
+
+# Print the resident set size of a process in KiB, or nothing if it has
+# exited.
+rss() {
+    awk '/^VmRSS:/ { print $2 }' "/proc/$1/status" 2>/dev/null || true
+}
+
+
+commands | $SOAK_WRAPPER "$MKAPP" 2> "$TMP/mkapp.err" &
+PID=$!
+
+STARTED=$SECONDS
+while kill -0 $PID 2>/dev/null; do
+    SAMPLE=$(rss $PID)
+    if [ -n "$SAMPLE" ] && ((SECONDS - STARTED >= WARMUP)); then
+        echo "$SAMPLE" >> "$TMP/rss"
+    fi
+    sleep 0.2
+done
+
+STATUS=0
+wait $PID || STATUS=$?
+ELAPSED=$((SECONDS - STARTED))
+
+if [ $STATUS -ne 0 ]; then
+    echo "mkapp failed with status $STATUS:" >&2
+    tail -n 20 "$TMP/mkapp.err" >&2
+    exit 1
+fi
+
+touch "$TMP/rss"
+read -r SAMPLES FIRST SECOND < <(awk '
+    { rss[NR] = $1 }
+    END {
+        for (i = 1; i <= NR; ++i)
+            if (i <= NR / 2) { if (rss[i] > first) first = rss[i] }
+            else if (rss[i] > second) second = rss[i]
+        print NR, first + 0, second + 0
+    }' "$TMP/rss")
+
+echo "rounds: $ROUNDS, chunks: $CHUNKS, time: ${ELAPSED}s, samples: $SAMPLES"
+echo "max. RSS: ${FIRST} KiB (first half), ${SECOND} KiB (second half)"
+
+if [ "$SAMPLES" -lt 4 ]; then
+    echo "Not enough RSS samples: increase the number of rounds." >&2
+    exit 1
+fi
+
+if ((SECOND - FIRST > TOLERANCE)); then
+    echo "RSS grew by $((SECOND - FIRST)) KiB (tolerance: $TOLERANCE KiB)." >&2
+    exit 1
+fi
+
+echo "RSS is flat."